@@ -4,7 +4,7 @@
 #include "rtweekend.h"
 #include <algorithm>
 
-int argmax(const std::vector<double>& vec) {
+int argmax(const std::vector<real>& vec) {
     return std::distance(vec.begin(), std::max_element(vec.begin(), vec.end()));
 }
 
@@ -36,13 +36,16 @@ class AABB {
             return x;
         }
 
-        bool hit(const Ray& r, Interval ray_t) const {
+        bool hit(const Ray& r, Interval ray_t) const { return clip_ray(r, ray_t); }
+
+        // hit(), narrowing ray_t to the part of the ray inside the box
+        bool clip_ray(const Ray& r, Interval& ray_t) const {
             const point4& ray_o = r.o();
             const point4& ray_d = r.d();
 
             for (int axis = 0; axis < 3; axis++) {
                 const Interval& ax = axis_interval(axis);
-                const double adinv = 1.0 / ray_d[axis];
+                const real adinv = 1.0 / ray_d[axis];
                 // t_ = min/max(x_ - Q_) / adinv_ 
                 auto t0 = (ax.min - ray_o[axis]) * adinv;
                 auto t1 = (ax.max - ray_o[axis]) * adinv;
@@ -68,12 +71,45 @@ class AABB {
             return argmax({x.size(), y.size(), z.size()});
         }
 
+        bool is_empty() const {
+            return x.min > x.max || y.min > y.max || z.min > z.max;
+        }
+
+        double surface_area() const {
+            // empty boxes contribute nothing to SAH costs
+            if (is_empty()) return 0.0;
+            return 2.0 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+        }
+
+        double centroid(int n) const {
+            const Interval& ax = axis_interval(n);
+            return 0.5 * (ax.min + ax.max);
+        }
+
+        // overlap of two boxes (empty if disjoint); unlike the other
+        // constructors, no padding is applied
+        static AABB intersection(const AABB& a, const AABB& b) {
+            AABB box;
+            box.x = Interval(std::fmax(a.x.min, b.x.min), std::fmin(a.x.max, b.x.max));
+            box.y = Interval(std::fmax(a.y.min, b.y.min), std::fmin(a.y.max, b.y.max));
+            box.z = Interval(std::fmax(a.z.min, b.z.min), std::fmin(a.z.max, b.z.max));
+            return box;
+        }
+
+        // portion of the box on one side of an axis-aligned plane
+        AABB clip(int n, double lo, double hi) const {
+            AABB box = *this;
+            Interval& ax = (n == 1) ? box.y : (n == 2) ? box.z : box.x;
+            ax = Interval(std::fmax(ax.min, lo), std::fmin(ax.max, hi));
+            return box;
+        }
+
         static const AABB empty, universe;
     private:
 
         void pad_to_minimums() {
             // adjust AABB such that no side is narrower than some delta
-            double delta = 0.0001;
+            real delta = 0.0001;
             if (x.size() < delta) x = x.expand(delta);
             if (y.size() < delta) y = y.expand(delta);
             if (z.size() < delta) z = z.expand(delta);
@@ -92,4 +128,12 @@ AABB operator+(const vec4& offset, const AABB& bbox) {
     return bbox + offset;
 }
 
+// for motion bounds: box swept linearly from a (t=0) to b (t=1)
+inline AABB lerp(const AABB& a, const AABB& b, double t) {
+    return AABB(
+        Interval((1-t) * a.x.min + t * b.x.min, (1-t) * a.x.max + t * b.x.max),
+        Interval((1-t) * a.y.min + t * b.y.min, (1-t) * a.y.max + t * b.y.max),
+        Interval((1-t) * a.z.min + t * b.z.min, (1-t) * a.z.max + t * b.z.max));
+}
+
 #endif
\ No newline at end of file
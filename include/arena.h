@@ -0,0 +1,110 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Bump allocator over large blocks. Allocation is a pointer increment and
+// nothing is freed on its own: reset() rewinds the arena (keeping its blocks
+// for reuse) and the destructor returns every block at once. Not thread-safe;
+// use one arena per thread.
+class Arena {
+    public:
+        explicit Arena(size_t block_size = 256 * 1024) : block_size(block_size) {}
+        ~Arena() { for (auto& b : blocks) delete[] b.data; }
+
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        void* allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+            while (current < blocks.size()) {
+                Block& b = blocks[current];
+                size_t start = (offset + align - 1) & ~(align - 1);
+                if (start + bytes <= b.size) {
+                    offset = start + bytes;
+                    used += bytes;
+                    return b.data + start;
+                }
+                current++; // doesn't fit; later blocks (kept from before a reset) may
+                offset = 0;
+            }
+            // oversized requests get a block of their own
+            size_t size = std::max(block_size, bytes + align);
+            blocks.push_back(Block{new char[size], size});
+            current = blocks.size() - 1;
+            offset = 0;
+            return allocate(bytes, align);
+        }
+
+        // everything allocated so far is dead after this
+        void reset() {
+            current = 0;
+            offset = 0;
+            used = 0;
+        }
+
+        size_t bytes_used() const { return used; }
+        size_t bytes_reserved() const {
+            size_t total = 0;
+            for (const auto& b : blocks) total += b.size;
+            return total;
+        }
+
+    private:
+        struct Block {
+            char* data;
+            size_t size;
+        };
+
+        size_t block_size;
+        std::vector<Block> blocks;
+        size_t current = 0; // block being bumped
+        size_t offset = 0;
+        size_t used = 0;
+};
+
+// Standard allocator over an Arena, for containers and allocate_shared.
+// deallocate() is a no-op; the memory goes back with the arena.
+template <typename T>
+class ArenaAllocator {
+    public:
+        typedef T value_type;
+
+        explicit ArenaAllocator(Arena& arena) : arena(&arena) {}
+        template <typename U>
+        ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+        T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+        void deallocate(T*, size_t) {}
+
+        template <typename U>
+        bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+        template <typename U>
+        bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+    private:
+        template <typename U> friend class ArenaAllocator;
+        Arena* arena;
+};
+
+// Arena for everything the scene functions build: primitives, materials,
+// textures, BVH nodes. Each object shares one allocation with its
+// shared_ptr control block, so the scene packs into a few large blocks.
+// Destructors still run when the last reference goes; the memory is
+// released in bulk at exit. Scene construction is single-threaded.
+inline Arena& scene_arena() {
+    static Arena arena(1 << 20);
+    return arena;
+}
+
+template <typename T, typename... Args>
+inline std::shared_ptr<T> make_scene_shared(Args&&... args) {
+    return std::allocate_shared<T>(ArenaAllocator<T>(scene_arena()), std::forward<Args>(args)...);
+}
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef BOX_H
+#define BOX_H
+
+#include "hittable.h"
+
+// Rectangular box hit with a single slab test. The box lives in a local frame
+// (center + three orthonormal axes), so the same class covers axis-aligned
+// boxes and rotated ones without a Rotate/Translate wrapper.
+//
+// Face uvs match the six-quad box() this replaces. As a light it samples only
+// the faces that can be seen from the shading point.
+class Box final : public Hittable {
+  public:
+    // axis-aligned box with opposite corners a and b
+    Box(const point4& a, const point4& b, shared_ptr<Material> mat)
+      : Box(0.5 * (a + b), 0.5 * vec4(std::fabs(b.x() - a.x()), std::fabs(b.y() - a.y()),
+                                      std::fabs(b.z() - a.z())),
+            vec4(1,0,0), vec4(0,1,0), mat) {}
+
+    // oriented box; x_axis and y_axis must be orthonormal, z is their cross product
+    Box(const point4& center, const vec4& half_extent, const vec4& x_axis, const vec4& y_axis,
+        shared_ptr<Material> mat)
+      : center(center), half(half_extent), mat_id(material_id(mat))
+    {
+        axis[0] = x_axis;
+        axis[1] = y_axis;
+        axis[2] = cross(x_axis, y_axis);
+        for (int a = 0; a < 3; a++) face_area[a] = 4 * half[(a + 1) % 3] * half[(a + 2) % 3];
+        set_bounding_box();
+    }
+
+    virtual void set_bounding_box() {
+        // extent of the rotated box along each world axis
+        vec4 extent;
+        for (int w = 0; w < 3; w++)
+            for (int a = 0; a < 3; a++) extent[w] += std::fabs(axis[a][w]) * half[a];
+        bbox = AABB(center - extent, center + extent);
+    }
+
+    AABB bounding_box() const override { return bbox; }
+
+    AABB transformed_bounds(const Mat34& m) const override {
+        vec4 extent;
+        for (int a = 0; a < 3; a++) {
+            vec4 edge = m.vector(axis[a]);
+            for (int w = 0; w < 3; w++) extent[w] += std::fabs(edge[w]) * half[a];
+        }
+        point4 c = m.point(center);
+        return AABB(c - extent, c + extent);
+    }
+    double surface_area() const override { return 2 * (face_area[0] + face_area[1] + face_area[2]); }
+
+    bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
+        point4 o = to_local(r.o() - center);
+        vec4 d = to_local(r.d());
+        double t, side;
+        int face_axis;
+        if (!intersect(o, d, ray_t, t, face_axis, side)) return false;
+
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.mat_id = mat_id;
+        rec.object = nullptr; // filled in right away: the face is known here
+        rec.set_face_normal(r, side * axis[face_axis]);
+        face_uv(o + t * d, face_axis, side, rec.u, rec.v);
+        face_derivatives(face_axis, side, rec.dpdu, rec.dpdv);
+        return true;
+    }
+
+    bool span(const Ray& r, double& t_in, double& t_out) const override {
+        int near_axis, far_axis;
+        return slabs(to_local(r.o() - center), to_local(r.d()), t_in, t_out, near_axis, far_axis);
+    }
+
+    double pdf_value(const point4& origin, const vec4& dir) const override {
+        point4 o = to_local(origin - center);
+        vec4 d = to_local(dir);
+        double t, side;
+        int face_axis;
+        if (!intersect(o, d, Interval(0.001, infinity), t, face_axis, side)) return 0.0;
+
+        double total = 0;
+        for (int f = 0; f < 6; f++) total += face_weight(o, f / 2, (f % 2) ? -1.0 : 1.0);
+        double weight = face_weight(o, face_axis, side);
+        if (total <= 0 || weight <= 0) return 0.0;
+
+        auto distance_squared = t * t * d.norm2();
+        auto cosine = std::fabs(d[face_axis]) / d.norm();
+        return (weight / total) * distance_squared / (cosine * face_area[face_axis]);
+    }
+
+    vec4 random(const point4& origin) const override {
+        point4 o = to_local(origin - center);
+        double weights[6], total = 0;
+        for (int f = 0; f < 6; f++) {
+            weights[f] = face_weight(o, f / 2, (f % 2) ? -1.0 : 1.0);
+            total += weights[f];
+        }
+
+        double pick = gen_random_double() * total;
+        int f = 0;
+        while (f < 5 && (weights[f] <= 0 || pick >= weights[f])) {
+            pick -= weights[f];
+            f++;
+        }
+        while (weights[f] <= 0 && f > 0) f--; // rounding ran past the last visible face
+        int face_axis = f / 2;
+        double side = (f % 2) ? -1.0 : 1.0;
+
+        vec4 local;
+        local[face_axis] = side * half[face_axis];
+        local[(face_axis + 1) % 3] = gen_random_double(-1, 1) * half[(face_axis + 1) % 3];
+        local[(face_axis + 2) % 3] = gen_random_double(-1, 1) * half[(face_axis + 2) % 3];
+        return center + to_world(local) - origin;
+    }
+
+  private:
+    point4 center;
+    vec4 half;      // half extents along the local axes
+    vec4 axis[3];
+    double face_area[3]; // area of one face perpendicular to each local axis
+    uint32_t mat_id;
+    AABB bbox;
+
+    vec4 to_local(const vec4& v) const {
+        return vec4(dot(v, axis[0]), dot(v, axis[1]), dot(v, axis[2]));
+    }
+
+    vec4 to_world(const vec4& v) const {
+        return v[0] * axis[0] + v[1] * axis[1] + v[2] * axis[2];
+    }
+
+    bool slabs(const point4& o, const vec4& d, double& t_near, double& t_far,
+               int& near_axis, int& far_axis) const {
+        // remember which axis sets the entry and exit distances
+        t_near = -infinity;
+        t_far = infinity;
+        near_axis = far_axis = 0;
+        for (int a = 0; a < 3; a++) {
+            double inv = 1.0 / d[a];
+            double t0 = (-half[a] - o[a]) * inv;
+            double t1 = ( half[a] - o[a]) * inv;
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > t_near) { t_near = t0; near_axis = a; }
+            if (t1 < t_far) { t_far = t1; far_axis = a; }
+        }
+        return t_near <= t_far;
+    }
+
+    bool intersect(const point4& o, const vec4& d, Interval ray_t,
+                   double& t, int& face_axis, double& side) const {
+        double t_near, t_far;
+        int near_axis, far_axis;
+        if (!slabs(o, d, t_near, t_far, near_axis, far_axis)) return false;
+
+        // the entry face, or the exit face for rays starting inside
+        if (ray_t.contains(t_near)) { t = t_near; face_axis = near_axis; }
+        else if (ray_t.contains(t_far)) { t = t_far; face_axis = far_axis; }
+        else return false;
+
+        side = (o[face_axis] + t * d[face_axis] > 0) ? 1.0 : -1.0;
+        return true;
+    }
+
+    double face_weight(const point4& o, int a, double side) const {
+        // Faces are sampled in proportion to their area projected towards o
+        // (cosine at the face center over distance), so faces seen edge-on
+        // get few samples and hidden ones none. From inside, by plain area.
+        bool inside = std::fabs(o[0]) <= half[0] && std::fabs(o[1]) <= half[1]
+                   && std::fabs(o[2]) <= half[2];
+        if (inside) return face_area[a];
+        double height = side * o[a] - half[a];
+        if (height <= 0) return 0.0;
+        vec4 to_face = o;
+        to_face[a] -= side * half[a];
+        return face_area[a] * height / to_face.norm();
+    }
+
+    void face_uv(const point4& p, int face_axis, double side, real& u, real& v) const {
+        // [0,1] coordinates across the box, oriented like the six quads of box()
+        double s[3];
+        for (int a = 0; a < 3; a++) s[a] = (half[a] > 0) ? 0.5 * (p[a] / half[a] + 1) : 0.5;
+        switch (face_axis) {
+            case 0: u = (side > 0) ? 1 - s[2] : s[2]; v = s[1]; break; // right / left
+            case 1: u = s[0]; v = (side > 0) ? 1 - s[2] : s[2]; break; // top / bottom
+            default: u = (side > 0) ? s[0] : 1 - s[0]; v = s[1]; break; // front / back
+        }
+    }
+
+    void face_derivatives(int face_axis, double side, vec4& dpdu, vec4& dpdv) const {
+        // each [0,1] coordinate spans the box's full extent along its axis
+        vec4 e[3];
+        for (int a = 0; a < 3; a++) e[a] = (2 * half[a]) * axis[a];
+        switch (face_axis) {
+            case 0: dpdu = (side > 0) ? -e[2] : e[2]; dpdv = e[1]; break;
+            case 1: dpdu = e[0]; dpdv = (side > 0) ? -e[2] : e[2]; break;
+            default: dpdu = (side > 0) ? e[0] : -e[0]; dpdv = e[1]; break;
+        }
+    }
+};
+
+// Box from corners a and b, rotated about its local origin (the a/b frame's
+// origin, like Rotate_y) and then moved by offset: the same placement as
+// Translate(Rotate_y(box(a, b), angle), offset), without the wrappers.
+inline shared_ptr<Box> rotated_box(const point4& a, const point4& b, double y_degrees,
+                                   const vec4& offset, shared_ptr<Material> mat) {
+    Mat34 m = Mat34::translation(offset) * Mat34::rotation(1, y_degrees);
+    vec4 half_extent = 0.5 * vec4(std::fabs(b.x() - a.x()), std::fabs(b.y() - a.y()),
+                                  std::fabs(b.z() - a.z()));
+    return make_scene_shared<Box>(m.point(0.5 * (a + b)), half_extent,
+                            m.vector(vec4(1,0,0)), m.vector(vec4(0,1,0)), mat);
+}
+
+#endif
@@ -34,8 +34,8 @@ class BVH_node : public Hittable {
                           });
 
                 auto mid = start + range / 2;
-                left  = make_shared<BVH_node>(objects, start, mid);
-                right = make_shared<BVH_node>(objects, mid, end);
+                left  = make_scene_shared<BVH_node>(objects, start, mid);
+                right = make_scene_shared<BVH_node>(objects, mid, end);
             }
 
             // bbox = AABB(left->bounding_box(), right->bounding_box());
@@ -58,6 +58,24 @@ class BVH_node : public Hittable {
         }
 
         AABB bounding_box() const override { return bbox; }
+        AABB transformed_bounds(const Mat34& m) const override {
+            return AABB(left->transformed_bounds(m), right->transformed_bounds(m));
+        }
+        void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const override {
+            AABB l0, l1, r0, r1;
+            left->motion_bounds(t0, t1, l0, l1);
+            right->motion_bounds(t0, t1, r0, r1);
+            b0 = AABB(l0, r0);
+            b1 = AABB(l1, r1);
+        }
+        bool contains_media() const override {
+            return left->contains_media() || right->contains_media();
+        }
+        double surface_area() const override {
+            // single-object nodes point both children at the same object
+            if (left == right) return left->surface_area();
+            return left->surface_area() + right->surface_area();
+        }
     public:
     shared_ptr<Hittable> left;
     shared_ptr<Hittable> right;
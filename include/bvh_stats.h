@@ -0,0 +1,307 @@
+#ifndef BVH_STATS_H
+#define BVH_STATS_H
+
+#include "bvh.h"
+#include "sbvh.h"
+#include "motion.h"
+#include "compiled_scene.h"
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <string>
+#include <typeinfo>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+
+// Quality report for a built acceleration structure: shape of the tree, SAH
+// cost, sibling overlap, memory, and the objects whose bounding boxes cover
+// the most of the scene. Meant for comparing builders and for spotting scenes
+// that quietly make traversal slow (e.g. the 5000-radius fog sphere).
+
+struct BVHObjectInfo {
+    std::string type;
+    AABB bbox;
+    double bbox_area;      // surface area of the bounding box
+    double surface_area;   // area of the object itself (0 if unknown)
+    double scene_fraction; // bbox area relative to the root box
+};
+
+struct BVHStats {
+    std::string builder;
+    size_t nodes = 0;
+    size_t interior_nodes = 0;
+    size_t leaves = 0;
+    size_t primitives = 0;  // distinct objects
+    size_t references = 0;  // leaf entries (> primitives when references are split)
+    int max_depth = 0;
+    std::vector<size_t> depth_histogram;     // leaves per depth
+    std::vector<size_t> leaf_size_histogram; // leaves per reference count
+    double sah_cost = 0;
+    double sibling_overlap = 0; // overlap area of sibling boxes / interior node area
+    size_t memory_bytes = 0;    // acceleration structure only, not the primitives
+    std::vector<BVHObjectInfo> largest_objects;
+
+    void print(std::ostream& out) const {
+        out << "BVH report (" << builder << ")\n"
+            << "  nodes            " << nodes << " (" << interior_nodes << " interior, "
+            << leaves << " leaves)\n"
+            << "  primitives       " << primitives << " (" << references << " references)\n"
+            << "  max depth        " << max_depth << "\n"
+            << "  SAH cost         " << sah_cost << "\n"
+            << "  sibling overlap  " << sibling_overlap << "\n"
+            << "  memory           " << memory_bytes << " bytes\n";
+
+        out << "  leaves per depth\n";
+        for (size_t d = 0; d < depth_histogram.size(); d++) {
+            if (depth_histogram[d] > 0)
+                out << "    " << std::setw(4) << d << "  " << depth_histogram[d] << "\n";
+        }
+        out << "  leaves per size\n";
+        for (size_t n = 0; n < leaf_size_histogram.size(); n++) {
+            if (leaf_size_histogram[n] > 0)
+                out << "    " << std::setw(4) << n << "  " << leaf_size_histogram[n] << "\n";
+        }
+
+        out << "  largest bounding boxes (share of scene box area, bbox area / surface area)\n";
+        for (const auto& obj : largest_objects) {
+            out << "    " << std::setw(10) << obj.scene_fraction << "  ";
+            if (obj.surface_area > 0) out << std::setw(10) << obj.bbox_area / obj.surface_area;
+            else out << std::setw(10) << "-";
+            out << "  " << obj.type
+                << " [" << obj.bbox.x.min << ", " << obj.bbox.y.min << ", " << obj.bbox.z.min
+                << "] - [" << obj.bbox.x.max << ", " << obj.bbox.y.max << ", " << obj.bbox.z.max
+                << "]\n";
+        }
+    }
+
+    void print_json(std::ostream& out) const {
+        auto list = [&out](const std::vector<size_t>& v) {
+            out << "[";
+            for (size_t i = 0; i < v.size(); i++) out << (i ? ", " : "") << v[i];
+            out << "]";
+        };
+        auto number = [&out](double x) { // JSON has no inf/nan
+            if (std::isfinite(x)) out << x;
+            else out << "null";
+        };
+
+        out << "{\n"
+            << "  \"builder\": \"" << builder << "\",\n"
+            << "  \"nodes\": " << nodes << ",\n"
+            << "  \"interior_nodes\": " << interior_nodes << ",\n"
+            << "  \"leaves\": " << leaves << ",\n"
+            << "  \"primitives\": " << primitives << ",\n"
+            << "  \"references\": " << references << ",\n"
+            << "  \"max_depth\": " << max_depth << ",\n"
+            << "  \"depth_histogram\": ";
+        list(depth_histogram);
+        out << ",\n  \"leaf_size_histogram\": ";
+        list(leaf_size_histogram);
+        out << ",\n  \"sah_cost\": ";
+        number(sah_cost);
+        out << ",\n  \"sibling_overlap\": ";
+        number(sibling_overlap);
+        out << ",\n  \"memory_bytes\": " << memory_bytes << ",\n"
+            << "  \"largest_objects\": [";
+        for (size_t i = 0; i < largest_objects.size(); i++) {
+            const auto& obj = largest_objects[i];
+            out << (i ? "," : "") << "\n    {\"type\": \"" << obj.type << "\", \"bbox\": [";
+            number(obj.bbox.x.min); out << ", "; number(obj.bbox.y.min); out << ", ";
+            number(obj.bbox.z.min); out << ", "; number(obj.bbox.x.max); out << ", ";
+            number(obj.bbox.y.max); out << ", "; number(obj.bbox.z.max);
+            out << "], \"bbox_area\": "; number(obj.bbox_area);
+            out << ", \"surface_area\": "; number(obj.surface_area);
+            out << ", \"scene_fraction\": "; number(obj.scene_fraction);
+            out << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+};
+
+namespace bvh_stats_detail {
+
+inline std::string type_name(const Hittable& h) {
+    const char* name = typeid(h).name();
+#ifdef __GNUG__
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (status == 0 && demangled) {
+        std::string result(demangled);
+        std::free(demangled);
+        return result;
+    }
+#endif
+    return name;
+}
+
+// Accumulates statistics during a walk over any tree layout.
+class Collector {
+    public:
+        Collector(BVHStats& stats, const AABB& root, const BVHBuildOptions& costs)
+          : stats(stats), root_area(root.surface_area()), costs(costs) {}
+
+        void interior(const AABB& box, const AABB& left, const AABB& right, int depth) {
+            stats.nodes++;
+            stats.interior_nodes++;
+            stats.max_depth = std::max(stats.max_depth, depth);
+            stats.sah_cost += costs.traversal_cost * relative(box);
+            interior_area += box.surface_area();
+            overlap_area += AABB::intersection(left, right).surface_area();
+        }
+
+        void leaf(const AABB& box, int depth, const std::vector<const Hittable*>& objects) {
+            stats.nodes++;
+            stats.leaves++;
+            stats.max_depth = std::max(stats.max_depth, depth);
+            stats.references += objects.size();
+            stats.sah_cost += costs.intersection_cost * objects.size() * relative(box);
+
+            if (stats.depth_histogram.size() <= size_t(depth)) stats.depth_histogram.resize(depth + 1);
+            stats.depth_histogram[depth]++;
+            if (stats.leaf_size_histogram.size() <= objects.size())
+                stats.leaf_size_histogram.resize(objects.size() + 1);
+            stats.leaf_size_histogram[objects.size()]++;
+
+            for (const Hittable* obj : objects) unique[obj]++;
+        }
+
+        void finish(int top_n) {
+            stats.sibling_overlap = (interior_area > 0) ? overlap_area / interior_area : 0.0;
+            stats.primitives = unique.size();
+
+            std::vector<BVHObjectInfo> infos;
+            for (const auto& entry : unique) {
+                const Hittable* obj = entry.first;
+                AABB box = obj->bounding_box();
+                double area = box.surface_area();
+                infos.push_back({type_name(*obj), box, area, obj->surface_area(),
+                                 (root_area > 0) ? area / root_area : 0.0});
+            }
+            std::sort(infos.begin(), infos.end(), [](const BVHObjectInfo& a, const BVHObjectInfo& b) {
+                return a.scene_fraction > b.scene_fraction;
+            });
+            if (infos.size() > size_t(top_n)) infos.resize(top_n);
+            stats.largest_objects = infos;
+        }
+
+    private:
+        BVHStats& stats;
+        double root_area;
+        BVHBuildOptions costs;
+        double interior_area = 0;
+        double overlap_area = 0;
+        std::map<const Hittable*, size_t> unique;
+
+        double relative(const AABB& box) const {
+            return (root_area > 0) ? box.surface_area() / root_area : 0.0;
+        }
+};
+
+inline void walk(const BVH_node& node, int depth, Collector& collector, size_t& node_count) {
+    node_count++;
+    auto left = dynamic_cast<const BVH_node*>(node.left.get());
+    auto right = dynamic_cast<const BVH_node*>(node.right.get());
+
+    if (!left && !right) {
+        // both children are objects: this node is a leaf with one or two entries
+        std::vector<const Hittable*> objects;
+        objects.push_back(node.left.get());
+        if (node.right != node.left) objects.push_back(node.right.get());
+        collector.leaf(node.bbox, depth, objects);
+        return;
+    }
+
+    collector.interior(node.bbox, node.left->bounding_box(), node.right->bounding_box(), depth);
+    if (left) walk(*left, depth + 1, collector, node_count);
+    else collector.leaf(node.left->bounding_box(), depth + 1, {node.left.get()});
+    if (right) walk(*right, depth + 1, collector, node_count);
+    else collector.leaf(node.right->bounding_box(), depth + 1, {node.right.get()});
+}
+
+// object(ref) gives the Hittable a leaf reference stands for
+template <typename ObjectOf>
+inline void walk_flat(const std::vector<BVHFlatNode>& nodes, const std::vector<int>& refs,
+                      ObjectOf object, Collector& collector) {
+    // (index, depth) pairs; children always follow their parent
+    std::vector<std::pair<int, int>> stack;
+    if (!nodes.empty()) stack.push_back({0, 0});
+    while (!stack.empty()) {
+        int index = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+
+        const BVHFlatNode& node = nodes[index];
+        if (node.count > 0) {
+            std::vector<const Hittable*> leaf_objects;
+            for (int i = node.offset; i < node.offset + node.count; i++)
+                leaf_objects.push_back(object(refs[i]));
+            collector.leaf(node.bbox, depth, leaf_objects);
+        } else {
+            collector.interior(node.bbox, nodes[index + 1].bbox, nodes[node.offset].bbox, depth);
+            stack.push_back({node.offset, depth + 1});
+            stack.push_back({index + 1, depth + 1});
+        }
+    }
+}
+
+} // namespace bvh_stats_detail
+
+inline BVHStats bvh_stats(const BVH_node& root, int top_n = 10,
+                          const BVHBuildOptions& costs = BVHBuildOptions()) {
+    BVHStats stats;
+    stats.builder = "BVH_node";
+    bvh_stats_detail::Collector collector(stats, root.bounding_box(), costs);
+    size_t node_objects = 0;
+    bvh_stats_detail::walk(root, 0, collector, node_objects);
+    collector.finish(top_n);
+    // every node is its own make_shared allocation (object + control block)
+    stats.memory_bytes = node_objects * (sizeof(BVH_node) + 2 * sizeof(long));
+    return stats;
+}
+
+inline BVHStats bvh_stats(const SBVH& bvh, int top_n = 10,
+                          const BVHBuildOptions& costs = BVHBuildOptions()) {
+    BVHStats stats;
+    stats.builder = "SBVH";
+    bvh_stats_detail::Collector collector(stats, bvh.bounding_box(), costs);
+    const auto& objects = bvh.primitives();
+    bvh_stats_detail::walk_flat(bvh.flat_nodes(), bvh.references(),
+                                [&](int i) { return objects[i].get(); }, collector);
+    collector.finish(top_n);
+    stats.memory_bytes = bvh.flat_nodes().size() * sizeof(BVHFlatNode)
+                       + bvh.references().size() * sizeof(int)
+                       + bvh.primitives().size() * sizeof(shared_ptr<Hittable>);
+    return stats;
+}
+
+inline BVHStats bvh_stats(const MotionBVH& bvh, int top_n = 10,
+                          const BVHBuildOptions& costs = BVHBuildOptions()) {
+    // shape and costs are measured on the mid-shutter topology boxes
+    BVHStats stats;
+    stats.builder = "MotionBVH";
+    bvh_stats_detail::Collector collector(stats, bvh.bounding_box(), costs);
+    const auto& objects = bvh.primitives();
+    bvh_stats_detail::walk_flat(bvh.flat_nodes(), bvh.references(),
+                                [&](int i) { return objects[i].get(); }, collector);
+    collector.finish(top_n);
+    stats.memory_bytes = bvh.flat_nodes().size()
+                           * (sizeof(BVHFlatNode) + 2 * bvh.time_segments() * sizeof(AABB))
+                       + bvh.references().size() * sizeof(int)
+                       + bvh.primitives().size() * sizeof(shared_ptr<Hittable>);
+    return stats;
+}
+
+inline BVHStats bvh_stats(const CompiledScene& scene, int top_n = 10,
+                          const BVHBuildOptions& costs = BVHBuildOptions()) {
+    BVHStats stats;
+    stats.builder = "CompiledScene";
+    bvh_stats_detail::Collector collector(stats, scene.bounding_box(), costs);
+    bvh_stats_detail::walk_flat(scene.flat_nodes(), scene.references(),
+                                [&](int i) { return scene.object(i); }, collector);
+    collector.finish(top_n);
+    stats.memory_bytes = scene.memory_bytes();
+    return stats;
+}
+
+#endif
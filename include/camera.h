@@ -4,6 +4,10 @@
 #include "rtweekend.h"
 #include "material.h"
 #include "pdf.h"
+#include "light_bvh.h"
+#include "environment_light.h"
+#include "motion.h"
+#include "path_guide.h"
 #include <fstream>
 #include <../src/part1/ppm2png.cpp>
 
@@ -31,6 +35,7 @@ class Camera {
     int image_width = 100;
     int samples_per_pixel = 10; // random samples for each pixel
     Color background; // background color
+    shared_ptr<EnvironmentLight> environment; // seen instead of background when set
 
     double fovy = 90;
     point4 lookfrom = point4(0,0,0);
@@ -39,9 +44,33 @@ class Camera {
     
     double defocus_angle = 0; // variation angle of rays through each pixel
     double focus_dist = 10; // distance from cam center to perfect focus plane
+    int roulette_depth = 3; // bounces before paths may be ended at random
+    int guide_passes = 0; // path guiding: training passes (1, 2, 4... spp) before the image; 0 is off
+
+    // lights are the emitters found in the world, picked through a LightBVH;
+    // with none, bounces only follow the materials
+    void render(const Hittable& world) {
+        LightBVH lights(world, environment.get());
+        std::clog << "Found " << lights.size() << " emitters" << (environment ? " and an environment map\n" : "\n");
+        render_image(world, lights.empty() ? nullptr : &lights);
+    }
 
     void render(const Hittable& world, const Hittable& lights) {
+        render_image(world, &lights);
+    }
+
+  private:
+    std::vector<const Hittable*> media; // those shadow rays pass through (Ray::is_shadow)
+    PathGuide* guide = nullptr; // while rendering with guide_passes
+    bool training = false;      // during a guide pass: record into the guide
+
+    void render_image(const Hittable& world, const Hittable* lights) {
+        media.clear();
+        collect_media(world);
         initialize();
+        PathGuide path_guide(world.bounding_box());
+        guide = (guide_passes > 0) ? &path_guide : nullptr;
+        for (int pass = 0; pass < guide_passes; pass++) train_guide(world, lights, pass);
         std::ofstream output_file(OUT_FILENAME + ".ppm");
 
         if (output_file.is_open()) {
@@ -64,8 +93,9 @@ class Camera {
 
                   for (int s_j = 0; s_j < sqrt_spp; s_j++) { // sample j cell
                     for (int s_i = 0; s_i < sqrt_spp; s_i++) {
-                      Ray r = get_ray(i, j, s_i, s_j);
-                      pixel_color += ray_color(r, max_depth, world, lights);
+                      RayDifferential diff;
+                      Ray r = get_ray(i, j, s_i, s_j, diff);
+                      pixel_color += ray_color(r, max_depth, world, lights, 0, &diff);
                     } 
                   }
 
@@ -80,14 +110,29 @@ class Camera {
         // Convert ppm to png
         convertPPMtoPNG(OUT_FILENAME + ".ppm", OUT_FILENAME + ".png");
         std::clog << "\rDone.                 \n";
+        guide = nullptr;
+    }
+
+    // One pass of 2^pass samples per pixel that only feeds the guide; its
+    // image is dropped, being sampled with what the guide knew before it.
+    void train_guide(const Hittable& world, const Hittable* lights, int pass) {
+        std::clog << "\rTraining guide: pass " << (pass + 1) << " of " << guide_passes << "    " << std::flush;
+        training = true;
+        for (int j = 0; j < image_height; j++)
+            for (int i = 0; i < image_width; i++)
+                for (int s = 0; s < (1 << pass); s++)
+                    ray_color(get_ray(i, j), max_depth, world, lights);
+        training = false;
+        guide->refine(pass);
+        std::clog << "\rTraining guide: " << guide->leaf_count() << " regions after pass " << (pass + 1) << '\n';
     }
 
-  private:
     int image_height;
     point4 center;
     point4 pixel00_loc;
     int sqrt_spp; // sqrt of # of samples per pixel
     double recip_sqrt_spp; // 1 / sqrt_spp; avoid unneccssary calc
+    double differential_scale; // spacing of a sample's ray differentials, in pixels
     double pixel_samples_scale;
     vec4 pixel_delta_u;
     vec4 pixel_delta_v;
@@ -102,6 +147,9 @@ class Camera {
         image_height = resolution[1];
         sqrt_spp = int(std::sqrt(samples_per_pixel));
         recip_sqrt_spp = 1.0 / sqrt_spp;
+        // each sample stands for its stratum; past 64 spp a texel-sized
+        // footprint is plenty
+        differential_scale = std::fmax(0.125, recip_sqrt_spp);
         pixel_samples_scale = 1.0 / (sqrt_spp * sqrt_spp);
         center = lookfrom;
         // double focal_length = (lookfrom - lookat).norm();
@@ -181,7 +229,7 @@ class Camera {
       return Ray(ray_orig, ray_dir, ray_time);
     }
 
-    Ray get_ray(int i, int j, int s_i, int s_j) const {
+    Ray get_ray(int i, int j, int s_i, int s_j, RayDifferential& diff) const {
       // creates camera rays towards pixel (i,j)
       // direct at randomly sampled stratified square near i,j: s_i, s_j
       // auto offset = sample_square();
@@ -193,18 +241,34 @@ class Camera {
       auto ray_orig = (defocus_angle <= 0) ? center : defocus_disk_sample();
       auto ray_dir  = pixel_sample - ray_orig;
       auto ray_time = gen_random_double();
+
+      // neighbours from the same lens point, so they meet in the focus plane
+      diff.rx_o = diff.ry_o = ray_orig;
+      diff.rx_d = ray_dir + differential_scale * pixel_delta_u;
+      diff.ry_d = ray_dir + differential_scale * pixel_delta_v;
       return Ray(ray_orig, ray_dir, ray_time);
     }
 
-    Color ray_color(const Ray& r, int depth, const Hittable& world, const Hittable& lights) const {
+    // bsdf_pdf: density the previous vertex's material sampled r with, or 0
+    // for camera and specular rays; emission found this way is then weighted
+    // against that vertex's light sample (see sample_light)
+    // diff: r's differentials, on camera rays and through specular bounces
+    // only; textures are filtered over the footprint they give
+    Color ray_color(const Ray& r, int depth, const Hittable& world, const Hittable* lights,
+                    double bsdf_pdf = 0, const RayDifferential* diff = nullptr) const {
         if (depth <= 0) return Color(0,0,0);
 
         Hit rec;
         // 0.001 on the interval to prevent "shadow acne"
         // where numerical approximations cause intersection error
         if (!world.hit(r, Interval(0.001, infinity), rec)) {
-          return background;
+          Color sky = sky_radiance(r);
+          if (bsdf_pdf > 0 && lights) sky *= power_heuristic(bsdf_pdf, lights->pdf_value(r.o(), r.d()));
+          return sky;
         }
+        rec.finish(r); // surface data for the closest hit only
+        vec4 dpdx, dpdy;
+        bool has_footprint = diff && surface_footprint(*diff, rec, dpdx, dpdy);
 
         #ifdef DEBUG_MODE
           std::cout << "HIT: " << rec.p << " || NORMAL: " << rec.normal << "\n";
@@ -214,26 +278,51 @@ class Camera {
         // Color attenuation;  // based on material properties
         // double pdf_value;   // importance sampling weighting term
         ScatterRecord srec;
-        Color color_from_emission = rec.mat->emitted(r, rec, rec.u, rec.v, rec.p);
+        const Material* mat = rec.material();
+        Color color_from_emission = material_emitted(*mat, r, rec, rec.u, rec.v, rec.p);
+        if (bsdf_pdf > 0 && lights && !color_from_emission.near_zero()) {
+          // the light sample at r's origin could have found this too
+          color_from_emission *= power_heuristic(bsdf_pdf, lights->pdf_value(r.o(), r.d()));
+        }
 
         // if ray produces a valid reflecting ray
-        if (!rec.mat->scatter(r, rec, srec)) {
+        if (!material_scatter(*mat, r, rec, srec)) {
           // if material does not scatter (gets fully absorbed)
           return color_from_emission;
         }
 
         if (srec.skip_pdf) { // specular materials
-            return srec.attenuation * ray_color(srec.skip_pdf_ray, depth - 1, world, lights);
+            RayDifferential next;
+            bool keep = has_footprint
+                     && material_differentials(*mat, r, rec, srec.skip_pdf_ray, *diff, dpdx, dpdy, next);
+            return srec.attenuation * ray_color(srec.skip_pdf_ray, depth - 1, world, lights, 0,
+                                                keep ? &next : nullptr);
         }
 
-        // for light sampling
-        auto light_ptr = make_shared<HittablePDF>(lights, rec.p);
-        MixturePDF mixed_pdf(light_ptr, srec.pdf_ptr); // along with material
+        // what the guide learned around here joins the material's sampling
+        uint32_t region = guide ? guide->region(rec.p) : 0;
+        GuidedPDF sampling(srec.pdf, guide ? guide->learned(region) : nullptr);
+
+        // next-event estimation: direct light through one shadow ray
+        Color color_from_lights = lights ? sample_light(r, rec, *mat, srec, sampling, world, *lights)
+                                         : Color(0,0,0);
+
+        // Paths no longer end by running into the light, so past the first
+        // few bounces let dim ones stop (Russian roulette); the survivors are
+        // scaled up to keep the estimate unbiased.
+        double survival = 1;
+        if (max_depth - depth >= roulette_depth) {
+            const Color& a = srec.attenuation;
+            survival = std::fmin(0.95, std::fmax(a.x(), std::fmax(a.y(), a.z())));
+            if (gen_random_double() >= survival) return color_from_emission + color_from_lights;
+        }
 
-        Ray scattered = Ray(rec.p, mixed_pdf.generate(), r.time());
-        auto pdf_value = mixed_pdf.value(scattered.d());
+        // and the path goes on along the material's own distribution (mixed
+        // with the guide's, when there is one)
+        Ray scattered = Ray(rec.p, sampling.generate(), r.time());
+        double pdf_value = sampling.value(scattered.d());
+        if (pdf_value <= 0) return color_from_emission + color_from_lights;
 
-        // HittablePDF light_pdf(lights, rec.p);
         // scattered = Ray(rec.p, light_pdf.generate(), r.time());
         // pdf_value = light_pdf.value(scattered.d());
 
@@ -264,13 +353,20 @@ class Camera {
         // scattered = Ray(rec.p, to_light, r.time());
 
         // of scatter function (based on material)
-        double scattering_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+        double scattering_pdf = material_scattering_pdf(*mat, r, rec, scattered);
         // pdf_value = scattering_pdf;
+        // a guided direction can point where the material sends nothing
+        if (scattering_pdf <= 0) return color_from_emission + color_from_lights;
 
         // emission is (0,0,0) if material is not emissive
         // recursively color ray from multiple scatters based on 'max_depth'
-        Color color_from_scatter = (srec.attenuation * scattering_pdf * ray_color(scattered, depth - 1, world, lights)) / pdf_value;
-        return color_from_emission + color_from_scatter;
+        Color incoming = ray_color(scattered, depth - 1, world, lights, pdf_value);
+        if (training) {
+            double luminance = 0.2126 * incoming.x() + 0.7152 * incoming.y() + 0.0722 * incoming.z();
+            guide->record(region, scattered.d(), luminance / pdf_value);
+        }
+        Color color_from_scatter = (srec.attenuation * scattering_pdf * incoming) / (pdf_value * survival);
+        return color_from_emission + color_from_lights + color_from_scatter;
 
         // vec4 direction = random_on_hemisphere(rec.normal); // uniform scattering
         //vec4 direction = rec.normal + random_unit_vector(); // Lambertian
@@ -278,6 +374,91 @@ class Camera {
         // return reflectance * ray_color(Ray(rec.p, direction), depth - 1, world);
 
     }
+
+    // Where the differential rays cross the tangent plane at rec (dpdx, dpdy
+    // from p), and the uv width that spans: dpdu du + dpdv dv = dp solved in
+    // the least-squares sense for each. Sets rec.footprint; false if a
+    // neighbour runs parallel to the plane.
+    static bool surface_footprint(const RayDifferential& diff, Hit& rec, vec4& dpdx, vec4& dpdy) {
+        const vec4& n = rec.normal;
+        double dx = dot(n, diff.rx_d), dy = dot(n, diff.ry_d);
+        if (dx == 0 || dy == 0) return false;
+        double d = dot(n, rec.p);
+        dpdx = diff.rx_o + ((d - dot(n, diff.rx_o)) / dx) * diff.rx_d - rec.p;
+        dpdy = diff.ry_o + ((d - dot(n, diff.ry_o)) / dy) * diff.ry_d - rec.p;
+
+        double a00 = dot(rec.dpdu, rec.dpdu), a01 = dot(rec.dpdu, rec.dpdv), a11 = dot(rec.dpdv, rec.dpdv);
+        double det = a00 * a11 - a01 * a01;
+        if (det > 0) {
+            auto uv_width = [&](const vec4& dp) {
+                double b0 = dot(rec.dpdu, dp), b1 = dot(rec.dpdv, dp);
+                double du = (a11 * b0 - a01 * b1) / det, dv = (a00 * b1 - a01 * b0) / det;
+                return std::fmax(std::fabs(du), std::fabs(dv));
+            };
+            rec.footprint = std::fmax(uv_width(dpdx), uv_width(dpdy));
+        }
+        return true;
+    }
+
+    // media reachable without going through an instance: the ones that
+    // see shadow rays as such
+    void collect_media(const Hittable& object) {
+        if (!object.contains_media()) return;
+        if (auto list = dynamic_cast<const HittableList*>(&object)) {
+            for (const auto& child : list->objects) collect_media(*child);
+        } else if (auto node = dynamic_cast<const BVH_node*>(&object)) {
+            collect_media(*node->left);
+            if (node->right != node->left) collect_media(*node->right);
+        } else if (auto bvh = dynamic_cast<const SBVH*>(&object)) {
+            for (const auto& child : bvh->primitives()) collect_media(*child);
+        } else if (auto bvh = dynamic_cast<const MotionBVH*>(&object)) {
+            for (const auto& child : bvh->primitives()) collect_media(*child);
+        } else if (auto compiled = dynamic_cast<const CompiledScene*>(&object)) {
+            collect_media(compiled->source_objects());
+        } else {
+            media.push_back(&object); // instances report 1 and block on their own
+        }
+    }
+
+    Color sky_radiance(const Ray& r) const {
+        return environment ? environment->radiance(r.d()) : background;
+    }
+
+    // One shadow ray towards a point picked by the lights. Whatever it hits
+    // first is the visibility test: only an emitter facing back contributes.
+    // Weighted (power heuristic) against the material having sampled the
+    // same direction, which ray_color counts from the other side;
+    // `sampling` is the density it would have.
+    Color sample_light(const Ray& r_in, const Hit& rec, const Material& mat, const ScatterRecord& srec,
+                       const PDF& sampling, const Hittable& world, const Hittable& lights) const {
+        Ray to_light(rec.p, lights.random(rec.p), r_in.time(), true);
+        double light_pdf = lights.pdf_value(rec.p, to_light.d());
+        if (light_pdf <= 0) return Color(0,0,0);
+
+        double scattering_pdf = material_scattering_pdf(mat, r_in, rec, to_light);
+        if (scattering_pdf <= 0) return Color(0,0,0); // behind the surface
+
+        Hit light_rec;
+        Color emitted;
+        Interval segment(0.001, infinity);
+        if (world.hit(to_light, segment, light_rec)) {
+            light_rec.finish(to_light);
+            emitted = material_emitted(*light_rec.material(), to_light, light_rec,
+                                       light_rec.u, light_rec.v, light_rec.p);
+            segment.max = light_rec.t;
+        } else {
+            emitted = sky_radiance(to_light); // nothing in the way of the environment
+        }
+        if (emitted.near_zero()) return Color(0,0,0);
+        // the media it went through
+        for (const Hittable* medium : media) {
+            emitted *= medium->transmittance(to_light, segment);
+            if (emitted.near_zero()) return Color(0,0,0);
+        }
+
+        double weight = power_heuristic(light_pdf, sampling.value(to_light.d()));
+        return srec.attenuation * scattering_pdf * emitted * weight / light_pdf;
+    }
 };
 
 #endif
\ No newline at end of file
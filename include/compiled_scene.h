@@ -0,0 +1,175 @@
+#ifndef COMPILED_SCENE_H
+#define COMPILED_SCENE_H
+
+#include "hittable_list.h"
+#include "bvh.h"
+#include "sbvh.h"
+#include "primitives.h"
+#include "box.h"
+
+// Render-time form of a scene built with the usual classes. Lists and BVHs
+// are flattened; the built-in shapes (all final) are copied by value into
+// one array per type and referenced by a tagged index, and anything else
+// (meshes, pools, media, instances) is kept as an opaque Hittable. A single
+// BVH covers them all and its leaves switch on the tag, so the shape's hit()
+// is a direct call inlined into the traversal instead of a virtual one per
+// object and per BVH_node.
+//
+// Materials and textures are dispatched the same way through their tags
+// (material_scatter() and friends), so shading doesn't go virtual either.
+class CompiledScene : public Hittable {
+    public:
+        CompiledScene(const HittableList& world, const BVHBuildOptions& options = BVHBuildOptions())
+          : source(world) {
+            std::vector<AABB> bounds;
+            for (const auto& object : world.objects) add(object, bounds);
+
+            BVHBuilder builder(bounds, options,
+                [this](int prim, int axis, double pos, const AABB& ref, AABB& left, AABB& right) {
+                    const Ref& p = refs[size_t(prim)];
+                    if (p.kind == opaque && others[p.index]->contains_media()) return false;
+                    left = ref.clip(axis, -infinity, pos);
+                    right = ref.clip(axis, pos, infinity);
+                    return true;
+                });
+            builder.build(nodes, prim_indices);
+            bbox = nodes.empty() ? AABB::empty : nodes[0].bbox;
+        }
+
+        bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
+            if (nodes.empty()) return false;
+
+            bool hit_anything = false;
+            int stack[64];
+            int top = 0;
+            stack[top++] = 0;
+
+            while (top > 0) {
+                int index = stack[--top];
+                const BVHFlatNode& node = nodes[index];
+                if (!node.bbox.hit(r, ray_t)) continue;
+
+                if (node.count > 0) {
+                    for (int i = node.offset; i < node.offset + node.count; i++) {
+                        if (hit_ref(refs[size_t(prim_indices[i])], r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                } else {
+                    int near_child = index + 1;
+                    int far_child = node.offset;
+                    if (r.d()[node.axis] < 0) std::swap(near_child, far_child);
+                    stack[top++] = far_child;
+                    stack[top++] = near_child;
+                }
+            }
+            return hit_anything;
+        }
+
+        AABB bounding_box() const override { return bbox; }
+
+        // the rest answers from the authoring objects
+        AABB transformed_bounds(const Mat34& m) const override { return source.transformed_bounds(m); }
+        void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const override {
+            source.motion_bounds(t0, t1, b0, b1);
+        }
+        bool contains_media() const override { return source.contains_media(); }
+        double surface_area() const override { return source.surface_area(); }
+
+        // the scene as it was authored (lights are picked from here)
+        const HittableList& source_objects() const { return source; }
+
+        size_t shape_count() const { return refs.size() - others.size(); }
+        size_t opaque_count() const { return others.size(); }
+
+        // the tree, for bvh_stats(): leaves hold [offset, offset + count)
+        // of references(), each an index for object()
+        const std::vector<BVHFlatNode>& flat_nodes() const { return nodes; }
+        const std::vector<int>& references() const { return prim_indices; }
+        const Hittable* object(int prim) const {
+            const Ref& p = refs[size_t(prim)];
+            switch (p.kind) {
+                case sphere:   return &spheres[p.index];
+                case quad:     return &quads[p.index];
+                case disk:     return &disks[p.index];
+                case triangle: return &triangles[p.index];
+                case box:      return &boxes[p.index];
+                default:       return others[p.index].get();
+            }
+        }
+
+        // nodes, leaf references and tags; not the shapes themselves
+        size_t memory_bytes() const {
+            return nodes.capacity() * sizeof(BVHFlatNode) + prim_indices.capacity() * sizeof(int)
+                 + refs.capacity() * sizeof(Ref);
+        }
+
+    private:
+        enum Kind : uint32_t { sphere, quad, disk, triangle, box, opaque };
+
+        struct Ref {
+            Kind kind;
+            uint32_t index; // into the array for `kind`
+        };
+
+        HittableList source;
+        std::vector<Sphere> spheres;
+        std::vector<Quad> quads;
+        std::vector<Disk> disks;
+        std::vector<Triangle> triangles;
+        std::vector<Box> boxes;
+        std::vector<shared_ptr<Hittable>> others;
+        std::vector<Ref> refs;
+        std::vector<BVHFlatNode> nodes;
+        std::vector<int> prim_indices;
+        AABB bbox;
+
+        template <typename Shape>
+        bool take(const shared_ptr<Hittable>& object, std::vector<Shape>& shapes, Kind kind) {
+            auto shape = std::dynamic_pointer_cast<Shape>(object);
+            if (!shape) return false;
+            refs.push_back({kind, uint32_t(shapes.size())});
+            shapes.push_back(*shape);
+            return true;
+        }
+
+        void add(const shared_ptr<Hittable>& object, std::vector<AABB>& bounds) {
+            if (auto list = std::dynamic_pointer_cast<HittableList>(object)) {
+                for (const auto& child : list->objects) add(child, bounds);
+                return;
+            }
+            if (auto node = std::dynamic_pointer_cast<BVH_node>(object)) {
+                add(node->left, bounds);
+                if (node->right != node->left) add(node->right, bounds);
+                return;
+            }
+            if (auto bvh = std::dynamic_pointer_cast<SBVH>(object)) {
+                for (const auto& child : bvh->primitives()) add(child, bounds);
+                return;
+            }
+
+            if (!take(object, spheres, sphere)
+                && !take(object, quads, quad)
+                && !take(object, disks, disk)
+                && !take(object, triangles, triangle)
+                && !take(object, boxes, box)) {
+                refs.push_back({opaque, uint32_t(others.size())});
+                others.push_back(object);
+            }
+            bounds.push_back(object->bounding_box());
+        }
+
+        bool hit_ref(const Ref& p, const Ray& r, const Interval& ray_t, Hit& rec) const {
+            switch (p.kind) {
+                case sphere:   return spheres[p.index].hit(r, ray_t, rec);
+                case quad:     return quads[p.index].hit(r, ray_t, rec);
+                case disk:     return disks[p.index].hit(r, ray_t, rec);
+                case triangle: return triangles[p.index].hit(r, ray_t, rec);
+                case box:      return boxes[p.index].hit(r, ray_t, rec);
+                default:       return others[p.index]->hit(r, ray_t, rec);
+            }
+        }
+};
+
+#endif
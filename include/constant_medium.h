@@ -10,55 +10,67 @@ class ConstantMedium : public Hittable {
   public:
     ConstantMedium(shared_ptr<Hittable> boundary, double density, shared_ptr<Texture> tex)
       : boundary(boundary), neg_inv_density(-1/density),
-        phase_function(make_shared<Isotropic>(tex))
+        phase_function(material_id(make_scene_shared<Isotropic>(tex)))
     {}
 
     ConstantMedium(shared_ptr<Hittable> boundary, double density, const Color& albedo)
       : boundary(boundary), neg_inv_density(-1/density),
-        phase_function(make_shared<Isotropic>(albedo))
+        phase_function(material_id(make_scene_shared<Isotropic>(albedo)))
     {}
 
     bool hit(const Ray& r, Interval Ray_t, Hit& rec) const override {
-        Hit rec1, rec2;
+        if (r.is_shadow()) return false; // transmittance() accounts for it
 
-        if (!boundary->hit(r, Interval::universe, rec1))
+        // one query for both boundary crossings
+        double t_in, t_out;
+        if (!boundary->span(r, t_in, t_out))
             return false;
 
-        if (!boundary->hit(r, Interval(rec1.t+0.0001, infinity), rec2))
-            return false;
-
-        if (rec1.t < Ray_t.min) rec1.t = Ray_t.min;
-        if (rec2.t > Ray_t.max) rec2.t = Ray_t.max;
+        if (t_in < Ray_t.min) t_in = Ray_t.min;
+        if (t_out > Ray_t.max) t_out = Ray_t.max;
 
-        if (rec1.t >= rec2.t)
+        if (t_in >= t_out)
             return false;
 
-        if (rec1.t < 0)
-            rec1.t = 0;
+        if (t_in < 0)
+            t_in = 0;
 
         auto Ray_length = r.d().norm();
-        auto distance_inside_boundary = (rec2.t - rec1.t) * Ray_length;
+        auto distance_inside_boundary = (t_out - t_in) * Ray_length;
         auto hit_distance = neg_inv_density * std::log(gen_random_double());
 
         if (hit_distance > distance_inside_boundary)
             return false;
 
-        rec.t = rec1.t + hit_distance / Ray_length;
+        rec.t = t_in + hit_distance / Ray_length;
         rec.p = r.at(rec.t);
 
         rec.normal = vec4(1,0,0);  // arbitrary
         rec.front_face = true;     // also arbitrary
-        rec.mat = phase_function;
+        rec.dpdu = rec.dpdv = vec4(0,0,0); // no surface to filter a texture over
+        rec.mat_id = phase_function;
+        rec.object = nullptr; // complete; rec may hold a stale deferred hit
 
         return true;
     }
 
+    // exp(-density * length inside), exactly
+    double transmittance(const Ray& r, Interval ray_t) const override {
+        double t_in, t_out;
+        if (!boundary->span(r, t_in, t_out)) return 1.0;
+        double inside = std::fmin(t_out, ray_t.max) - std::fmax(t_in, ray_t.min);
+        if (inside <= 0) return 1.0;
+        return std::exp(inside * r.d().norm() / neg_inv_density);
+    }
+
     AABB bounding_box() const override { return boundary->bounding_box(); }
+    bool contains_media() const override { return true; }
+    double surface_area() const override { return boundary->surface_area(); }
 
   private:
     shared_ptr<Hittable> boundary;
     double neg_inv_density;
-    shared_ptr<Material> phase_function;
+    uint32_t phase_function;
 };
 
 #endif
\ No newline at end of file
@@ -4,10 +4,10 @@
 #include "hittable.h"
 
 // setup like general quads, but different
-class Disk : public Hittable {
+class Disk final : public Hittable {
   public:
     Disk(const point4& Q, const vec4& u, const vec4& v, shared_ptr<Material> mat)
-      : Q(Q), u(u), v(v), mat(mat)
+      : Q(Q), u(u), v(v), mat_id(material_id(mat))
     {
         auto n = cross(u,v);
         normal = unit_vector(n); // normal of plane (quad)
@@ -17,16 +17,50 @@ class Disk : public Hittable {
     }
 
     virtual void set_bounding_box() {
-        // Compute the bounding box of all four vertices.
-        // u and v are the defining edge vectors
-        // Q is the "origin" of u and v vectors
-        auto bbox_diagonal1 = AABB(Q, Q + u + v);
-        auto bbox_diagonal2 = AABB(Q + u, Q + v);
-        bbox = AABB(bbox_diagonal1, bbox_diagonal2);
+        // The disk is the ellipse Q + cos(s)*u + sin(s)*v, which reaches
+        // sqrt(u_k^2 + v_k^2) either side of Q along each axis k.
+        vec4 extent(std::sqrt(u.x()*u.x() + v.x()*v.x()), std::sqrt(u.y()*u.y() + v.y()*v.y()),
+                    std::sqrt(u.z()*u.z() + v.z()*v.z()));
+        bbox = AABB(Q - extent, Q + extent);
     }
 
     AABB bounding_box() const override { return bbox; }
 
+    AABB transformed_bounds(const Mat34& m) const override {
+        // still an ellipse, with the transformed u and v
+        point4 q = m.point(Q);
+        vec4 mu = m.vector(u), mv = m.vector(v);
+        vec4 extent(std::sqrt(mu.x()*mu.x() + mv.x()*mv.x()), std::sqrt(mu.y()*mu.y() + mv.y()*mv.y()),
+                    std::sqrt(mu.z()*mu.z() + mv.z()*mv.z()));
+        return AABB(q - extent, q + extent);
+    }
+    // points are Q + a*u + b*v with a^2 + b^2 <= 1: an ellipse around Q
+    double surface_area() const override { return pi * cross(u, v).norm(); }
+    uint32_t light_material() const override { return mat_id; }
+    vec4 normal_bounds(double& cos_theta) const override {
+        cos_theta = 1;
+        return normal;
+    }
+
+    double pdf_value(const point4& origin, const vec4& dir) const override {
+        Hit rec;
+        if (!this->hit(Ray(origin, dir), Interval(0.001, infinity), rec)) {
+            return 0.0;
+        }
+        auto distance_squared = rec.t * rec.t * dir.norm2();
+        auto cosine = std::fabs(dot(dir, normal) / dir.norm());
+
+        return distance_squared / (cosine * surface_area());
+    }
+
+    vec4 random(const point4& origin) const override {
+        // uniform on the unit disk, then stretched onto the ellipse
+        auto r = std::sqrt(gen_random_double());
+        auto phi = 2 * pi * gen_random_double();
+        auto p = Q + (r * std::cos(phi) * u) + (r * std::sin(phi) * v);
+        return p - origin;
+    }
+
     bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
         auto denom = dot(normal, r.d());
 
@@ -44,15 +78,20 @@ class Disk : public Hittable {
 
         if (!is_interior(alpha, beta, rec)) { return false; }
         
-        // fill out rec if valid intersection
+        // u, v are set; the rest waits for surface()
         rec.t = t;
-        rec.p = intersection;
-        rec.mat = mat;
-        rec.set_face_normal(r, normal);
-
+        rec.object = this;
         return true;
     }
 
+    void surface(const Ray& r, Hit& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.mat_id = mat_id;
+        rec.set_face_normal(r, normal);
+        rec.dpdu = u; // u, v are the coordinates along the edges
+        rec.dpdv = v;
+    }
+
     virtual bool is_interior(double a, double b, Hit& rec) const {
         Interval unit_interval = Interval(0, 1);
         if(!unit_interval.contains(std::sqrt(a*a + b*b))) {
@@ -68,7 +107,7 @@ class Disk : public Hittable {
     point4 Q;
     vec4 u, v;
     vec4 w;
-    shared_ptr<Material> mat;
+    uint32_t mat_id;
     AABB bbox;
     vec4 normal;
     double D;
@@ -0,0 +1,77 @@
+#ifndef ENVIRONMENT_LIGHT_H
+#define ENVIRONMENT_LIGHT_H
+
+#include "hittable.h"
+#include "pdf.h"
+#include "rtw_stb_image.h"
+
+// Light from infinitely far away, read from an equirectangular map (HDR
+// files keep their full range through stb's float loader). Directions map to
+// the map the same way Sphere maps its normals to uv, with +y at the top row.
+//
+// Directions are sampled in proportion to luminance times sin(theta), the
+// solid angle a texel covers, so a small bright sun gets most samples
+// instead of the few a uniform or cosine direction would land on it.
+// Passed to LightBVH it joins next-event estimation like any other light;
+// rays that escape the scene see radiance().
+class EnvironmentLight : public Hittable {
+    public:
+        EnvironmentLight(const char* filename, double scale = 1.0) : image(filename), scale(scale) {
+            int nu = std::max(image.width(), 1), nv = std::max(image.height(), 1);
+            std::vector<double> weights(size_t(nu) * nv, 0.0);
+            if (image.height() > 0) {
+                for (int k = 0; k < nv; k++) {
+                    // v cell k is image row nv - 1 - k (the map is stored top down)
+                    double sin_theta = std::sin(pi * (k + 0.5) / nv);
+                    for (int i = 0; i < nu; i++) {
+                        const float* c = image.float_pixel_data(i, nv - 1 - k);
+                        weights[size_t(k) * nu + i] = (0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2]) * sin_theta;
+                    }
+                }
+            }
+            distribution = Distribution2D(weights, nu, nv);
+        }
+
+        Color radiance(const vec4& dir) const {
+            if (image.height() <= 0) return Color(0,0,0);
+            double u, v;
+            direction_to_uv(unit_vector(dir), u, v);
+            const float* c = image.float_pixel_data(int(u * image.width()), int((1 - v) * image.height()));
+            return scale * Color(c[0], c[1], c[2]);
+        }
+
+        double pdf_value(const point4& origin, const vec4& dir) const override {
+            double u, v;
+            direction_to_uv(unit_vector(dir), u, v);
+            double sin_theta = std::sin(pi * v);
+            if (sin_theta <= 0) return 0.0;
+            // from the unit square to the sphere: d(omega) = 2 pi^2 sin(theta) du dv
+            return distribution.density(u, v) / (2 * pi * pi * sin_theta);
+        }
+
+        vec4 random(const point4& origin) const override {
+            double u, v, pdf;
+            distribution.sample(gen_random_double(), gen_random_double(), u, v, pdf);
+            double theta = pi * v, phi = 2 * pi * u;
+            return vec4(-std::sin(theta) * std::cos(phi), -std::cos(theta), std::sin(theta) * std::sin(phi));
+        }
+
+        // nothing to hit; it's what rays see when they hit nothing else
+        bool hit(const Ray& r, Interval ray_t, Hit& rec) const override { return false; }
+        AABB bounding_box() const override { return AABB::empty; }
+
+    private:
+        rtw_image image;
+        double scale;
+        Distribution2D distribution;
+
+        static void direction_to_uv(const vec4& d, double& u, double& v) {
+            // as Sphere::get_sphere_uv: theta from -y, phi around y from -x
+            auto theta = std::acos(std::fmin(1, std::fmax(-1, -d.y())));
+            auto phi = std::atan2(-d.z(), d.x()) + pi;
+            u = phi / (2 * pi);
+            v = theta / pi;
+        }
+};
+
+#endif
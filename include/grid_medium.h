@@ -0,0 +1,235 @@
+#ifndef GRID_MEDIUM_H
+#define GRID_MEDIUM_H
+
+#include "hittable.h"
+#include "material.h"
+#include <fstream>
+#include <vector>
+
+// Participating medium whose density varies over a voxel grid spread across
+// an axis-aligned box (smoke, clouds). Density is interpolated trilinearly
+// between voxel centers and times `scale` is the extinction per unit length.
+//
+// Voxels are kept in 8x8x8 bricks, and bricks that are all zero aren't
+// stored, so a sparse cloud costs memory only where it is. Each brick also
+// keeps the largest density its lookups can see, which makes a coarse
+// majorant grid: hit() walks it along the ray (3D DDA), skips empty bricks
+// outright and runs delta tracking against the brick's majorant in the
+// rest. Shadow rays go through the same walk with ratio tracking
+// (transmittance()), which gives a fraction instead of a yes or no.
+class GridMedium : public Hittable {
+  public:
+    // density: nx * ny * nz values, x varying fastest, then y, then z
+    GridMedium(const AABB& bounds, int nx, int ny, int nz, const std::vector<float>& density,
+               double scale, const Color& albedo)
+      : bounds(bounds), scale(scale), phase_function(material_id(make_scene_shared<Isotropic>(albedo)))
+    {
+        build(nx, ny, nz, density);
+    }
+
+    // from a raw file of nx * ny * nz floats (native byte order), same order
+    GridMedium(const char* filename, int nx, int ny, int nz, const AABB& bounds,
+               double scale, const Color& albedo)
+      : bounds(bounds), scale(scale), phase_function(material_id(make_scene_shared<Isotropic>(albedo)))
+    {
+        std::vector<float> density(size_t(std::max(nx, 0)) * std::max(ny, 0) * std::max(nz, 0));
+        std::ifstream in(filename, std::ios::binary);
+        if (!in.read(reinterpret_cast<char*>(density.data()), std::streamsize(density.size() * sizeof(float)))) {
+            std::cerr << "ERROR: Could not load voxel file '" << filename << "'.\n";
+            return; // an empty medium
+        }
+        build(nx, ny, nz, density);
+    }
+
+    bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
+        if (r.is_shadow() || bricks.empty()) return false; // see transmittance()
+
+        double t = 0;
+        bool found = false;
+        walk(r, ray_t, [&](double t0, double t1, double sigma_max) {
+            // delta tracking: tentative collisions at the majorant's rate,
+            // real with probability density / majorant
+            double inv = 1 / (sigma_max * r.d().norm());
+            for (t = t0;;) {
+                t -= std::log(1 - gen_random_double()) * inv;
+                if (t >= t1) return true; // on to the next brick
+                if (gen_random_double() * sigma_max < scale * density(r.at(t))) {
+                    found = true;
+                    return false;
+                }
+            }
+        });
+        if (!found) return false;
+
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.normal = vec4(1,0,0);  // arbitrary
+        rec.front_face = true;     // also arbitrary
+        rec.dpdu = rec.dpdv = vec4(0,0,0);
+        rec.mat_id = phase_function;
+        rec.object = nullptr; // complete; rec may hold a stale deferred hit
+        return true;
+    }
+
+    // ratio tracking: the product of (1 - density / majorant) over the
+    // tentative collisions; unbiased, and exactly 1 through empty bricks
+    double transmittance(const Ray& r, Interval ray_t) const override {
+        if (bricks.empty()) return 1.0;
+        double tr = 1;
+        walk(r, ray_t, [&](double t0, double t1, double sigma_max) {
+            double inv = 1 / (sigma_max * r.d().norm());
+            for (double t = t0;;) {
+                t -= std::log(1 - gen_random_double()) * inv;
+                if (t >= t1) return true;
+                tr *= 1 - scale * density(r.at(t)) / sigma_max;
+                if (tr < 0.1) { // dim enough: stop at random, keeping the mean
+                    if (gen_random_double() < 0.5) { tr = 0; return false; }
+                    tr *= 2;
+                }
+            }
+        });
+        return tr;
+    }
+
+    AABB bounding_box() const override { return bounds; }
+    bool contains_media() const override { return true; }
+
+    size_t memory_bytes() const {
+        return voxels.capacity() * sizeof(float)
+             + bricks.capacity() * sizeof(uint32_t) + majorant.capacity() * sizeof(float);
+    }
+
+  private:
+    static const int brick = 8;
+    static const uint32_t empty_brick = ~uint32_t(0);
+
+    AABB bounds;
+    double scale;
+    uint32_t phase_function;
+    int n[3] = {0, 0, 0};          // voxels
+    int bricks_n[3] = {0, 0, 0};   // bricks (the majorant grid)
+    vec4 voxel_size;
+    std::vector<uint32_t> bricks;  // index of each brick's first voxel, or empty_brick
+    std::vector<float> voxels;     // stored bricks, brick^3 each
+    std::vector<float> majorant;   // per brick, density units
+
+    void build(int nx, int ny, int nz, const std::vector<float>& density) {
+        n[0] = nx; n[1] = ny; n[2] = nz;
+        if (nx <= 0 || ny <= 0 || nz <= 0) return;
+        for (int a = 0; a < 3; a++) {
+            bricks_n[a] = (n[a] + brick - 1) / brick;
+            voxel_size[a] = bounds.axis_interval(a).size() / n[a];
+        }
+        auto source = [&](int x, int y, int z) {
+            return density[(size_t(z) * ny + y) * nx + x];
+        };
+
+        bricks.assign(size_t(bricks_n[0]) * bricks_n[1] * bricks_n[2], uint32_t(empty_brick));
+        majorant.assign(bricks.size(), 0.0f);
+        for (int bz = 0; bz < bricks_n[2]; bz++)
+            for (int by = 0; by < bricks_n[1]; by++)
+                for (int bx = 0; bx < bricks_n[0]; bx++) {
+                    size_t b = (size_t(bz) * bricks_n[1] + by) * bricks_n[0] + bx;
+                    // lookups inside the brick interpolate with the voxels
+                    // one past its edges too
+                    float m = 0;
+                    for (int z = std::max(bz * brick - 1, 0); z < std::min((bz + 1) * brick + 1, nz); z++)
+                        for (int y = std::max(by * brick - 1, 0); y < std::min((by + 1) * brick + 1, ny); y++)
+                            for (int x = std::max(bx * brick - 1, 0); x < std::min((bx + 1) * brick + 1, nx); x++)
+                                m = std::max(m, source(x, y, z));
+                    majorant[b] = m;
+
+                    bool any = false;
+                    for (int z = bz * brick; z < std::min((bz + 1) * brick, nz) && !any; z++)
+                        for (int y = by * brick; y < std::min((by + 1) * brick, ny) && !any; y++)
+                            for (int x = bx * brick; x < std::min((bx + 1) * brick, nx) && !any; x++)
+                                any = source(x, y, z) != 0;
+                    if (!any) continue;
+
+                    bricks[b] = uint32_t(voxels.size());
+                    voxels.resize(voxels.size() + brick * brick * brick, 0.0f);
+                    float* dst = &voxels[bricks[b]];
+                    for (int z = 0; z < brick; z++)
+                        for (int y = 0; y < brick; y++)
+                            for (int x = 0; x < brick; x++) {
+                                int gx = bx * brick + x, gy = by * brick + y, gz = bz * brick + z;
+                                if (gx < nx && gy < ny && gz < nz)
+                                    dst[(z * brick + y) * brick + x] = source(gx, gy, gz);
+                            }
+                }
+    }
+
+    float voxel(int x, int y, int z) const {
+        x = std::min(std::max(x, 0), n[0] - 1);
+        y = std::min(std::max(y, 0), n[1] - 1);
+        z = std::min(std::max(z, 0), n[2] - 1);
+        size_t b = (size_t(z / brick) * bricks_n[1] + y / brick) * bricks_n[0] + x / brick;
+        if (bricks[b] == empty_brick) return 0.0f;
+        return voxels[bricks[b] + ((z % brick) * brick + y % brick) * brick + x % brick];
+    }
+
+    // trilinear between voxel centers, clamped at the edges
+    double density(const point4& p) const {
+        double c[3];
+        int i[3];
+        for (int a = 0; a < 3; a++) {
+            c[a] = (p[a] - bounds.axis_interval(a).min) / voxel_size[a] - 0.5;
+            double f = std::floor(c[a]);
+            i[a] = int(f);
+            c[a] -= f;
+        }
+        double accum = 0;
+        for (int dz = 0; dz < 2; dz++)
+            for (int dy = 0; dy < 2; dy++)
+                for (int dx = 0; dx < 2; dx++)
+                    accum += (dx ? c[0] : 1 - c[0]) * (dy ? c[1] : 1 - c[1]) * (dz ? c[2] : 1 - c[2])
+                           * voxel(i[0] + dx, i[1] + dy, i[2] + dz);
+        return accum;
+    }
+
+    // Steps through the bricks r crosses within ray_t (Amanatides & Woo),
+    // calling visit(t0, t1, sigma_max) for each one that isn't empty, in
+    // order, until it returns false.
+    template <typename Visit>
+    void walk(const Ray& r, Interval ray_t, Visit visit) const {
+        if (!bounds.clip_ray(r, ray_t)) return;
+
+        int cell[3], step[3];
+        double t_next[3], t_delta[3];
+        for (int a = 0; a < 3; a++) {
+            double size = brick * voxel_size[a];
+            double lo = bounds.axis_interval(a).min;
+            double pos = (r.o()[a] + ray_t.min * r.d()[a] - lo) / size;
+            cell[a] = std::min(std::max(int(pos), 0), bricks_n[a] - 1);
+            if (r.d()[a] > 0) {
+                step[a] = 1;
+                t_next[a] = (lo + (cell[a] + 1) * size - r.o()[a]) / r.d()[a];
+                t_delta[a] = size / r.d()[a];
+            } else if (r.d()[a] < 0) {
+                step[a] = -1;
+                t_next[a] = (lo + cell[a] * size - r.o()[a]) / r.d()[a];
+                t_delta[a] = -size / r.d()[a];
+            } else {
+                step[a] = 0;
+                t_next[a] = t_delta[a] = infinity;
+            }
+        }
+
+        double t = ray_t.min;
+        while (t < ray_t.max) {
+            int a = (t_next[0] < t_next[1]) ? ((t_next[0] < t_next[2]) ? 0 : 2)
+                                            : ((t_next[1] < t_next[2]) ? 1 : 2);
+            double t_exit = std::fmin(t_next[a], ray_t.max);
+            size_t b = (size_t(cell[2]) * bricks_n[1] + cell[1]) * bricks_n[0] + cell[0];
+            double sigma_max = scale * majorant[b];
+            if (sigma_max > 0 && t_exit > t && !visit(t, t_exit, sigma_max)) return;
+
+            t = t_exit;
+            cell[a] += step[a];
+            if (cell[a] < 0 || cell[a] >= bricks_n[a]) return;
+            t_next[a] += t_delta[a];
+        }
+    }
+};
+
+#endif
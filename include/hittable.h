@@ -3,21 +3,37 @@
 
 #include "rtweekend.h"
 #include "aabb.h"
+#include "mat34.h"
+#include "material_table.h"
+#include <type_traits>
 
 
 
-class Material;
+class Hittable;
 
+// Intersection tests only record t, the primitive and its local coordinates
+// (u, v, prim_id) and point `object` at themselves. The rest of the surface
+// (p, normal, front_face, mat_id, final uv) is filled in by finish() once the
+// closest hit is known, so superseded candidates cost no normals or trig.
 class Hit {
     public:
     point4 p; // hitpoint
     vec4 normal; // normal vector from p
-    shared_ptr<Material> mat;
-    double t; // intersection 't'
-    bool front_face;
+    real t; // intersection 't'
     // for texture mapping, need u and v
-    double u;
-    double v;
+    real u;
+    real v;
+    uint32_t mat_id; // into MaterialTable::scene(); keeps Hit trivially copyable
+    uint32_t prim_id; // primitive within `object` (mesh face, pool entry)
+    const Hittable* object = nullptr; // set while the surface is still deferred
+    bool front_face;
+    // how p moves with u and v (zero where a shape doesn't say), and the
+    // width in uv a camera ray's pixel footprint covers here (0: point lookup)
+    vec4 dpdu, dpdv;
+    real footprint = 0;
+
+    // completes a deferred hit; r must be the ray the object was tested with
+    inline void finish(const Ray& r);
 
     void set_face_normal(const Ray& r, const vec4& normal_out) {
         // normal_out assumed to be a unit vector
@@ -25,8 +41,12 @@ class Hit {
         normal = front_face ? normal_out : -normal_out;
     }
 
+    const Material* material() const { return MaterialTable::scene()[mat_id]; }
+
 };
 
+static_assert(std::is_trivially_copyable<Hit>::value, "Hit is copied on every closer hit");
+
 class Hittable {
     public:
         // virtual functions are to be overridden by
@@ -37,14 +57,63 @@ class Hittable {
             Interval Ray_t,
             Hit& hit_record) const = 0;
         virtual AABB bounding_box() const = 0;
+        // bounds of the object after the affine transform m; shapes that
+        // know their geometry override this to be tighter than the moved box
+        virtual AABB transformed_bounds(const Mat34& m) const {
+            return m.transform_box(bounding_box());
+        }
+        // bounds over the time range [t0, t1]: for every s in [0, 1] the box
+        // lerp(b0, b1, s) must contain the object at time t0 + s * (t1 - t0)
+        virtual void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const {
+            b0 = b1 = bounding_box();
+        }
         virtual double pdf_value(const point4& origin, const vec4& dir) const {
             return 0.0;
         }
         virtual vec4 random(const point4& origin) const {
             return vec4(1,0,0);
         }
+        // participating media sample their hit randomly, so acceleration
+        // structures must never test them twice for the same ray
+        virtual bool contains_media() const { return false; }
+        // [t_in, t_out] where r is inside this closed, convex object, for
+        // bounding media; t_in may be behind the origin. The default finds
+        // the two crossings with hit().
+        virtual bool span(const Ray& r, double& t_in, double& t_out) const {
+            Hit rec1, rec2;
+            if (!hit(r, Interval::universe, rec1)) return false;
+            if (!hit(r, Interval(rec1.t + 0.0001, infinity), rec2)) return false;
+            t_in = rec1.t;
+            t_out = rec2.t;
+            return true;
+        }
+        // fraction of light getting through along r over ray_t: 1 except
+        // for media (see Ray::is_shadow)
+        virtual double transmittance(const Ray& r, Interval ray_t) const { return 1.0; }
+        // area of the actual surface (0 if unknown), for statistics and light power
+        virtual double surface_area() const { return 0.0; }
+        // fills in a hit this object deferred (see Hit); hit() leaves t, u,
+        // v and prim_id as this needs them
+        virtual void surface(const Ray& r, Hit& rec) const {}
+        // material of a single-material surface that implements random() and
+        // pdf_value(), so it can stand in as a light; 0 for everything else
+        virtual uint32_t light_material() const { return 0; }
+        // front-facing normals all lie within acos(cos_theta) of the returned
+        // axis; closed or unknown surfaces answer the whole sphere
+        virtual vec4 normal_bounds(double& cos_theta) const {
+            cos_theta = -1;
+            return vec4(0,0,1);
+        }
 };
 
+inline void Hit::finish(const Ray& r) {
+    if (!object) return;
+    const Hittable* deferred = object;
+    object = nullptr;
+    dpdu = dpdv = vec4(0,0,0); // another candidate's may still be here
+    deferred->surface(r, *this);
+}
+
 class Translate : public Hittable {
     public:
         Translate(shared_ptr<Hittable> object, const vec4& offset)
@@ -59,23 +128,29 @@ class Translate : public Hittable {
             if(!object->hit(offset_r, Ray_t, rec)) {
                 return false;
             }
+            rec.finish(offset_r);
 
             // move intersection point forwards by offset
             rec.p += offset;
             return true;
         }
         AABB bounding_box() const override { return bbox; }
+        void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const override {
+            object->motion_bounds(t0, t1, b0, b1);
+            b0 = b0 + offset;
+            b1 = b1 + offset;
+        }
+        bool contains_media() const override { return object->contains_media(); }
+        double surface_area() const override { return object->surface_area(); }
     private:
         shared_ptr<Hittable> object;
         vec4 offset;
         AABB bbox;
 };
 
-// returns Ray w.r.t object frame for both o and direction
-std::vector<vec4> to_object_frame(const Ray& r, double cos_theta, double sin_theta, int axis) {
-    point4 o;
-    point4 direction;
-
+// Ray w.r.t object frame for both o and direction
+inline void to_object_frame(const Ray& r, double cos_theta, double sin_theta, int axis,
+                            point4& o, vec4& direction) {
     if (axis == 0) {
         o = point4(
             r.o().x(),
@@ -113,14 +188,18 @@ std::vector<vec4> to_object_frame(const Ray& r, double cos_theta, double sin_the
             r.d().z()
         );
     }
-
-    return {o, direction};
 }
 
-std::vector<vec4> to_world_frame(const Hit& rec, double cos_theta, double sin_theta, int axis) {
-    point4 o; // hit point
-    point4 n; // normal
+// a direction (not renormalized) back in the world frame
+inline vec4 rotate_to_world(const vec4& d, double cos_theta, double sin_theta, int axis) {
+    if (axis == 0) return vec4(d.x(), cos_theta * d.y() - sin_theta * d.z(), sin_theta * d.y() + cos_theta * d.z());
+    if (axis == 1) return vec4(cos_theta * d.x() + sin_theta * d.z(), d.y(), -sin_theta * d.x() + cos_theta * d.z());
+    return vec4(cos_theta * d.x() - sin_theta * d.y(), sin_theta * d.x() + cos_theta * d.y(), d.z());
+}
 
+// hit point and unit normal back in the world frame
+inline void to_world_frame(const Hit& rec, double cos_theta, double sin_theta, int axis,
+                           point4& o, vec4& n) {
     if (axis == 0) { // X
 
         o = point4(
@@ -159,7 +238,7 @@ std::vector<vec4> to_world_frame(const Hit& rec, double cos_theta, double sin_th
         );
     }
 
-    return {o, unit_vector(n)};
+    n = unit_vector(n);
 }
 
 class Rotate : public Hittable {
@@ -168,102 +247,83 @@ class Rotate : public Hittable {
             auto radians = degrees_to_radians(angle);
             sin_theta = std::sin(radians);
             cos_theta = std::cos(radians);
-            bbox = object->bounding_box();
-
-            point4 min( infinity,  infinity,  infinity);
-            point4 max(-infinity, -infinity, -infinity);
-
-            for (int i = 0; i < 2; i++) {
-                for (int j = 0; j < 2; j++) {
-                    for (int k = 0; k < 2; k++) {
-                        auto x = i * bbox.x.max + (1-i) * bbox.x.min;
-                        auto y = j * bbox.y.max + (1-j) * bbox.y.min;
-                        auto z = k * bbox.z.max + (1-k) * bbox.z.min;
-
-                        auto new_x =  cos_theta * x + sin_theta * z;
-                        auto new_z = -sin_theta * x + cos_theta * z;
-
-                        vec4 test_vec(new_x, y, new_z); // rotated
-
-                        for (int c = 0; c < 3; c++) {
-                            min[c] = std::fmin(min[c], test_vec[c]);
-                            max[c] = std::fmax(max[c], test_vec[c]);
-                        }
-
-                    }
-                }
-            }
-
-            bbox = AABB(min, max);
+            bbox = rotate_box(object->bounding_box());
         }
         bool hit(const Ray& r, Interval Ray_t, Hit& rec) const override {
             // transform Ray from world to object space (inverse transform)
             // meaning, "rotate by -theta"
-            std::vector<vec4> r_wrt_object = to_object_frame(
-                r, cos_theta, sin_theta, axis
-            );
+            point4 origin;
+            vec4 direction;
+            to_object_frame(r, cos_theta, sin_theta, axis, origin, direction);
 
-            auto origin = r_wrt_object[0];
-            auto direction = r_wrt_object[1];
-            
             Ray rotated_ray(origin, direction, r.time());
 
             // check if intersection exists in obj space
             if (!object->hit(rotated_ray, Ray_t, rec)) {
                 return false;
             }
-
-            std::vector<vec4> r_wrt_world = to_world_frame(
-                rec, cos_theta, sin_theta, axis
-            );            
+            rec.finish(rotated_ray);
 
             // back to world space
-            rec.p = r_wrt_world[0];
-            rec.normal = r_wrt_world[1]; // for non-uniform scaling, need to apply inverse transpose
+            // (for non-uniform scaling, the normal needs the inverse transpose)
+            to_world_frame(rec, cos_theta, sin_theta, axis, rec.p, rec.normal);
+            rec.dpdu = rotate_to_world(rec.dpdu, cos_theta, sin_theta, axis);
+            rec.dpdv = rotate_to_world(rec.dpdv, cos_theta, sin_theta, axis);
 
             return true;
         }
         AABB bounding_box() const override { return bbox; }
+        void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const override {
+            // rotation is linear, so rotating both end boxes stays conservative
+            object->motion_bounds(t0, t1, b0, b1);
+            b0 = rotate_box(b0);
+            b1 = rotate_box(b1);
+        }
+        bool contains_media() const override { return object->contains_media(); }
+        double surface_area() const override { return object->surface_area(); }
     private:
         shared_ptr<Hittable> object;
         double sin_theta;
         double cos_theta;
         AABB bbox;
         int axis; // [0, 2] corresponding to x,y,z axes
-};
-
-class Rotate_y : public Hittable {
-  public:
-    Rotate_y(shared_ptr<Hittable> object, double angle) : object(object) {
-        auto radians = degrees_to_radians(angle);
-        sin_theta = std::sin(radians);
-        cos_theta = std::cos(radians);
-        bbox = object->bounding_box();
-
-        point4 min( infinity,  infinity,  infinity);
-        point4 max(-infinity, -infinity, -infinity);
-
-        for (int i = 0; i < 2; i++) {
-            for (int j = 0; j < 2; j++) {
-                for (int k = 0; k < 2; k++) {
-                    auto x = i*bbox.x.max + (1-i)*bbox.x.min;
-                    auto y = j*bbox.y.max + (1-j)*bbox.y.min;
-                    auto z = k*bbox.z.max + (1-k)*bbox.z.min;
 
-                    auto newx =  cos_theta*x + sin_theta*z;
-                    auto newz = -sin_theta*x + cos_theta*z;
+        AABB rotate_box(const AABB& box) const {
+            // bounds of the object-space box corners taken to world space
+            point4 min( infinity,  infinity,  infinity);
+            point4 max(-infinity, -infinity, -infinity);
 
-                    vec4 tester(newx, y, newz);
+            for (int i = 0; i < 2; i++) {
+                for (int j = 0; j < 2; j++) {
+                    for (int k = 0; k < 2; k++) {
+                        Hit corner;
+                        corner.p = point4(
+                            i * box.x.max + (1-i) * box.x.min,
+                            j * box.y.max + (1-j) * box.y.min,
+                            k * box.z.max + (1-k) * box.z.min);
+                        corner.normal = vec4(1,0,0);
+                        vec4 test_vec, normal;
+                        to_world_frame(corner, cos_theta, sin_theta, axis, test_vec, normal);
 
-                    for (int c = 0; c < 3; c++) {
-                        min[c] = std::fmin(min[c], tester[c]);
-                        max[c] = std::fmax(max[c], tester[c]);
+                        for (int c = 0; c < 3; c++) {
+                            min[c] = std::fmin(min[c], test_vec[c]);
+                            max[c] = std::fmax(max[c], test_vec[c]);
+                        }
                     }
                 }
             }
+
+            return AABB(min, max);
         }
+};
 
-        bbox = AABB(min, max);
+class Rotate_y : public Hittable {
+  public:
+    Rotate_y(shared_ptr<Hittable> object, double angle) : object(object) {
+        auto radians = degrees_to_radians(angle);
+        sin_theta = std::sin(radians);
+        cos_theta = std::cos(radians);
+        bbox = rotate_box(object->bounding_box());
     }
     bool hit(const Ray& r, Interval Ray_t, Hit& rec) const override {
 
@@ -287,6 +347,7 @@ class Rotate_y : public Hittable {
 
         if (!object->hit(rotated_r, Ray_t, rec))
             return false;
+        rec.finish(rotated_r);
 
         // Transform the intersection from object space back to world space.
 
@@ -301,17 +362,53 @@ class Rotate_y : public Hittable {
             rec.normal.y(),
             (-sin_theta * rec.normal.x()) + (cos_theta * rec.normal.z())
         );
+        rec.dpdu = rotate_to_world(rec.dpdu, cos_theta, sin_theta, 1);
+        rec.dpdv = rotate_to_world(rec.dpdv, cos_theta, sin_theta, 1);
 
         return true;
     }
 
     AABB bounding_box() const override { return bbox; }
+    void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const override {
+        object->motion_bounds(t0, t1, b0, b1);
+        b0 = rotate_box(b0);
+        b1 = rotate_box(b1);
+    }
+    bool contains_media() const override { return object->contains_media(); }
+    double surface_area() const override { return object->surface_area(); }
 
     private:
         shared_ptr<Hittable> object;
         double sin_theta;
         double cos_theta;
         AABB bbox;
+
+        AABB rotate_box(const AABB& box) const {
+            point4 min( infinity,  infinity,  infinity);
+            point4 max(-infinity, -infinity, -infinity);
+
+            for (int i = 0; i < 2; i++) {
+                for (int j = 0; j < 2; j++) {
+                    for (int k = 0; k < 2; k++) {
+                        auto x = i*box.x.max + (1-i)*box.x.min;
+                        auto y = j*box.y.max + (1-j)*box.y.min;
+                        auto z = k*box.z.max + (1-k)*box.z.min;
+
+                        auto newx =  cos_theta*x + sin_theta*z;
+                        auto newz = -sin_theta*x + cos_theta*z;
+
+                        vec4 tester(newx, y, newz);
+
+                        for (int c = 0; c < 3; c++) {
+                            min[c] = std::fmin(min[c], tester[c]);
+                            max[c] = std::fmax(max[c], tester[c]);
+                        }
+                    }
+                }
+            }
+
+            return AABB(min, max);
+        }
 };
 
 #endif
\ No newline at end of file
@@ -16,12 +16,17 @@ class HittableList : public Hittable {
     HittableList() {}
     HittableList(shared_ptr<Hittable> object) { add(object); }
 
-    void clear() { objects.clear(); }
+    void clear() {
+        objects.clear();
+        bbox = AABB();
+        has_media = false;
+    }
 
     void add(shared_ptr<Hittable> object) {
         objects.push_back(object);
         bbox = AABB(bbox, object->bounding_box());
         // ok for bbox to be empty; it gets overwritten by object box
+        has_media = has_media || object->contains_media();
     }
 
     bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
@@ -42,6 +47,27 @@ class HittableList : public Hittable {
     }
 
     AABB bounding_box() const override { return bbox; }
+    AABB transformed_bounds(const Mat34& m) const override {
+        AABB box = AABB::empty;
+        for (const auto& object : objects) box = AABB(box, object->transformed_bounds(m));
+        return box;
+    }
+    void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const override {
+        b0 = b1 = AABB::empty;
+        for (const auto& object : objects) {
+            AABB c0, c1;
+            object->motion_bounds(t0, t1, c0, c1);
+            b0 = AABB(b0, c0);
+            b1 = AABB(b1, c1);
+        }
+    }
+    bool contains_media() const override { return has_media; }
+
+    double surface_area() const override {
+        double sum = 0.0;
+        for (const auto& object : objects) sum += object->surface_area();
+        return sum;
+    }
 
     double pdf_value(const point4& origin, const vec4& dir) const override {
         auto weight = 1.0 / objects.size();
@@ -63,6 +89,7 @@ class HittableList : public Hittable {
 
     private:
         AABB bbox; // scene content bbox (if miss, doesn't check anything else)
+        bool has_media = false;
 };
 
 #endif
\ No newline at end of file
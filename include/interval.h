@@ -5,33 +5,33 @@
 
 class Interval {
     public:
-        double min, max;
+        real min, max;
         Interval() : min(+infinity), max(-infinity) {}
-        Interval(double min, double max) : min(min), max(max) {}
+        Interval(real min, real max) : min(min), max(max) {}
         Interval(const Interval& a, const Interval& b) {
             min = a.min <= b.min ? a.min : b.min; // choose the smallest
             max = a.max >= b.max ? a.max : b.max; // choose the largest
         }
 
-        double size() const {
+        real size() const {
             return max - min;
         }
         
-        bool contains(double x) const {
+        bool contains(real x) const {
             return min <= x && x <= max;
         }
 
-        bool surrounds(double x) const {
+        bool surrounds(real x) const {
             return min < x && x < max;
         }
 
-        double clamp(double x) const {
+        real clamp(real x) const {
             if (x < min) { return min; }
             if (x > max) { return max; }
             return x;
         }
 
-        Interval expand(double delta) const {
+        Interval expand(real delta) const {
             auto padding = delta / 2;
             return Interval(min - padding, max + padding);
         }
@@ -43,11 +43,11 @@ const Interval Interval::empty    = Interval(+infinity, -infinity);
 const Interval Interval::universe = Interval(-infinity, +infinity);
 
 // for Translate
-Interval operator+(const Interval& ival, double displacement) {
+Interval operator+(const Interval& ival, real displacement) {
     return Interval(ival.min + displacement, ival.max + displacement);
 }
 
-Interval operator+(double displacement, const Interval& ival) {
+Interval operator+(real displacement, const Interval& ival) {
     return ival + displacement;
 }
 
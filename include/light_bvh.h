@@ -0,0 +1,397 @@
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include "hittable_list.h"
+#include "bvh.h"
+#include "sbvh.h"
+#include "compiled_scene.h"
+#include "material.h"
+#include <algorithm>
+
+// Bounds of a group of emitters, as in PBRT's light BVH: where they are
+// (bounds), how much they emit (phi), the cone their normals lie in (axis w,
+// cos_theta_o) and how far past a normal they still emit (cos_theta_e).
+struct LightBounds {
+    AABB bounds = AABB::empty;
+    vec4 w = vec4(0,0,1);
+    double phi = 0;
+    double cos_theta_o = 1;
+    double cos_theta_e = 1;
+
+    LightBounds() {}
+    LightBounds(const AABB& bounds, const vec4& w, double phi, double cos_theta_o, double cos_theta_e)
+      : bounds(bounds), w(w), phi(phi), cos_theta_o(cos_theta_o), cos_theta_e(cos_theta_e) {}
+
+    point4 centroid() const { return point4(bounds.centroid(0), bounds.centroid(1), bounds.centroid(2)); }
+
+    static LightBounds merge(const LightBounds& a, const LightBounds& b) {
+        if (a.phi == 0) return b;
+        if (b.phi == 0) return a;
+        LightBounds m;
+        m.bounds = AABB(a.bounds, b.bounds);
+        m.phi = a.phi + b.phi;
+        m.cos_theta_e = std::fmin(a.cos_theta_e, b.cos_theta_e);
+        merge_cones(a.w, a.cos_theta_o, b.w, b.cos_theta_o, m.w, m.cos_theta_o);
+        return m;
+    }
+
+    // Conservative estimate of the light reaching p (with normal n, or a zero
+    // vector if there is none): power over squared distance, times the best
+    // emission and incidence cosines any point in the bounds could achieve.
+    double importance(const point4& p, const vec4& n) const {
+        point4 pc = centroid();
+        vec4 diagonal(bounds.x.size(), bounds.y.size(), bounds.z.size());
+        double d2 = std::fmax((p - pc).norm2(), 0.25 * diagonal.norm2());
+
+        vec4 wi = unit_vector(p - pc);
+        double cos_w = dot(w, wi);
+        double sin_w = safe_sqrt(1 - cos_w * cos_w);
+
+        // directions from p that can reach the box
+        double cos_b = -1;
+        double r2 = 0.25 * diagonal.norm2();
+        if ((p - pc).norm2() > r2) cos_b = safe_sqrt(1 - r2 / (p - pc).norm2());
+        double sin_b = safe_sqrt(1 - cos_b * cos_b);
+
+        // angle between wi and the cone, shrunk by what the box subtends
+        double sin_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+        double cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, cos_theta_o);
+        double sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, cos_theta_o);
+        double cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+        if (cos_p <= cos_theta_e) return 0;
+
+        double result = phi * cos_p / d2;
+        if (n.norm2() > 0) {
+            double cos_i = std::fabs(dot(wi, n));
+            double sin_i = safe_sqrt(1 - cos_i * cos_i);
+            result *= cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+        }
+        return std::fmax(result, 0);
+    }
+
+    // PBRT's split cost: power times the solid angle the normals can emit
+    // into, times the box area (stretched along thin split axes)
+    double cost(int axis) const {
+        double theta_o = std::acos(clamp(cos_theta_o)), theta_e = std::acos(clamp(cos_theta_e));
+        double theta_w = std::fmin(theta_o + theta_e, pi);
+        double sin_o = std::sin(theta_o);
+        double m_omega = 2 * pi * (1 - cos_theta_o)
+                       + pi / 2 * (2 * theta_w * sin_o - std::cos(theta_o - 2 * theta_w)
+                                   - 2 * theta_o * sin_o + cos_theta_o);
+        double extent[3] = {bounds.x.size(), bounds.y.size(), bounds.z.size()};
+        double kr = std::max(extent[0], std::max(extent[1], extent[2]))
+                  / std::fmax(extent[axis], 1e-8);
+        return phi * m_omega * kr * bounds.surface_area();
+    }
+
+    private:
+        static double safe_sqrt(double x) { return std::sqrt(std::fmax(0, x)); }
+        static double clamp(double c) { return std::fmin(1, std::fmax(-1, c)); }
+
+        // cos and sin of max(0, a - b), given those of a and b
+        static double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+            if (cos_a > cos_b) return 1;
+            return cos_a * cos_b + sin_a * sin_b;
+        }
+        static double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+            if (cos_a > cos_b) return 0;
+            return sin_a * cos_b - cos_a * sin_b;
+        }
+
+        // smallest cone around both cones (w_a, cos_a) and (w_b, cos_b)
+        static void merge_cones(const vec4& w_a, double cos_a, const vec4& w_b, double cos_b,
+                                vec4& w, double& cos_theta) {
+            double theta_a = std::acos(clamp(cos_a)), theta_b = std::acos(clamp(cos_b));
+            double theta_d = std::acos(clamp(dot(w_a, w_b)));
+            if (std::fmin(theta_d + theta_b, pi) <= theta_a) { w = w_a; cos_theta = cos_a; return; }
+            if (std::fmin(theta_d + theta_a, pi) <= theta_b) { w = w_b; cos_theta = cos_b; return; }
+
+            double theta_o = 0.5 * (theta_a + theta_d + theta_b);
+            vec4 axis = cross(w_a, w_b);
+            if (theta_o >= pi || axis.norm2() == 0) { w = w_a; cos_theta = -1; return; }
+
+            // turn w_a towards w_b until the cone just covers both
+            double theta_r = theta_o - theta_a;
+            axis = unit_vector(axis);
+            w = unit_vector(std::cos(theta_r) * w_a + std::sin(theta_r) * cross(axis, w_a));
+            cos_theta = std::cos(theta_o);
+        }
+};
+
+// Light list built from the scene itself: every surface whose material is a
+// DiffuseLight and that can be sampled (see Hittable::light_material()) is
+// bounded by its power and normal cone, and the bounds go into a binary tree.
+// random() walks down it choosing each child by its importance for the
+// shading point, so lights that are close, bright and facing it get picked
+// in O(log n) instead of uniformly. pdf_value() only visits the emitters the
+// direction actually passes through, and for each follows its stored path
+// from the root to get the probability it was chosen.
+//
+// An infinite light (EnvironmentLight) can't be bounded, so it sits beside
+// the tree and gets half the samples when there are emitters too.
+//
+// The emitters aren't owned; the world passed in has to outlive the tree.
+class LightBVH : public Hittable {
+    public:
+        explicit LightBVH(const Hittable& world, const Hittable* infinite = nullptr) : infinite(infinite) {
+            std::vector<Entry> entries;
+            collect(world, entries);
+            trails.assign(lights.size(), 0);
+            if (!entries.empty()) build(entries, 0, entries.size(), 0, 0);
+            bbox = nodes.empty() ? AABB::empty : nodes[0].lb.bounds;
+        }
+
+        bool empty() const { return nodes.empty() && !infinite; }
+        size_t size() const { return lights.size(); }
+        double total_power() const { return nodes.empty() ? 0.0 : nodes[0].lb.phi; }
+
+        // Picks an emitter for shading point p with normal n (a zero vector
+        // if there is none) and returns it; pmf is the chance of that pick.
+        const Hittable* sample(const point4& p, const vec4& n, double& pmf) const {
+            pmf = 0;
+            double p_infinite = infinite_probability();
+            if (p_infinite > 0 && gen_random_double() < p_infinite) {
+                pmf = p_infinite;
+                return infinite;
+            }
+            if (nodes.empty()) return nullptr;
+            pmf = 1 - p_infinite;
+            int index = 0;
+            while (!nodes[index].leaf) {
+                double p_left = left_probability(index, p, n);
+                if (gen_random_double() < p_left) {
+                    pmf *= p_left;
+                    index = index + 1;
+                } else {
+                    pmf *= 1 - p_left;
+                    index = nodes[index].offset;
+                }
+            }
+            return lights[nodes[index].offset];
+        }
+
+        // chance that sample(p, n) picks light number `light`
+        double pmf(const point4& p, const vec4& n, int light) const {
+            if (nodes.empty()) return 0;
+            uint64_t trail = trails[light];
+            double result = 1 - infinite_probability();
+            int index = 0;
+            while (!nodes[index].leaf) {
+                double p_left = left_probability(index, p, n);
+                if (trail & 1) {
+                    result *= 1 - p_left;
+                    index = nodes[index].offset;
+                } else {
+                    result *= p_left;
+                    index = index + 1;
+                }
+                trail >>= 1;
+            }
+            return result;
+        }
+
+        double pdf_value(const point4& origin, const vec4& dir) const override {
+            double sum = infinite ? infinite_probability() * infinite->pdf_value(origin, dir) : 0.0;
+            if (nodes.empty()) return sum;
+            Ray r(origin, dir);
+            Interval ray_t(0.001, infinity);
+
+            int stack[64];
+            int top = 0;
+            stack[top++] = 0;
+            while (top > 0) {
+                int index = stack[--top];
+                const Node& node = nodes[index];
+                if (!node.lb.bounds.hit(r, ray_t)) continue;
+                if (node.leaf) {
+                    double density = lights[node.offset]->pdf_value(origin, dir);
+                    if (density > 0) sum += density * pmf(origin, vec4(0,0,0), node.offset);
+                } else {
+                    stack[top++] = node.offset;
+                    stack[top++] = index + 1;
+                }
+            }
+            return sum;
+        }
+
+        vec4 random(const point4& origin) const override {
+            double pick_pmf;
+            const Hittable* light = sample(origin, vec4(0,0,0), pick_pmf);
+            return light ? light->random(origin) : vec4(1,0,0);
+        }
+
+        bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
+            if (nodes.empty()) return false;
+
+            bool hit_anything = false;
+            int stack[64];
+            int top = 0;
+            stack[top++] = 0;
+            while (top > 0) {
+                int index = stack[--top];
+                const Node& node = nodes[index];
+                if (!node.lb.bounds.hit(r, ray_t)) continue;
+                if (node.leaf) {
+                    if (lights[node.offset]->hit(r, ray_t, rec)) {
+                        hit_anything = true;
+                        ray_t.max = rec.t;
+                    }
+                } else {
+                    stack[top++] = node.offset;
+                    stack[top++] = index + 1;
+                }
+            }
+            return hit_anything;
+        }
+
+        AABB bounding_box() const override { return bbox; }
+
+    private:
+        struct Node {
+            LightBounds lb;
+            int offset; // leaf: light index, interior: right child (the left one follows)
+            bool leaf;
+        };
+
+        struct Entry {
+            LightBounds lb;
+            int light;
+        };
+
+        std::vector<const Hittable*> lights;
+        const Hittable* infinite;
+        std::vector<uint64_t> trails; // bit d: went right at depth d on the way down
+        std::vector<Node> nodes;
+        AABB bbox;
+
+        static const int buckets = 12;
+
+        void collect(const Hittable& object, std::vector<Entry>& entries) {
+            if (auto list = dynamic_cast<const HittableList*>(&object)) {
+                for (const auto& child : list->objects) collect(*child, entries);
+            } else if (auto node = dynamic_cast<const BVH_node*>(&object)) {
+                collect(*node->left, entries);
+                if (node->right != node->left) collect(*node->right, entries);
+            } else if (auto bvh = dynamic_cast<const SBVH*>(&object)) {
+                for (const auto& child : bvh->primitives()) collect(*child, entries);
+            } else if (auto compiled = dynamic_cast<const CompiledScene*>(&object)) {
+                collect(compiled->source_objects(), entries);
+            } else if (emitter(object)) {
+                LightBounds lb = light_bounds(object);
+                if (lb.phi <= 0) return; // black, never worth a sample
+                entries.push_back({lb, int(lights.size())});
+                lights.push_back(&object);
+            }
+        }
+
+        static const DiffuseLight* emitter(const Hittable& object) {
+            uint32_t id = object.light_material();
+            if (id == 0) return nullptr;
+            const Material* mat = MaterialTable::scene()[id];
+            if (!mat || mat->kind() != MaterialKind::diffuse_light) return nullptr;
+            return static_cast<const DiffuseLight*>(mat);
+        }
+
+        static LightBounds light_bounds(const Hittable& object) {
+            // mean radiance from a few lookups over the texture's uv square
+            const Texture& tex = emitter(object)->emission();
+            AABB box = object.bounding_box();
+            point4 center(box.centroid(0), box.centroid(1), box.centroid(2));
+            double radiance = 0;
+            for (int j = 0; j < 4; j++) {
+                for (int i = 0; i < 4; i++) {
+                    Color c = texture_value(tex, (i + 0.5) / 4, (j + 0.5) / 4, center);
+                    radiance += (c.x() + c.y() + c.z()) / 3;
+                }
+            }
+            radiance /= 16;
+
+            // one-sided Lambertian emitter: phi = pi * L * area, over a hemisphere
+            double cos_theta_o;
+            vec4 w = object.normal_bounds(cos_theta_o);
+            return LightBounds(box, w, pi * radiance * object.surface_area(), cos_theta_o, 0);
+        }
+
+        double infinite_probability() const {
+            if (!infinite) return 0;
+            return nodes.empty() ? 1 : 0.5;
+        }
+
+        double left_probability(int index, const point4& p, const vec4& n) const {
+            double l = nodes[index + 1].lb.importance(p, n);
+            double r = nodes[nodes[index].offset].lb.importance(p, n);
+            // both bounded to nothing: still a valid distribution over the subtree
+            return (l + r > 0) ? l / (l + r) : 0.5;
+        }
+
+        int build(std::vector<Entry>& entries, size_t start, size_t end, uint64_t trail, int depth) {
+            int index = int(nodes.size());
+            nodes.push_back(Node());
+
+            if (end - start == 1) {
+                nodes[index] = {entries[start].lb, entries[start].light, true};
+                trails[entries[start].light] = trail;
+                return index;
+            }
+
+            LightBounds all;
+            AABB centroids = AABB::empty;
+            for (size_t i = start; i < end; i++) {
+                all = LightBounds::merge(all, entries[i].lb);
+                point4 c = entries[i].lb.centroid();
+                centroids = AABB(centroids, AABB(c, c));
+            }
+
+            // bucketed split on the PBRT cost; past depth 32 (or if nothing
+            // separates) a median split keeps the trail within 64 bits
+            size_t mid = start;
+            double best_cost = infinity;
+            int best_axis = -1, best_bucket = 0;
+            for (int axis = 0; axis < 3 && depth < 32; axis++) {
+                const Interval& span = centroids.axis_interval(axis);
+                if (span.size() <= 0) continue;
+                LightBounds bins[buckets];
+                for (size_t i = start; i < end; i++) {
+                    LightBounds& bin = bins[bucket_of(entries[i], axis, span)];
+                    bin = LightBounds::merge(bin, entries[i].lb);
+                }
+
+                for (int split = 1; split < buckets; split++) {
+                    LightBounds below, above;
+                    for (int b = 0; b < split; b++) below = LightBounds::merge(below, bins[b]);
+                    for (int b = split; b < buckets; b++) above = LightBounds::merge(above, bins[b]);
+                    double cost = below.cost(axis) + above.cost(axis);
+                    if (below.phi > 0 && above.phi > 0 && cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_bucket = split;
+                    }
+                }
+            }
+
+            if (best_axis >= 0) {
+                const Interval& span = centroids.axis_interval(best_axis);
+                auto first_above = std::partition(entries.begin() + start, entries.begin() + end,
+                    [&](const Entry& e) { return bucket_of(e, best_axis, span) < best_bucket; });
+                mid = size_t(first_above - entries.begin());
+            }
+            if (mid == start || mid == end) {
+                int axis = centroids.longest_axis();
+                mid = (start + end) / 2;
+                std::nth_element(entries.begin() + start, entries.begin() + mid, entries.begin() + end,
+                    [axis](const Entry& a, const Entry& b) { return a.lb.centroid()[axis] < b.lb.centroid()[axis]; });
+            }
+
+            build(entries, start, mid, trail, depth + 1);
+            int right = build(entries, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+            nodes[index] = {all, right, false};
+            return index;
+        }
+
+        static int bucket_of(const Entry& e, int axis, const Interval& span) {
+            int b = int(buckets * (e.lb.centroid()[axis] - span.min) / span.size());
+            return std::min(std::max(b, 0), buckets - 1);
+        }
+};
+
+#endif
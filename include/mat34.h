@@ -0,0 +1,111 @@
+#ifndef MAT34_H
+#define MAT34_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+// 3x4 affine matrix: a 3x3 linear part and a translation column.
+// point() applies both, vector() only the linear part.
+class Mat34 {
+    public:
+        double m[3][4];
+
+        Mat34() : m{{1,0,0,0}, {0,1,0,0}, {0,0,1,0}} {}
+
+        static Mat34 translation(const vec4& offset) {
+            Mat34 r;
+            for (int i = 0; i < 3; i++) r.m[i][3] = offset[i];
+            return r;
+        }
+
+        static Mat34 scaling(const vec4& factors) {
+            Mat34 r;
+            for (int i = 0; i < 3; i++) r.m[i][i] = factors[i];
+            return r;
+        }
+
+        // right-handed rotation about axis 0, 1 or 2 (x, y, z); the same
+        // direction as Rotate / Rotate_y
+        static Mat34 rotation(int axis, double degrees) {
+            auto radians = degrees_to_radians(degrees);
+            auto s = std::sin(radians);
+            auto c = std::cos(radians);
+            int a = (axis + 1) % 3, b = (axis + 2) % 3;
+            Mat34 r;
+            r.m[a][a] = c;  r.m[a][b] = -s;
+            r.m[b][a] = s;  r.m[b][b] = c;
+            return r;
+        }
+
+        point4 point(const point4& p) const {
+            return point4(m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+                          m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+                          m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]);
+        }
+
+        vec4 vector(const vec4& v) const {
+            return vec4(m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                        m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                        m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+        }
+
+        // transpose of the linear part times v; with the inverse matrix this
+        // takes normals to the other space
+        vec4 transpose_vector(const vec4& v) const {
+            return vec4(m[0][0]*v[0] + m[1][0]*v[1] + m[2][0]*v[2],
+                        m[0][1]*v[0] + m[1][1]*v[1] + m[2][1]*v[2],
+                        m[0][2]*v[0] + m[1][2]*v[1] + m[2][2]*v[2]);
+        }
+
+        double determinant() const {
+            return m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1])
+                 - m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0])
+                 + m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+        }
+
+        // Inverse transform. A singular matrix (zero scale) gives infinities
+        // and is the caller's problem.
+        Mat34 inverse() const {
+            Mat34 r;
+            auto inv_det = 1.0 / determinant();
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    // adjugate: cofactor of (j, i)
+                    int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+                    int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+                    r.m[i][j] = (m[j1][i1]*m[j2][i2] - m[j1][i2]*m[j2][i1]) * inv_det;
+                }
+            }
+            for (int i = 0; i < 3; i++)
+                r.m[i][3] = -(r.m[i][0]*m[0][3] + r.m[i][1]*m[1][3] + r.m[i][2]*m[2][3]);
+            return r;
+        }
+
+        // Bounds of a transformed box, from its center and half extents
+        // (Arvo 1990); exactly the box around the eight moved corners.
+        AABB transform_box(const AABB& box) const {
+            if (box.is_empty()) return box;
+            point4 c(box.centroid(0), box.centroid(1), box.centroid(2));
+            vec4 half(0.5 * box.x.size(), 0.5 * box.y.size(), 0.5 * box.z.size());
+            point4 center = point(c);
+            vec4 extent;
+            for (int i = 0; i < 3; i++)
+                extent[i] = std::fabs(m[i][0])*half[0] + std::fabs(m[i][1])*half[1]
+                          + std::fabs(m[i][2])*half[2];
+            return AABB(center - extent, center + extent);
+        }
+};
+
+// a * b: apply b first, then a
+inline Mat34 operator*(const Mat34& a, const Mat34& b) {
+    Mat34 r;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            r.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j];
+        }
+        r.m[i][3] += a.m[i][3];
+    }
+    return r;
+}
+
+#endif
@@ -6,14 +6,41 @@
 // #include "onb.h"
 #include "pdf.h"
 
+// Ray differentials through a specular bounce. The neighbouring rays leave
+// from where they met the tangent plane (p + dpdx, p + dpdy) and turn the
+// way the main ray did: mirrored if `scattered` went back out, refracted with
+// index ratio ri if it went in. Curvature is ignored, so a curved mirror
+// spreads them a little less than it should.
+inline void bend_differentials(const Ray& r_in, const Hit& rec, const Ray& scattered,
+                               const RayDifferential& in, const vec4& dpdx, const vec4& dpdy,
+                               double ri, RayDifferential& out) {
+    const vec4& n = rec.normal;
+    bool reflected = dot(scattered.d(), n) > 0; // n faces the incoming ray
+    auto bend = [&](const vec4& d) {
+        return reflected ? reflect(unit_vector(d), n) : refract(d, n, ri);
+    };
+    vec4 base = bend(r_in.d());
+    vec4 s = unit_vector(scattered.d());
+    out.rx_o = rec.p + dpdx;
+    out.ry_o = rec.p + dpdy;
+    out.rx_d = s + (bend(in.rx_d) - base);
+    out.ry_d = s + (bend(in.ry_d) - base);
+}
+
 class ScatterRecord {
     public:
         Color attenuation;
-        shared_ptr<PDF> pdf_ptr;
+        SurfacePDF pdf; // by value; none for specular materials
         bool skip_pdf;
         Ray skip_pdf_ray;
 };
 
+// Built-in materials are a closed set, tagged like textures (texture.h):
+// the material_*() functions below switch to the concrete final class so the
+// render loop inlines the shading code. Other subclasses stay `custom` and go
+// through the virtual calls.
+enum class MaterialKind { custom, lambertian, metal, dielectric, diffuse_light, isotropic };
+
 class Material {
     public:
         virtual ~Material() = default;
@@ -34,20 +61,25 @@ class Material {
         virtual double scattering_pdf(const Ray& r_in, const Hit& rec, const Ray& scattered) const {
             return 0.0;
         }
+
+        MaterialKind kind() const { return tag; }
+
+    protected:
+        MaterialKind tag = MaterialKind::custom;
 };
 
-class Lambertian : public Material {
+class Lambertian final : public Material {
     public:
-        Lambertian(const Color& albedo) : tex(make_shared<SolidColor>(albedo)) {}
-        Lambertian(shared_ptr<Texture> tex) : tex(tex) {}
+        Lambertian(const Color& albedo) : tex(make_scene_shared<SolidColor>(albedo)) { tag = MaterialKind::lambertian; }
+        Lambertian(shared_ptr<Texture> tex) : tex(tex) { tag = MaterialKind::lambertian; }
         bool scatter(
             const Ray& r_in, // ray going in
             const Hit& rec,  // store hit record data
             ScatterRecord& srec)
             const override
         {
-            srec.attenuation = tex->value(rec.u, rec.v, rec.p);
-            srec.pdf_ptr = make_shared<CosinePDF>(rec.normal);
+            srec.attenuation = texture_value(*tex, rec.u, rec.v, rec.p, rec.footprint);
+            srec.pdf = SurfacePDF::cosine_about(rec.normal);
             srec.skip_pdf = false;
             return true;
             // ONB uvw(rec.normal); // generalized local "z-axis"
@@ -87,9 +119,9 @@ class Lambertian : public Material {
         shared_ptr<Texture> tex;
 };
 
-class Metal : public Material {
+class Metal final : public Material {
     public: 
-        Metal(const Color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+        Metal(const Color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) { tag = MaterialKind::metal; }
         // 'scatter'defines how an incoming ray interacts with material to produce outgoing ray
         // if diffuse, this is somewhat random, and if 1.0 albedo, fully reflects.
         // 'attenuation' is the scaling factor of light's intensity
@@ -104,28 +136,34 @@ class Metal : public Material {
                 reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
                 // scattered = Ray(rec.p, reflected, r_in.time()); // hit point to outgoing ray
                 srec.attenuation = albedo;
-                srec.pdf_ptr = nullptr;
                 srec.skip_pdf = true;
                 srec.skip_pdf_ray = Ray(rec.p, reflected, r_in.time());
 
                 return true;
             }
 
+        bool differentials(const Ray& r_in, const Hit& rec, const Ray& scattered,
+                           const RayDifferential& in, const vec4& dpdx, const vec4& dpdy,
+                           RayDifferential& out) const {
+            // fuzz moves the neighbours along with the ray
+            bend_differentials(r_in, rec, scattered, in, dpdx, dpdy, 0, out);
+            return true;
+        }
+
     private:
         Color albedo;
         double fuzz;
 };
 
-class Dielectric : public Material {
+class Dielectric final : public Material {
     public:
-        Dielectric(double index) : refraction_index(index) {};
+        Dielectric(double index) : refraction_index(index) { tag = MaterialKind::dielectric; }
         bool scatter(
             const Ray& r_in, 
             const Hit& rec,
             ScatterRecord& srec)
         const override {
             srec.attenuation = Color(1.0, 1.0, 1.0);
-            srec.pdf_ptr = nullptr;
             srec.skip_pdf = true;
             double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
             // renormalize due to numerical errors
@@ -152,6 +190,14 @@ class Dielectric : public Material {
             return true;
         }
 
+        bool differentials(const Ray& r_in, const Hit& rec, const Ray& scattered,
+                           const RayDifferential& in, const vec4& dpdx, const vec4& dpdy,
+                           RayDifferential& out) const {
+            double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
+            bend_differentials(r_in, rec, scattered, in, dpdx, dpdy, ri, out);
+            return true;
+        }
+
     private:
         double refraction_index;
 
@@ -163,30 +209,32 @@ class Dielectric : public Material {
         }
 };
 
-class DiffuseLight : public Material {
+class DiffuseLight final : public Material {
     public:
-        DiffuseLight(shared_ptr<Texture> tex) : tex(tex) {}
-        DiffuseLight(const Color& emit) : tex(make_shared<SolidColor>(emit)) {}
+        DiffuseLight(shared_ptr<Texture> tex) : tex(tex) { tag = MaterialKind::diffuse_light; }
+        DiffuseLight(const Color& emit) : tex(make_scene_shared<SolidColor>(emit)) { tag = MaterialKind::diffuse_light; }
 
-        Color emitted(const Ray& r_in, const Hit& rec, double u, double v, const point4& p) const {
+        Color emitted(const Ray& r_in, const Hit& rec, double u, double v, const point4& p) const override {
             if (!rec.front_face) { return Color(0,0,0); } // one-sided light
-            return tex->value(u,v,p);
+            return texture_value(*tex, u, v, p, rec.footprint);
         }
 
+        const Texture& emission() const { return *tex; }
+
     private:
         shared_ptr<Texture> tex;
 };
 
-class Isotropic : public Material {
+class Isotropic final : public Material {
     public:
-        Isotropic(const Color& albedo) : tex(make_shared<SolidColor>(albedo)) {}
-        Isotropic(shared_ptr<Texture> albedo) : tex(tex) {}
+        Isotropic(const Color& albedo) : tex(make_scene_shared<SolidColor>(albedo)) { tag = MaterialKind::isotropic; }
+        Isotropic(shared_ptr<Texture> albedo) : tex(albedo) { tag = MaterialKind::isotropic; }
 
         bool scatter(const Ray& r_in, const Hit& rec, ScatterRecord& srec) const override {
             // scatter in a random direction
             // scattered = Ray(rec.p, random_unit_vector(), r_in.time());
-            srec.attenuation = tex->value(rec.u, rec.v, rec.p);
-            srec.pdf_ptr = make_shared<SpherePDF>();
+            srec.attenuation = texture_value(*tex, rec.u, rec.v, rec.p);
+            srec.pdf = SurfacePDF::uniform_sphere();
             srec.skip_pdf = false;
             return true;
         }
@@ -198,4 +246,58 @@ class Isotropic : public Material {
         shared_ptr<Texture> tex;
 };
 
-#endif
\ No newline at end of file
+// Non-virtual entry points for the render loop. Only DiffuseLight emits and
+// only the sampled (non-specular) materials have a scattering pdf.
+inline Color material_emitted(const Material& mat, const Ray& r_in, const Hit& rec,
+                              double u, double v, const point4& p) {
+    switch (mat.kind()) {
+        case MaterialKind::diffuse_light:
+            return static_cast<const DiffuseLight&>(mat).emitted(r_in, rec, u, v, p);
+        case MaterialKind::custom:
+            return mat.emitted(r_in, rec, u, v, p);
+        default:
+            return Color(0,0,0);
+    }
+}
+
+inline bool material_scatter(const Material& mat, const Ray& r_in, const Hit& rec, ScatterRecord& srec) {
+    switch (mat.kind()) {
+        case MaterialKind::lambertian: return static_cast<const Lambertian&>(mat).scatter(r_in, rec, srec);
+        case MaterialKind::metal:      return static_cast<const Metal&>(mat).scatter(r_in, rec, srec);
+        case MaterialKind::dielectric: return static_cast<const Dielectric&>(mat).scatter(r_in, rec, srec);
+        case MaterialKind::isotropic:  return static_cast<const Isotropic&>(mat).scatter(r_in, rec, srec);
+        case MaterialKind::custom:     return mat.scatter(r_in, rec, srec);
+        default:                       return false;
+    }
+}
+
+// differentials of the specular ray scatter() just made; false when the
+// material doesn't track them (and lookups down the path go unfiltered)
+inline bool material_differentials(const Material& mat, const Ray& r_in, const Hit& rec,
+                                   const Ray& scattered, const RayDifferential& in,
+                                   const vec4& dpdx, const vec4& dpdy, RayDifferential& out) {
+    switch (mat.kind()) {
+        case MaterialKind::metal:
+            return static_cast<const Metal&>(mat).differentials(r_in, rec, scattered, in, dpdx, dpdy, out);
+        case MaterialKind::dielectric:
+            return static_cast<const Dielectric&>(mat).differentials(r_in, rec, scattered, in, dpdx, dpdy, out);
+        default:
+            return false;
+    }
+}
+
+inline double material_scattering_pdf(const Material& mat, const Ray& r_in, const Hit& rec,
+                                      const Ray& scattered) {
+    switch (mat.kind()) {
+        case MaterialKind::lambertian:
+            return static_cast<const Lambertian&>(mat).scattering_pdf(r_in, rec, scattered);
+        case MaterialKind::isotropic:
+            return static_cast<const Isotropic&>(mat).scattering_pdf(r_in, rec, scattered);
+        case MaterialKind::custom:
+            return mat.scattering_pdf(r_in, rec, scattered);
+        default:
+            return 0.0;
+    }
+}
+
+#endif
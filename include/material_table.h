@@ -0,0 +1,55 @@
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+
+#include "rtweekend.h"
+#include <cstdint>
+#include <unordered_map>
+
+class Material;
+
+// Scene materials by 32-bit id. Primitives and hit records carry the id and
+// the table keeps the materials alive, so a hit copies four bytes instead of
+// bumping a shared_ptr refcount. Id 0 is "no material" (lights-only quads,
+// meshes without one).
+//
+// Materials are registered while the scene is built; lookups during the
+// render are read-only and safe from any thread.
+class MaterialTable {
+    public:
+        static MaterialTable& scene() {
+            static MaterialTable table;
+            return table;
+        }
+
+        // same material, same id
+        uint32_t add(shared_ptr<Material> mat) {
+            if (!mat) return 0;
+            auto it = ids.find(mat.get());
+            if (it != ids.end()) return it->second;
+            uint32_t id = uint32_t(lookup.size());
+            owned.push_back(mat);
+            lookup.push_back(mat.get());
+            ids[mat.get()] = id;
+            return id;
+        }
+
+        const Material* operator[](uint32_t id) const { return lookup[id]; }
+        size_t size() const { return lookup.size(); }
+
+    private:
+        MaterialTable() : owned(1), lookup(1, nullptr) {
+            // materials may live in the scene arena; create it first so it
+            // is destroyed after this table
+            scene_arena();
+        }
+
+        std::vector<shared_ptr<Material>> owned;
+        std::vector<const Material*> lookup; // raw pointers, no refcount traffic
+        std::unordered_map<const Material*, uint32_t> ids;
+};
+
+inline uint32_t material_id(shared_ptr<Material> mat) {
+    return MaterialTable::scene().add(mat);
+}
+
+#endif
@@ -0,0 +1,441 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "hittable.h"
+#include "sbvh.h"
+#include "simd.h"
+#include "triangle.h"
+#include <cstdint>
+
+// Indexed triangle mesh. Vertex attributes live in shared float arrays and
+// faces only store indices, so a triangle costs a few dozen bytes instead of
+// a heap-allocated Triangle object. The mesh owns its own BVH over faces.
+//
+// Leaves keep copies of their triangles in SIMD_WIDTH-wide SoA packets, and
+// a ray is tested against a whole packet at once with the watertight
+// algorithm from triangle.h evaluated in float lanes.
+
+struct vec3f {
+    float x, y, z;
+    float operator[](int i) const { return (i == 0) ? x : (i == 1) ? y : z; }
+};
+
+struct vec2f {
+    float u, v;
+};
+
+inline vec4 to_vec4(const vec3f& v) { return vec4(v.x, v.y, v.z); }
+inline vec3f to_vec3f(const vec4& v) { return {float(v.x()), float(v.y()), float(v.z())}; }
+
+// 32-byte BVH node for meshes; float bounds are rounded outwards so they
+// still contain the (float) vertices exactly
+struct MeshBVHNode {
+    float lo[3], hi[3];
+    int32_t offset;  // leaf: first triangle packet, interior: right child
+    uint16_t count;  // faces in the leaf, 0 for interior nodes
+    uint16_t axis;
+};
+
+// SIMD_WIDTH triangles of one leaf; unused lanes of the last packet are
+// zeroed and masked off by the face count
+struct TrianglePacket {
+    float v[3][3][SIMD_WIDTH]; // [vertex][axis][lane]
+    uint32_t face[SIMD_WIDTH];
+};
+
+// Per-ray constants of the float kernel
+struct PacketRay {
+    WatertightRay shear;
+    int k[3];            // kx, ky, kz
+    float o[3];          // origin, original axis order
+    float sx, sy, sz;
+
+    PacketRay(const Ray& r) : shear(r.d()) {
+        k[0] = shear.kx; k[1] = shear.ky; k[2] = shear.kz;
+        for (int a = 0; a < 3; a++) o[a] = float(r.o()[a]);
+        sx = float(shear.sx); sy = float(shear.sy); sz = float(shear.sz);
+    }
+};
+
+// nearest floats below / above a double, for bounds that must stay conservative
+inline float float_below(double x) {
+    float f = float(x);
+    return (double(f) > x) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float float_above(double x) {
+    float f = float(x);
+    return (double(f) < x) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// bound on the relative rounding error of three float operations
+constexpr double mesh_box_gamma = 3 * 0.5 * std::numeric_limits<float>::epsilon()
+                               / (1 - 3 * 0.5 * std::numeric_limits<float>::epsilon());
+
+// ray against the box [lo, hi]: float node bounds, or boxes blended in double
+template <typename T>
+inline bool slab_hit(const T* lo, const T* hi, const point4& o, const double* inv_d, Interval ray_t) {
+    for (int a = 0; a < 3; a++) {
+        double t0 = (lo[a] - o[a]) * inv_d[a];
+        double t1 = (hi[a] - o[a]) * inv_d[a];
+        if (t0 > t1) std::swap(t0, t1);
+        // conservative far distance (Ize 2013). The triangle kernel
+        // works on a float-sheared ray, so the margin has to cover
+        // float rounding, or a hit exactly at a box corner gets culled.
+        t1 *= 1 + 2 * mesh_box_gamma;
+        if (t0 > ray_t.min) ray_t.min = t0;
+        if (t1 < ray_t.max) ray_t.max = t1;
+        if (ray_t.max < ray_t.min) return false;
+    }
+    return true;
+}
+
+inline bool mesh_node_hit(const MeshBVHNode& node, const point4& o, const double* inv_d,
+                          Interval ray_t) {
+    return slab_hit(node.lo, node.hi, o, inv_d, ray_t);
+}
+
+// Tests the first `lanes` triangles of a packet; on a closer hit it
+// shrinks ray_t and updates the face and barycentrics.
+inline bool intersect_packet(const TrianglePacket& packet, int lanes, const PacketRay& pr,
+                             Interval& ray_t,
+                             uint32_t& hit_face, double& hit_b1, double& hit_b2) {
+    const int kx = pr.k[0], ky = pr.k[1], kz = pr.k[2];
+    const vfloat sx(pr.sx), sy(pr.sy), sz(pr.sz);
+
+    // vertices relative to the origin, sheared onto the ray's frame
+    vfloat az = vfloat::load(packet.v[0][kz]) - vfloat(pr.o[kz]);
+    vfloat bz = vfloat::load(packet.v[1][kz]) - vfloat(pr.o[kz]);
+    vfloat cz = vfloat::load(packet.v[2][kz]) - vfloat(pr.o[kz]);
+    vfloat ax = vfloat::load(packet.v[0][kx]) - vfloat(pr.o[kx]) - sx * az;
+    vfloat ay = vfloat::load(packet.v[0][ky]) - vfloat(pr.o[ky]) - sy * az;
+    vfloat bx = vfloat::load(packet.v[1][kx]) - vfloat(pr.o[kx]) - sx * bz;
+    vfloat by = vfloat::load(packet.v[1][ky]) - vfloat(pr.o[ky]) - sy * bz;
+    vfloat cx = vfloat::load(packet.v[2][kx]) - vfloat(pr.o[kx]) - sx * cz;
+    vfloat cy = vfloat::load(packet.v[2][ky]) - vfloat(pr.o[ky]) - sy * cz;
+
+    vfloat u = cx * by - cy * bx;
+    vfloat v = ax * cy - ay * cx;
+    vfloat w = bx * ay - by * ax;
+
+    // Near an edge or vertex the rounded products can give an edge
+    // function the wrong sign, and neighbouring triangles would then
+    // disagree. Lanes where any sign is within the rounding error are
+    // redone in double, where the products of floats are exact.
+    const vfloat zero(0.0f);
+    const vfloat error_bound(2 * std::numeric_limits<float>::epsilon());
+    vbool uncertain = (abs(u) <= error_bound * (abs(cx * by) + abs(cy * bx)))
+                    | (abs(v) <= error_bound * (abs(ax * cy) + abs(ay * cx)))
+                    | (abs(w) <= error_bound * (abs(bx * ay) + abs(by * ax)));
+    int active = (1 << lanes) - 1;
+    int exact = uncertain.bits() & active;
+    vbool outside = ((u < zero) | (v < zero) | (w < zero)) & ((u > zero) | (v > zero) | (w > zero));
+    int candidates = active & ~exact & ~outside.bits();
+
+    bool found = false;
+    if (candidates) {
+        vfloat det = u + v + w;
+        vfloat T = u * (sz * az) + v * (sz * bz) + w * (sz * cz);
+        // t = T / det within ray_t, compared without the divide
+        vfloat t_scaled = xor_sign(T, det);
+        vfloat abs_det = abs(det);
+        vbool in_range = (det != zero) & (t_scaled > vfloat(float(ray_t.min)) * abs_det)
+                       & (t_scaled < vfloat(float(ray_t.max)) * abs_det);
+        candidates &= in_range.bits();
+
+        if (candidates) {
+            float T_lane[SIMD_WIDTH], det_lane[SIMD_WIDTH], v_lane[SIMD_WIDTH], w_lane[SIMD_WIDTH];
+            T.store(T_lane); det.store(det_lane); v.store(v_lane); w.store(w_lane);
+            for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+                if (!(candidates & (1 << lane))) continue;
+                double t = double(T_lane[lane]) / det_lane[lane];
+                if (!ray_t.surrounds(t)) continue;
+                ray_t.max = t;
+                hit_face = packet.face[lane];
+                hit_b1 = double(v_lane[lane]) / det_lane[lane];
+                hit_b2 = double(w_lane[lane]) / det_lane[lane];
+                found = true;
+            }
+        }
+    }
+
+    if (exact) {
+        // same sheared coordinates, so the signs stay consistent with
+        // what the neighbouring triangles computed
+        float x[3][SIMD_WIDTH], y[3][SIMD_WIDTH], z[3][SIMD_WIDTH];
+        ax.store(x[0]); bx.store(x[1]); cx.store(x[2]);
+        ay.store(y[0]); by.store(y[1]); cy.store(y[2]);
+        az.store(z[0]); bz.store(z[1]); cz.store(z[2]);
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            if (!(exact & (1 << lane))) continue;
+            double U = double(x[2][lane]) * y[1][lane] - double(y[2][lane]) * x[1][lane];
+            double V = double(x[0][lane]) * y[2][lane] - double(y[0][lane]) * x[2][lane];
+            double W = double(x[1][lane]) * y[0][lane] - double(y[1][lane]) * x[0][lane];
+            if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) continue;
+            double det = U + V + W;
+            if (det == 0) continue;
+            double t = pr.sz * (U * z[0][lane] + V * z[1][lane] + W * z[2][lane]) / det;
+            if (!ray_t.surrounds(t)) continue;
+            ray_t.max = t;
+            hit_face = packet.face[lane];
+            hit_b1 = V / det;
+            hit_b2 = W / det;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Front-to-back walk over a float BVH, with the box test left to the
+// caller: node_hit(index, ray_t) says whether the ray meets node `index`'s
+// box within ray_t. leaf(node, ray_t) tests the node's
+// primitives, shrinks ray_t on a closer hit and returns whether it found one.
+template <typename NodeTest, typename LeafTest>
+inline bool walk_float_bvh(const std::vector<MeshBVHNode>& nodes, const vec4& d, Interval& ray_t,
+                           NodeTest node_hit, LeafTest leaf) {
+    if (nodes.empty()) return false;
+
+    bool found = false;
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        int index = stack[--top];
+        const MeshBVHNode& node = nodes[index];
+        if (!node_hit(index, ray_t)) continue;
+
+        if (node.count > 0) {
+            if (leaf(node, ray_t)) found = true;
+        } else {
+            int near_child = index + 1;
+            int far_child = node.offset;
+            if (d[node.axis] < 0) std::swap(near_child, far_child);
+            stack[top++] = far_child;
+            stack[top++] = near_child;
+        }
+    }
+    return found;
+}
+
+// Front-to-back walk over a float BVH (meshes, primitive pools).
+template <typename LeafTest>
+inline bool traverse_float_bvh(const std::vector<MeshBVHNode>& nodes, const point4& o,
+                               const vec4& d, Interval& ray_t, LeafTest leaf) {
+    double inv_d[3] = { 1.0 / d.x(), 1.0 / d.y(), 1.0 / d.z() };
+    return walk_float_bvh(nodes, d, ray_t,
+        [&](int index, Interval& t) { return mesh_node_hit(nodes[index], o, inv_d, t); }, leaf);
+}
+
+// Mesh version: leaf(node, packet_ray, ray_t) gets the per-ray constants of
+// the triangle kernel as well.
+template <typename LeafTest>
+inline bool traverse_mesh_bvh(const std::vector<MeshBVHNode>& nodes, const Ray& r,
+                              Interval& ray_t, LeafTest leaf) {
+    if (nodes.empty()) return false;
+
+    // boxes are tested with the same (float) origin as the triangles
+    PacketRay packet_ray(r);
+    const point4 o(packet_ray.o[0], packet_ray.o[1], packet_ray.o[2]);
+    return traverse_float_bvh(nodes, o, r.d(), ray_t,
+        [&](const MeshBVHNode& node, Interval& t) { return leaf(node, packet_ray, t); });
+}
+
+class TriangleMesh : public Hittable {
+    public:
+        std::vector<vec3f> positions;
+        std::vector<vec3f> normals;           // optional, smooth shading normals
+        std::vector<vec2f> uvs;               // optional texture coordinates
+        std::vector<vec3f> colors;            // optional per-vertex colors (scans), follow `indices`
+        std::vector<uint32_t> indices;        // 3 position indices per face
+        std::vector<uint32_t> normal_indices; // optional; if empty, normals follow `indices`
+        std::vector<uint32_t> uv_indices;     // optional; if empty, uvs follow `indices`
+        std::vector<uint32_t> face_materials; // optional index into `materials` per face
+        std::vector<uint32_t> materials;      // MaterialTable ids
+
+        TriangleMesh() {}
+
+        size_t face_count() const { return indices.size() / 3; }
+
+        // leaves of one packet suit the kernel best
+        static BVHBuildOptions default_build_options() {
+            BVHBuildOptions options;
+            options.max_leaf_size = SIMD_WIDTH;
+            return options;
+        }
+
+        // Builds the face BVH. Call again whenever positions or indices change.
+        void build(const BVHBuildOptions& options = default_build_options()) {
+            size_t n = face_count();
+            std::vector<AABB> boxes(n);
+            for (size_t f = 0; f < n; f++) {
+                vec4 p0, p1, p2;
+                face_vertices(f, p0, p1, p2);
+                boxes[f] = AABB(AABB(p0, p1), AABB(p2, p2));
+            }
+
+            std::vector<BVHFlatNode> flat;
+            std::vector<int> refs;
+            BVHBuilder builder(boxes, options,
+                [this](int prim, int axis, double pos, const AABB& ref, AABB& left, AABB& right) {
+                    clip_face(size_t(prim), axis, pos, left, right);
+                    return true;
+                });
+            builder.build(flat, refs);
+
+            nodes.resize(flat.size());
+            packets.clear();
+            for (size_t i = 0; i < flat.size(); i++) {
+                const AABB& b = flat[i].bbox;
+                for (int a = 0; a < 3; a++) {
+                    nodes[i].lo[a] = float_below(b.axis_interval(a).min);
+                    nodes[i].hi[a] = float_above(b.axis_interval(a).max);
+                }
+                nodes[i].offset = flat[i].offset;
+                nodes[i].count = uint16_t(flat[i].count);
+                nodes[i].axis = uint16_t(flat[i].axis);
+                if (flat[i].count > 0) {
+                    nodes[i].offset = int32_t(packets.size());
+                    pack_leaf(&refs[flat[i].offset], flat[i].count);
+                }
+            }
+
+            bbox = flat.empty() ? AABB::empty : flat[0].bbox;
+            area = 0;
+            for (size_t f = 0; f < n; f++) {
+                vec4 p0, p1, p2;
+                face_vertices(f, p0, p1, p2);
+                area += 0.5 * cross(p1 - p0, p2 - p0).norm();
+            }
+        }
+
+        bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
+            uint32_t hit_face = 0;
+            double hit_b1 = 0, hit_b2 = 0;
+            auto leaf = [&](const MeshBVHNode& node, const PacketRay& pr, Interval& t) {
+                bool found = false;
+                for (int n = node.count, i = node.offset; n > 0; n -= SIMD_WIDTH, i++) {
+                    if (intersect_packet(packets[i], std::min(n, SIMD_WIDTH), pr, t,
+                                         hit_face, hit_b1, hit_b2))
+                        found = true;
+                }
+                return found;
+            };
+            if (!traverse_mesh_bvh(nodes, r, ray_t, leaf)) return false;
+            rec.t = ray_t.max;
+            rec.u = hit_b1;
+            rec.v = hit_b2;
+            rec.prim_id = hit_face;
+            rec.object = this;
+            return true;
+        }
+
+        void surface(const Ray& r, Hit& rec) const override {
+            fill_hit(r, rec.t, rec.prim_id, rec.u, rec.v, rec);
+        }
+
+        AABB bounding_box() const override { return bbox; }
+        double surface_area() const override { return area; }
+
+        size_t memory_bytes() const {
+            return (positions.capacity() + normals.capacity() + colors.capacity()) * sizeof(vec3f)
+                 + uvs.capacity() * sizeof(vec2f)
+                 + (indices.capacity() + normal_indices.capacity() + uv_indices.capacity()
+                    + face_materials.capacity()) * sizeof(uint32_t)
+                 + nodes.capacity() * sizeof(MeshBVHNode)
+                 + packets.capacity() * sizeof(TrianglePacket);
+        }
+
+    protected:
+        std::vector<MeshBVHNode> nodes;
+        std::vector<TrianglePacket> packets;
+        AABB bbox;
+        double area = 0;
+
+        void face_vertices(size_t f, vec4& p0, vec4& p1, vec4& p2) const {
+            p0 = to_vec4(positions[indices[3*f]]);
+            p1 = to_vec4(positions[indices[3*f + 1]]);
+            p2 = to_vec4(positions[indices[3*f + 2]]);
+        }
+
+        void pack_leaf(const int* faces, int count) {
+            for (int first = 0; first < count; first += SIMD_WIDTH) {
+                TrianglePacket packet = {};
+                for (int lane = 0; lane < SIMD_WIDTH && first + lane < count; lane++) {
+                    uint32_t f = uint32_t(faces[first + lane]);
+                    packet.face[lane] = f;
+                    for (int i = 0; i < 3; i++) {
+                        const vec3f& p = positions[indices[3*f + i]];
+                        packet.v[i][0][lane] = p.x;
+                        packet.v[i][1][lane] = p.y;
+                        packet.v[i][2][lane] = p.z;
+                    }
+                }
+                packets.push_back(packet);
+            }
+        }
+
+        void fill_hit(const Ray& r, double t, uint32_t f, double b1, double b2, Hit& rec) const {
+            double b0 = 1 - b1 - b2;
+            vec4 p0, p1, p2;
+            face_vertices(f, p0, p1, p2);
+
+            rec.t = t;
+            rec.p = r.at(t);
+            vec4 geometric = unit_vector(cross(p1 - p0, p2 - p0));
+            rec.set_face_normal(r, geometric);
+
+            // corners without a normal or uv index (out of range) fall back to
+            // the flat normal and to barycentric coordinates
+            const std::vector<uint32_t>& ni = normal_indices.empty() ? indices : normal_indices;
+            if (!normals.empty() && ni[3*f] < normals.size() && ni[3*f + 1] < normals.size()
+                && ni[3*f + 2] < normals.size()) {
+                vec4 n = b0 * to_vec4(normals[ni[3*f]]) + b1 * to_vec4(normals[ni[3*f + 1]])
+                       + b2 * to_vec4(normals[ni[3*f + 2]]);
+                if (n.norm2() > 0) {
+                    n = unit_vector(n);
+                    rec.normal = rec.front_face ? n : -n;
+                }
+            }
+
+            const std::vector<uint32_t>& ti = uv_indices.empty() ? indices : uv_indices;
+            if (!uvs.empty() && ti[3*f] < uvs.size() && ti[3*f + 1] < uvs.size()
+                && ti[3*f + 2] < uvs.size()) {
+                const vec2f& t0 = uvs[ti[3*f]];
+                const vec2f& t1 = uvs[ti[3*f + 1]];
+                const vec2f& t2 = uvs[ti[3*f + 2]];
+                rec.u = b0 * t0.u + b1 * t1.u + b2 * t2.u;
+                rec.v = b0 * t0.v + b1 * t1.v + b2 * t2.v;
+                const double corner_uv[3][2] = { {t0.u, t0.v}, {t1.u, t1.v}, {t2.u, t2.v} };
+                triangle_uv_derivatives(p0, p1, p2, corner_uv, rec.dpdu, rec.dpdv);
+            } else {
+                rec.u = b1;
+                rec.v = b2;
+                rec.dpdu = p1 - p0;
+                rec.dpdv = p2 - p0;
+            }
+
+            size_t m = face_materials.empty() ? 0 : face_materials[f];
+            rec.mat_id = (m < materials.size()) ? materials[m] : 0;
+        }
+
+        void clip_face(size_t f, int axis, double pos, AABB& left, AABB& right) const {
+            // bounds of the triangle's parts on either side of the plane
+            vec4 p[3];
+            face_vertices(f, p[0], p[1], p[2]);
+            left = right = AABB::empty;
+            for (int i = 0; i < 3; i++) {
+                const vec4& a = p[i];
+                const vec4& b = p[(i + 1) % 3];
+                if (a[axis] <= pos) left = AABB(left, AABB(a, a));
+                if (a[axis] >= pos) right = AABB(right, AABB(a, a));
+                if ((a[axis] < pos && b[axis] > pos) || (a[axis] > pos && b[axis] < pos)) {
+                    auto s = (pos - a[axis]) / (b[axis] - a[axis]);
+                    vec4 q = a + s * (b - a);
+                    left = AABB(left, AABB(q, q));
+                    right = AABB(right, AABB(q, q));
+                }
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sbvh.h"
+#include <algorithm>
+
+// Motion blur support: a BVH whose nodes carry bounds at the start and end of
+// each time segment (interpolated by ray time during traversal), and a
+// keyframed rigid transform for animating arbitrary hittables.
+
+class Quat { // unit quaternion, used for interpolating rotations
+    public:
+        double x, y, z, w;
+
+        Quat() : x(0), y(0), z(0), w(1) {}
+        Quat(double x, double y, double z, double w) : x(x), y(y), z(z), w(w) {}
+
+        static Quat from_axis_angle(const vec4& axis, double degrees) {
+            auto half = 0.5 * degrees_to_radians(degrees);
+            auto a = unit_vector(axis) * std::sin(half);
+            return Quat(a.x(), a.y(), a.z(), std::cos(half));
+        }
+
+        vec4 rotate(const vec4& v) const {
+            // v' = v + 2w (q x v) + 2 q x (q x v)
+            vec4 q(x, y, z);
+            vec4 t = 2 * cross(q, v);
+            return v + w * t + cross(q, t);
+        }
+
+        Quat conjugate() const { return Quat(-x, -y, -z, w); }
+
+        double angle_to(const Quat& b) const {
+            // rotation angle (radians) taking this orientation to b
+            auto d = std::fmin(1.0, std::fabs(x*b.x + y*b.y + z*b.z + w*b.w));
+            return 2 * std::acos(d);
+        }
+
+        static Quat slerp(const Quat& a, Quat b, double t) {
+            auto d = a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w;
+            if (d < 0) { // take the short way around
+                b = Quat(-b.x, -b.y, -b.z, -b.w);
+                d = -d;
+            }
+            double wa, wb;
+            if (d > 0.9995) { // nearly parallel: plain lerp is accurate enough
+                wa = 1 - t;
+                wb = t;
+            } else {
+                auto theta = std::acos(d);
+                auto sin_theta = std::sin(theta);
+                wa = std::sin((1 - t) * theta) / sin_theta;
+                wb = std::sin(t * theta) / sin_theta;
+            }
+            Quat q(wa*a.x + wb*b.x, wa*a.y + wb*b.y, wa*a.z + wb*b.z, wa*a.w + wb*b.w);
+            auto len = std::sqrt(q.x*q.x + q.y*q.y + q.z*q.z + q.w*q.w);
+            return Quat(q.x/len, q.y/len, q.z/len, q.w/len);
+        }
+};
+
+// Rigid transform (uniform scale, rotation, translation) animated by
+// keyframes over the shutter interval [0, 1]. Between keyframes the
+// translation and scale are interpolated linearly, the rotation by slerp.
+class MotionTransform : public Hittable {
+    public:
+        struct Keyframe {
+            double time;
+            vec4 translation;
+            vec4 axis;    // rotation axis (any length)
+            double angle; // rotation in degrees
+            double scale;
+        };
+
+        MotionTransform(shared_ptr<Hittable> object, const std::vector<Keyframe>& keyframes,
+                        int samples_per_key = 16)
+          : object(object), samples_per_key(std::max(1, samples_per_key)) {
+            for (const auto& k : keyframes) {
+                keys.push_back({k.time, k.translation, Quat::from_axis_angle(k.axis, k.angle),
+                                k.scale});
+            }
+            std::sort(keys.begin(), keys.end(), [](const Key& a, const Key& b) {
+                return a.time < b.time;
+            });
+            if (keys.empty()) keys.push_back({0.0, vec4(0,0,0), Quat(), 1.0});
+
+            AABB b0, b1;
+            object->motion_bounds(0, 1, b0, b1);
+            local_box = AABB(b0, b1);
+            bbox = swept_bounds(0, 1);
+        }
+
+        bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
+            Key k = key_at(r.time());
+            Quat inv = k.rotation.conjugate();
+
+            // world -> object: undo translation, rotation and scale; t is preserved
+            auto o = inv.rotate(r.o() - k.translation) / k.scale;
+            auto d = inv.rotate(r.d()) / k.scale;
+            Ray object_ray(o, d, r.time());
+            if (!object->hit(object_ray, ray_t, rec)) return false;
+            rec.finish(object_ray);
+
+            rec.p = k.translation + k.scale * k.rotation.rotate(rec.p);
+            rec.normal = k.rotation.rotate(rec.normal); // uniform scale keeps normals
+            rec.dpdu = k.scale * k.rotation.rotate(rec.dpdu);
+            rec.dpdv = k.scale * k.rotation.rotate(rec.dpdv);
+            return true;
+        }
+
+        AABB bounding_box() const override { return bbox; }
+
+        void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const override {
+            b0 = b1 = swept_bounds(t0, t1);
+        }
+
+        bool contains_media() const override { return object->contains_media(); }
+
+        double surface_area() const override {
+            double scale = 0; // largest scale over the shutter
+            for (const auto& k : keys) scale = std::fmax(scale, k.scale);
+            return scale * scale * object->surface_area();
+        }
+
+    private:
+        struct Key {
+            double time;
+            vec4 translation;
+            Quat rotation;
+            double scale;
+        };
+
+        shared_ptr<Hittable> object;
+        std::vector<Key> keys;
+        int samples_per_key;
+        AABB local_box; // object bounds over the whole shutter
+        AABB bbox;
+
+        Key key_at(double time) const {
+            if (time <= keys.front().time) return keys.front();
+            if (time >= keys.back().time) return keys.back();
+
+            size_t i = 1;
+            while (keys[i].time < time) i++;
+            const Key& a = keys[i - 1];
+            const Key& b = keys[i];
+            auto span = b.time - a.time;
+            auto s = (span > 0) ? (time - a.time) / span : 0.0;
+            return {time,
+                    (1 - s) * a.translation + s * b.translation,
+                    Quat::slerp(a.rotation, b.rotation, s),
+                    (1 - s) * a.scale + s * b.scale};
+        }
+
+        AABB transformed_box(const Key& k) const {
+            point4 min( infinity,  infinity,  infinity);
+            point4 max(-infinity, -infinity, -infinity);
+            for (int i = 0; i < 8; i++) {
+                point4 corner(
+                    (i & 1) ? local_box.x.max : local_box.x.min,
+                    (i & 2) ? local_box.y.max : local_box.y.min,
+                    (i & 4) ? local_box.z.max : local_box.z.min);
+                auto p = k.translation + k.scale * k.rotation.rotate(corner);
+                for (int c = 0; c < 3; c++) {
+                    min[c] = std::fmin(min[c], p[c]);
+                    max[c] = std::fmax(max[c], p[c]);
+                }
+            }
+            return AABB(min, max);
+        }
+
+        AABB swept_bounds(double t0, double t1) const {
+            // sample times: the range ends, every keyframe inside it, and
+            // samples_per_key steps within each keyframe interval
+            std::vector<double> times;
+            times.push_back(t0);
+            for (size_t i = 0; i + 1 < keys.size(); i++) {
+                for (int s = 0; s <= samples_per_key; s++) {
+                    auto t = keys[i].time + (keys[i+1].time - keys[i].time) * s / samples_per_key;
+                    if (t > t0 && t < t1) times.push_back(t);
+                }
+            }
+            times.push_back(t1);
+            std::sort(times.begin(), times.end());
+
+            // farthest corner from the local origin, for the rotation bulge below
+            double radius = 0;
+            for (int i = 0; i < 8; i++) {
+                point4 corner(
+                    (i & 1) ? local_box.x.max : local_box.x.min,
+                    (i & 2) ? local_box.y.max : local_box.y.min,
+                    (i & 4) ? local_box.z.max : local_box.z.min);
+                radius = std::fmax(radius, corner.norm());
+            }
+
+            AABB box = AABB::empty;
+            Key prev = key_at(times[0]);
+            for (size_t i = 0; i < times.size(); i++) {
+                Key k = key_at(times[i]);
+                AABB sample = transformed_box(k);
+                if (i > 0) {
+                    // between samples a rotating point leaves the chord by at
+                    // most r (1 - cos(dtheta / 2)); changing scale adds r ds dtheta
+                    auto dtheta = prev.rotation.angle_to(k.rotation);
+                    auto s = std::fmax(prev.scale, k.scale);
+                    auto pad = s * radius * (1 - std::cos(dtheta / 2))
+                             + radius * std::fabs(k.scale - prev.scale) * dtheta;
+                    sample = AABB(sample.x.expand(2 * pad), sample.y.expand(2 * pad),
+                                  sample.z.expand(2 * pad));
+                }
+                box = AABB(box, sample);
+                prev = k;
+            }
+            return box;
+        }
+};
+
+// BVH for scenes with moving objects. Each node stores a pair of boxes per
+// time segment (bounds at the segment's start and end); a ray tests the box
+// interpolated to its own time instead of the union over the whole shutter.
+class MotionBVH : public Hittable {
+    public:
+        MotionBVH(const HittableList& list, int segments = 1)
+          : objects(list.objects), segments(std::max(1, segments)) {
+            size_t n = objects.size();
+            size_t boxes_per_prim = 2 * this->segments;
+            std::vector<AABB> prim_motion(n * boxes_per_prim);
+            std::vector<AABB> mid_boxes(n);
+
+            for (size_t i = 0; i < n; i++) {
+                for (int s = 0; s < this->segments; s++) {
+                    double t0 = double(s) / this->segments;
+                    double t1 = double(s + 1) / this->segments;
+                    objects[i]->motion_bounds(t0, t1, prim_motion[i * boxes_per_prim + 2*s],
+                                              prim_motion[i * boxes_per_prim + 2*s + 1]);
+                }
+                // build the topology from where the objects are mid-shutter
+                int s = this->segments / 2;
+                double tau = 0.5 * this->segments - s;
+                if (s == this->segments) { s--; tau = 1.0; }
+                mid_boxes[i] = lerp(prim_motion[i * boxes_per_prim + 2*s],
+                                    prim_motion[i * boxes_per_prim + 2*s + 1], tau);
+            }
+
+            BVHBuildOptions options;
+            options.spatial_splits = false; // references must bound the whole shutter
+            options.max_leaf_size = 2;
+            BVHBuilder(mid_boxes, options).build(nodes, prim_indices);
+
+            // children always follow their parent, so a reverse sweep is bottom-up
+            node_boxes.assign(nodes.size() * boxes_per_prim, AABB::empty);
+            for (int index = int(nodes.size()) - 1; index >= 0; index--) {
+                const BVHFlatNode& node = nodes[index];
+                AABB* dst = &node_boxes[index * boxes_per_prim];
+                if (node.count > 0) {
+                    for (int i = node.offset; i < node.offset + node.count; i++) {
+                        const AABB* src = &prim_motion[prim_indices[i] * boxes_per_prim];
+                        for (size_t b = 0; b < boxes_per_prim; b++) dst[b] = AABB(dst[b], src[b]);
+                    }
+                } else {
+                    const AABB* l = &node_boxes[(index + 1) * boxes_per_prim];
+                    const AABB* r = &node_boxes[node.offset * boxes_per_prim];
+                    for (size_t b = 0; b < boxes_per_prim; b++) dst[b] = AABB(l[b], r[b]);
+                }
+            }
+
+            bbox = list.bounding_box();
+            has_media = list.contains_media();
+        }
+
+        bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
+            if (nodes.empty()) return false;
+
+            // locate the ray's time segment once
+            double scaled = Interval(0, 1).clamp(r.time()) * segments;
+            int s = std::min(segments - 1, int(scaled));
+            double tau = scaled - s;
+            size_t boxes_per_prim = 2 * segments;
+
+            bool hit_anything = false;
+            int stack[64];
+            int top = 0;
+            stack[top++] = 0;
+
+            while (top > 0) {
+                int index = stack[--top];
+                const BVHFlatNode& node = nodes[index];
+                const AABB* boxes = &node_boxes[index * boxes_per_prim + 2*s];
+                if (!lerp(boxes[0], boxes[1], tau).hit(r, ray_t)) continue;
+
+                if (node.count > 0) {
+                    for (int i = node.offset; i < node.offset + node.count; i++) {
+                        if (objects[prim_indices[i]]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                } else {
+                    int near_child = index + 1;
+                    int far_child = node.offset;
+                    if (r.d()[node.axis] < 0) std::swap(near_child, far_child);
+                    stack[top++] = far_child;
+                    stack[top++] = near_child;
+                }
+            }
+            return hit_anything;
+        }
+
+        AABB bounding_box() const override { return bbox; }
+
+        void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const override {
+            if (nodes.empty()) { b0 = b1 = AABB::empty; return; }
+            // exact when [t0, t1] is one of our segments, otherwise the union
+            // of every segment it touches
+            int first = std::max(0, std::min(segments - 1, int(t0 * segments)));
+            int last  = std::max(0, std::min(segments - 1, int(std::ceil(t1 * segments)) - 1));
+            if (first == last && t0 * segments == first && t1 * segments == first + 1) {
+                b0 = node_boxes[2*first];
+                b1 = node_boxes[2*first + 1];
+                return;
+            }
+            b0 = AABB::empty;
+            for (int s = first; s <= last; s++) {
+                b0 = AABB(b0, AABB(node_boxes[2*s], node_boxes[2*s + 1]));
+            }
+            b1 = b0;
+        }
+
+        bool contains_media() const override { return has_media; }
+
+        double surface_area() const override {
+            double sum = 0.0;
+            for (const auto& object : objects) sum += object->surface_area();
+            return sum;
+        }
+
+        const std::vector<BVHFlatNode>& flat_nodes() const { return nodes; }
+        const std::vector<int>& references() const { return prim_indices; }
+        const std::vector<shared_ptr<Hittable>>& primitives() const { return objects; }
+        int time_segments() const { return segments; }
+
+    private:
+        std::vector<shared_ptr<Hittable>> objects;
+        int segments;
+        std::vector<BVHFlatNode> nodes;
+        std::vector<int> prim_indices;
+        std::vector<AABB> node_boxes; // 2 * segments boxes per node
+        AABB bbox;
+        bool has_media = false;
+};
+
+#endif
@@ -0,0 +1,399 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "mesh.h"
+#include "material.h"
+#include "texture.h"
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+
+// Wavefront OBJ loader producing a single TriangleMesh.
+//
+// The file is read into memory and cut into line-aligned chunks that are
+// parsed by one thread each. A first parallel pass only counts elements per
+// chunk; prefix sums then give every chunk its write offsets, so the second
+// pass parses straight into the final arrays. OBJ's relative (negative)
+// indices and `usemtl` state carry across chunks through the same offsets.
+//
+// MTL support is basic: Kd/map_Kd become Lambertian, Ke an emitter, illum 3
+// (or shiny Ks) Metal, and transparent or refractive materials Dielectric.
+
+struct ObjLoadOptions {
+    unsigned threads = 0;   // 0: one per hardware thread
+    BVHBuildOptions bvh = TriangleMesh::default_build_options(); // settings for the face BVH
+    bool build = true;      // false: leave the BVH to the caller, e.g. to build once after moving vertices
+};
+
+namespace obj_detail {
+
+inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char* skip_space(const char* p, const char* end) {
+    while (p < end && is_space(*p)) p++;
+    return p;
+}
+
+inline const char* line_end(const char* p, const char* end) {
+    const char* e = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    return e ? e : end;
+}
+
+inline bool keyword(const char* p, const char* end, const char* word) {
+    // word followed by whitespace or end of line
+    size_t n = std::strlen(word);
+    if (size_t(end - p) < n || std::memcmp(p, word, n) != 0) return false;
+    return p + n == end || is_space(p[n]);
+}
+
+inline bool parse_float(const char*& p, const char* end, float& out) {
+    // plain decimal floats are by far the common case; anything unusual
+    // (inf, nan, hex) goes through strtod
+    static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+    p = skip_space(p, end);
+    const char* start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+
+    unsigned long long mantissa = 0;
+    int exponent = 0, digits = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (digits < 18) { mantissa = mantissa * 10 + (*p - '0'); digits++; }
+        else exponent++;
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (digits < 18) { mantissa = mantissa * 10 + (*p - '0'); digits++; exponent--; }
+            p++;
+        }
+    }
+    if (p == start || (p == start + 1 && (negative || *start == '+'))) {
+        char* stop = nullptr;
+        std::string token(start, line_end(start, end));
+        double value = std::strtod(token.c_str(), &stop);
+        if (stop == token.c_str()) return false;
+        p = start + (stop - token.c_str());
+        out = float(value);
+        return true;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        bool exp_negative = false;
+        if (q < end && (*q == '-' || *q == '+')) exp_negative = (*q++ == '-');
+        if (q < end && *q >= '0' && *q <= '9') {
+            int e = 0;
+            while (q < end && *q >= '0' && *q <= '9') { e = std::min(e * 10 + (*q - '0'), 1000); q++; }
+            exponent += exp_negative ? -e : e;
+            p = q;
+        }
+    }
+
+    double value = double(mantissa);
+    if (exponent < 0) value = (exponent >= -18) ? value / pow10[-exponent] : value * std::pow(10.0, exponent);
+    else if (exponent > 0) value = (exponent <= 18) ? value * pow10[exponent] : value * std::pow(10.0, exponent);
+    out = float(negative ? -value : value);
+    return true;
+}
+
+inline bool parse_int(const char*& p, const char* end, long& out) {
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+    if (p >= end || *p < '0' || *p > '9') return false;
+    long value = 0;
+    while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+    out = negative ? -value : value;
+    return true;
+}
+
+inline std::string rest_of_line(const char* p, const char* end) {
+    p = skip_space(p, end);
+    while (end > p && is_space(end[-1])) end--;
+    return std::string(p, end);
+}
+
+inline size_t count_face_vertices(const char* p, const char* end) {
+    size_t n = 0;
+    while (true) {
+        p = skip_space(p, end);
+        if (p >= end || *p == '#') return n;
+        n++;
+        while (p < end && !is_space(*p)) p++;
+    }
+}
+
+struct Chunk {
+    const char* begin;
+    const char* end;
+    // pass 1 results
+    size_t positions = 0, uvs = 0, normals = 0, faces = 0;
+    bool sets_material = false;
+    std::string last_material;
+    std::vector<std::string> mtllibs;
+    // pass 2 inputs (prefix sums)
+    size_t position_offset = 0, uv_offset = 0, normal_offset = 0, face_offset = 0;
+    uint32_t start_material = 0;
+};
+
+inline void count_chunk(Chunk& chunk) {
+    for (const char* p = chunk.begin; p < chunk.end; ) {
+        const char* e = line_end(p, chunk.end);
+        const char* q = skip_space(p, e);
+        if (keyword(q, e, "v")) chunk.positions++;
+        else if (keyword(q, e, "vt")) chunk.uvs++;
+        else if (keyword(q, e, "vn")) chunk.normals++;
+        else if (keyword(q, e, "f")) {
+            size_t n = count_face_vertices(q + 1, e);
+            if (n >= 3) chunk.faces += n - 2;
+        } else if (keyword(q, e, "usemtl")) {
+            chunk.sets_material = true;
+            chunk.last_material = rest_of_line(q + 6, e);
+        } else if (keyword(q, e, "mtllib")) {
+            chunk.mtllibs.push_back(rest_of_line(q + 6, e));
+        }
+        p = (e < chunk.end) ? e + 1 : chunk.end;
+    }
+}
+
+inline uint32_t resolve_index(long index, size_t count) {
+    // OBJ indices are 1-based; negative ones count back from the latest element
+    if (index > 0) return uint32_t(index - 1);
+    if (index < 0 && size_t(-index) <= count) return uint32_t(long(count) + index);
+    return UINT32_MAX;
+}
+
+inline void parse_chunk(const Chunk& chunk, TriangleMesh& mesh,
+                        const std::map<std::string, uint32_t>& material_ids) {
+    size_t np = chunk.position_offset, nt = chunk.uv_offset, nn = chunk.normal_offset;
+    size_t face = chunk.face_offset;
+    uint32_t material = chunk.start_material;
+    bool has_uvs = !mesh.uv_indices.empty();
+    bool has_normals = !mesh.normal_indices.empty();
+
+    std::vector<uint32_t> corner_p, corner_t, corner_n;
+    for (const char* p = chunk.begin; p < chunk.end; ) {
+        const char* e = line_end(p, chunk.end);
+        const char* q = skip_space(p, e);
+
+        if (keyword(q, e, "v")) {
+            float x = 0, y = 0, z = 0;
+            q += 1;
+            parse_float(q, e, x) && parse_float(q, e, y) && parse_float(q, e, z);
+            mesh.positions[np++] = {x, y, z};
+        } else if (keyword(q, e, "vt")) {
+            float u = 0, v = 0;
+            q += 2;
+            parse_float(q, e, u) && parse_float(q, e, v);
+            mesh.uvs[nt++] = {u, v};
+        } else if (keyword(q, e, "vn")) {
+            float x = 0, y = 0, z = 0;
+            q += 2;
+            parse_float(q, e, x) && parse_float(q, e, y) && parse_float(q, e, z);
+            mesh.normals[nn++] = {x, y, z};
+        } else if (keyword(q, e, "f")) {
+            corner_p.clear(); corner_t.clear(); corner_n.clear();
+            q += 1;
+            while (true) {
+                q = skip_space(q, e);
+                if (q >= e || *q == '#') break;
+                long vi = 0, ti = 0, ni = 0;
+                // v, v/t, v//n or v/t/n
+                parse_int(q, e, vi);
+                if (q < e && *q == '/') {
+                    q++;
+                    if (q < e && *q != '/') parse_int(q, e, ti);
+                    if (q < e && *q == '/') { q++; parse_int(q, e, ni); }
+                }
+                while (q < e && !is_space(*q)) q++; // skip anything malformed
+                corner_p.push_back(resolve_index(vi, np));
+                corner_t.push_back(resolve_index(ti, nt));
+                corner_n.push_back(resolve_index(ni, nn));
+            }
+
+            // fan triangulation; counts match count_face_vertices exactly
+            for (size_t k = 2; k < corner_p.size(); k++, face++) {
+                size_t c[3] = { 0, k - 1, k };
+                for (int j = 0; j < 3; j++) {
+                    uint32_t pi = corner_p[c[j]];
+                    mesh.indices[3*face + j] = (pi < mesh.positions.size()) ? pi : 0;
+                    if (has_uvs) mesh.uv_indices[3*face + j] = corner_t[c[j]];
+                    if (has_normals) mesh.normal_indices[3*face + j] = corner_n[c[j]];
+                }
+                mesh.face_materials[face] = material;
+            }
+        } else if (keyword(q, e, "usemtl")) {
+            auto it = material_ids.find(rest_of_line(q + 6, e));
+            material = (it != material_ids.end()) ? it->second : 0;
+        }
+        p = (e < chunk.end) ? e + 1 : chunk.end;
+    }
+}
+
+inline std::string directory_of(const std::string& path) {
+    auto slash = path.find_last_of("/\\");
+    return (slash == std::string::npos) ? std::string() : path.substr(0, slash + 1);
+}
+
+inline Color read_color(std::istringstream& in) {
+    double r = 0, g = 0, b = 0;
+    in >> r >> g >> b;
+    return Color(r, g, b);
+}
+
+inline void load_mtl(const std::string& filename, TriangleMesh& mesh,
+                     std::map<std::string, uint32_t>& material_ids) {
+    std::ifstream file(filename);
+    if (!file) {
+        std::cerr << "ERROR: Could not open material library '" << filename << "'.\n";
+        return;
+    }
+
+    struct MtlDesc {
+        std::string name;
+        Color kd = Color(0.8, 0.8, 0.8), ks = Color(0,0,0), ke = Color(0,0,0);
+        double ns = 0, ni = 1, dissolve = 1;
+        int illum = 2;
+        std::string map_kd;
+    };
+    std::vector<MtlDesc> descs;
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream in(line);
+        std::string key;
+        in >> key;
+        if (key == "newmtl") {
+            descs.push_back(MtlDesc());
+            descs.back().name = rest_of_line(line.c_str() + line.find("newmtl") + 6,
+                                             line.c_str() + line.size());
+        }
+        if (descs.empty()) continue;
+        MtlDesc& m = descs.back();
+        if (key == "Kd") m.kd = read_color(in);
+        else if (key == "Ks") m.ks = read_color(in);
+        else if (key == "Ke") m.ke = read_color(in);
+        else if (key == "Ns") in >> m.ns;
+        else if (key == "Ni") in >> m.ni;
+        else if (key == "d") in >> m.dissolve;
+        else if (key == "Tr") { double tr = 0; in >> tr; m.dissolve = 1 - tr; }
+        else if (key == "illum") in >> m.illum;
+        else if (key == "map_Kd") {
+            // the file name is the last token (options may precede it)
+            std::string token;
+            while (in >> token) m.map_kd = token;
+        }
+    }
+
+    std::string dir = directory_of(filename);
+    for (const auto& m : descs) {
+        shared_ptr<Material> mat;
+        if (m.ke.x() > 0 || m.ke.y() > 0 || m.ke.z() > 0) {
+            mat = make_scene_shared<DiffuseLight>(m.ke);
+        } else if (m.illum == 4 || m.illum == 6 || m.illum == 7 || m.dissolve < 1) {
+            mat = make_scene_shared<Dielectric>(m.ni > 1 ? m.ni : 1.5);
+        } else if (m.illum == 3 || (m.illum == 2 && m.ns > 500 && m.ks.norm2() > 0)) {
+            // map the Phong exponent to a rough fuzz value
+            mat = make_scene_shared<Metal>(m.ks.norm2() > 0 ? m.ks : m.kd, std::sqrt(2 / (m.ns + 2)));
+        } else if (!m.map_kd.empty()) {
+            mat = make_scene_shared<Lambertian>(make_scene_shared<ImageTexture>((dir + m.map_kd).c_str()));
+        } else {
+            mat = make_scene_shared<Lambertian>(m.kd);
+        }
+        material_ids[m.name] = uint32_t(mesh.materials.size());
+        mesh.materials.push_back(material_id(mat));
+    }
+}
+
+} // namespace obj_detail
+
+// Returns nullptr (after printing an error) if the file can't be read.
+// Faces without a `usemtl` (or with an unknown one) use default_material.
+inline shared_ptr<TriangleMesh> load_obj(const std::string& filename,
+                                         shared_ptr<Material> default_material,
+                                         const ObjLoadOptions& options = ObjLoadOptions()) {
+    using namespace obj_detail;
+
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        std::cerr << "ERROR: Could not load OBJ file '" << filename << "'.\n";
+        return nullptr;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    const char* begin = data.data();
+    const char* end = begin + data.size();
+
+    // line-aligned chunks; small files are not worth the threads
+    unsigned threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+    threads = std::max(1u, threads);
+    if (data.size() < (1u << 20)) threads = 1;
+
+    std::vector<Chunk> chunks;
+    const char* p = begin;
+    for (unsigned i = 0; i < threads && p < end; i++) {
+        const char* q = (i + 1 == threads) ? end : begin + data.size() * (i + 1) / threads;
+        if (q < p) q = p;
+        if (q < end) {
+            const char* e = line_end(q, end);
+            q = (e < end) ? e + 1 : end;
+        }
+        Chunk chunk;
+        chunk.begin = p;
+        chunk.end = q;
+        chunks.push_back(chunk);
+        p = q;
+    }
+
+    auto run = [&chunks](std::function<void(Chunk&)> task) {
+        if (chunks.size() == 1) { task(chunks[0]); return; }
+        std::vector<std::thread> workers;
+        for (auto& chunk : chunks) workers.push_back(std::thread(task, std::ref(chunk)));
+        for (auto& worker : workers) worker.join();
+    };
+
+    // pass 1: counts per chunk
+    run(count_chunk);
+
+    auto mesh = make_scene_shared<TriangleMesh>();
+    mesh->materials.push_back(material_id(default_material));
+    std::map<std::string, uint32_t> material_ids;
+    for (const auto& chunk : chunks)
+        for (const auto& lib : chunk.mtllibs) load_mtl(directory_of(filename) + lib, *mesh, material_ids);
+
+    // prefix sums give each chunk its offsets and the material in effect at its start
+    size_t np = 0, nt = 0, nn = 0, nf = 0;
+    uint32_t material = 0;
+    for (auto& chunk : chunks) {
+        chunk.position_offset = np; chunk.uv_offset = nt; chunk.normal_offset = nn;
+        chunk.face_offset = nf;
+        chunk.start_material = material;
+        np += chunk.positions; nt += chunk.uvs; nn += chunk.normals; nf += chunk.faces;
+        if (chunk.sets_material) {
+            auto it = material_ids.find(chunk.last_material);
+            material = (it != material_ids.end()) ? it->second : 0;
+        }
+    }
+
+    mesh->positions.resize(np);
+    mesh->uvs.resize(nt);
+    mesh->normals.resize(nn);
+    mesh->indices.resize(3 * nf);
+    if (nt > 0) mesh->uv_indices.resize(3 * nf);
+    if (nn > 0) mesh->normal_indices.resize(3 * nf);
+    mesh->face_materials.resize(nf);
+
+    // pass 2: parse straight into the mesh arrays
+    TriangleMesh& target = *mesh;
+    run([&target, &material_ids](Chunk& chunk) { parse_chunk(chunk, target, material_ids); });
+
+    if (options.build) mesh->build(options.bvh);
+    return mesh;
+}
+
+#endif
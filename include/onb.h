@@ -5,6 +5,7 @@
 
 class ONB {
     public:
+        ONB() {}
         ONB(const vec4& n) {
             axis[2] = unit_vector(n); // normal is the z-axis
             vec4 a  = (std::fabs(axis[2].x()) > 0.9) ? vec4(0,1,0) : vec4(1,0,0);
@@ -0,0 +1,414 @@
+#ifndef PAGED_MESH_H
+#define PAGED_MESH_H
+
+#include "mesh.h"
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Out-of-core triangle mesh.
+//
+// The mesh is cut into spatial clusters of up to `cluster_faces` triangles.
+// Each cluster is a self-contained TriangleMesh with its own BVH and packets,
+// written to a page file as one blob. Only the top-level BVH over cluster
+// bounds and the material table stay resident. A ray that reaches a cluster
+// pages it in through an LRU cache that keeps at most `memory_cap` bytes of
+// clusters resident, so scenes bigger than memory render slowly rather than
+// not at all.
+//
+// A page file is self-describing: write it once with PagedMesh::write() and
+// reopen it later without the source mesh ever being in memory again.
+// Writing one is not out-of-core, though: it takes the whole TriangleMesh
+// (plus a box per face for the clustering), so page files have to be made
+// on a machine with the memory to load the mesh. Only rendering from them
+// is bounded by memory_cap.
+//
+// File layout (native endian):
+//   "RTWPAGE1", cluster count, cluster table {bounds, area, offset, size},
+//   then the cluster blobs.
+
+struct PagedMeshOptions {
+    size_t cluster_faces = 1 << 16;   // triangles per cluster (at most)
+    size_t memory_cap = size_t(256) << 20; // bytes of resident clusters
+    BVHBuildOptions bvh = TriangleMesh::default_build_options(); // per-cluster BVH
+};
+
+struct PagingStats {
+    size_t hits = 0;          // cluster lookups served from memory
+    size_t misses = 0;        // lookups that read from disk
+    size_t evictions = 0;
+    size_t bytes_paged = 0;   // total bytes read from the page file
+    size_t resident_bytes = 0;
+    size_t peak_resident_bytes = 0;
+
+    void print(std::ostream& out) const {
+        auto lookups = hits + misses;
+        out << "Paging: " << lookups << " cluster lookups, " << misses << " misses ("
+            << (lookups ? 100.0 * misses / lookups : 0.0) << "%), " << evictions << " evictions, "
+            << bytes_paged / (1024.0 * 1024.0) << " MB paged in, peak resident "
+            << peak_resident_bytes / (1024.0 * 1024.0) << " MB\n";
+    }
+};
+
+namespace paged_detail {
+
+template <typename T>
+inline void write_vector(std::ostream& out, const std::vector<T>& v) {
+    uint64_t n = v.size();
+    out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    if (n) out.write(reinterpret_cast<const char*>(v.data()), std::streamsize(n * sizeof(T)));
+}
+
+template <typename T>
+inline bool read_vector(std::istream& in, std::vector<T>& v) {
+    uint64_t n = 0;
+    if (!in.read(reinterpret_cast<char*>(&n), sizeof(n))) return false;
+    v.resize(size_t(n));
+    return !n || bool(in.read(reinterpret_cast<char*>(v.data()), std::streamsize(n * sizeof(T))));
+}
+
+inline void write_box(std::ostream& out, const AABB& b) {
+    double d[6] = { b.x.min, b.x.max, b.y.min, b.y.max, b.z.min, b.z.max };
+    out.write(reinterpret_cast<const char*>(d), sizeof(d));
+}
+
+inline bool read_box(std::istream& in, AABB& b) {
+    double d[6];
+    if (!in.read(reinterpret_cast<char*>(d), sizeof(d))) return false;
+    b = AABB(Interval(d[0], d[1]), Interval(d[2], d[3]), Interval(d[4], d[5]));
+    return true;
+}
+
+// One cluster: a TriangleMesh that can store and restore its built BVH.
+class Cluster : public TriangleMesh {
+    public:
+        void write(std::ostream& out) const {
+            write_vector(out, positions);
+            write_vector(out, normals);
+            write_vector(out, uvs);
+            write_vector(out, colors);
+            write_vector(out, indices);
+            write_vector(out, normal_indices);
+            write_vector(out, uv_indices);
+            write_vector(out, face_materials);
+            write_vector(out, nodes);
+            write_vector(out, packets);
+            write_box(out, bbox);
+            out.write(reinterpret_cast<const char*>(&area), sizeof(area));
+        }
+
+        bool read(std::istream& in) {
+            return read_vector(in, positions) && read_vector(in, normals) && read_vector(in, uvs)
+                && read_vector(in, colors) && read_vector(in, indices)
+                && read_vector(in, normal_indices) && read_vector(in, uv_indices)
+                && read_vector(in, face_materials) && read_vector(in, nodes)
+                && read_vector(in, packets) && read_box(in, bbox)
+                && in.read(reinterpret_cast<char*>(&area), sizeof(area));
+        }
+};
+
+// Renumbers the attribute indices of the listed faces into a compact range.
+// `picked` receives the source index behind each new one. Indices at or past
+// `limit` mean "missing" to fill_hit and stay out of range.
+inline void remap_indices(const std::vector<uint32_t>& source_indices, const int* faces,
+                          size_t count, size_t limit, std::vector<uint32_t>& local_indices,
+                          std::vector<uint32_t>& picked) {
+    std::unordered_map<uint32_t, uint32_t> slot;
+    slot.reserve(count * 2);
+    local_indices.resize(3 * count);
+    for (size_t i = 0; i < count; i++) {
+        for (int k = 0; k < 3; k++) {
+            uint32_t index = source_indices[3 * size_t(faces[i]) + k];
+            if (index >= limit) {
+                local_indices[3 * i + k] = UINT32_MAX;
+                continue;
+            }
+            auto it = slot.find(index);
+            if (it == slot.end()) {
+                it = slot.emplace(index, uint32_t(picked.size())).first;
+                picked.push_back(index);
+            }
+            local_indices[3 * i + k] = it->second;
+        }
+    }
+}
+
+// Copies a vertex attribute of the listed faces. Attributes that follow the
+// position indices reuse the position remap (`position_picked`) and keep
+// following them in the cluster.
+template <typename T>
+inline void copy_attribute(const TriangleMesh& source, const std::vector<uint32_t>& own_indices,
+                           const std::vector<T>& values, const int* faces, size_t count,
+                           const std::vector<uint32_t>& position_picked,
+                           std::vector<T>& local_values, std::vector<uint32_t>& local_indices) {
+    if (values.empty()) return;
+    if (own_indices.empty() && values.size() >= source.positions.size()) {
+        for (uint32_t p : position_picked) local_values.push_back(values[p]);
+        return;
+    }
+    std::vector<uint32_t> picked;
+    remap_indices(own_indices.empty() ? source.indices : own_indices, faces, count,
+                  values.size(), local_indices, picked);
+    for (uint32_t i : picked) local_values.push_back(values[i]);
+}
+
+// Copies the faces of `source` listed in `faces` into a standalone mesh with
+// its own compact vertex arrays.
+inline void extract_cluster(const TriangleMesh& source, const int* faces, size_t count,
+                            Cluster& cluster) {
+    std::vector<uint32_t> picked;
+    remap_indices(source.indices, faces, count, source.positions.size(), cluster.indices, picked);
+    for (uint32_t p : picked) cluster.positions.push_back(source.positions[p]);
+    if (!source.colors.empty())
+        for (uint32_t p : picked) cluster.colors.push_back(source.colors[p]);
+
+    copy_attribute(source, source.normal_indices, source.normals, faces, count, picked,
+                   cluster.normals, cluster.normal_indices);
+    copy_attribute(source, source.uv_indices, source.uvs, faces, count, picked,
+                   cluster.uvs, cluster.uv_indices);
+
+    if (!source.face_materials.empty())
+        for (size_t i = 0; i < count; i++)
+            cluster.face_materials.push_back(source.face_materials[size_t(faces[i])]);
+}
+
+} // namespace paged_detail
+
+class PagedMesh : public Hittable {
+    public:
+        // Clusters `source` into `page_file` and returns the paged mesh, or
+        // nullptr if the file can't be written. The source can be dropped
+        // afterwards, but it has to fit in memory first (see above).
+        static shared_ptr<PagedMesh> create(const TriangleMesh& source, const std::string& page_file,
+                                            const PagedMeshOptions& options = PagedMeshOptions()) {
+            if (!write(source, page_file, options)) return nullptr;
+            auto mesh = make_shared<PagedMesh>(page_file, source.materials, options.memory_cap);
+            return mesh->cluster_count() ? mesh : nullptr;
+        }
+
+        static bool write(const TriangleMesh& source, const std::string& page_file,
+                          const PagedMeshOptions& options = PagedMeshOptions()) {
+            using namespace paged_detail;
+            std::ofstream out(page_file, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                std::cerr << "ERROR: Could not create page file " << page_file << "\n";
+                return false;
+            }
+
+            // clusters are the leaves of a coarse object-split BVH over the faces
+            size_t n = source.face_count();
+            std::vector<AABB> boxes(n);
+            for (size_t f = 0; f < n; f++) {
+                vec4 p0 = to_vec4(source.positions[source.indices[3*f]]);
+                vec4 p1 = to_vec4(source.positions[source.indices[3*f + 1]]);
+                vec4 p2 = to_vec4(source.positions[source.indices[3*f + 2]]);
+                boxes[f] = AABB(AABB(p0, p1), AABB(p2, p2));
+            }
+            BVHBuildOptions coarse;
+            coarse.spatial_splits = false;
+            coarse.max_leaf_size = int(std::max<size_t>(1, options.cluster_faces));
+            std::vector<BVHFlatNode> flat;
+            std::vector<int> faces;
+            BVHBuilder(boxes, coarse).build(flat, faces);
+
+            std::vector<ClusterInfo> table;
+            for (const auto& node : flat) {
+                if (node.count > 0)
+                    table.push_back({node.bbox, 0, 0, 0, size_t(node.offset), size_t(node.count)});
+            }
+
+            // header with a placeholder table, blobs, then the real table
+            uint64_t count = table.size();
+            out.write(magic(), 8);
+            out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+            auto table_pos = out.tellp();
+            for (const auto& info : table) write_info(out, info);
+
+            for (auto& info : table) {
+                Cluster cluster;
+                extract_cluster(source, &faces[info.first_face], info.face_count, cluster);
+                cluster.build(options.bvh);
+                info.area = cluster.surface_area();
+                info.bbox = cluster.bounding_box();
+                info.offset = uint64_t(out.tellp());
+                cluster.write(out);
+                info.size = uint64_t(out.tellp()) - info.offset;
+            }
+            out.seekp(table_pos);
+            for (const auto& info : table) write_info(out, info);
+            if (!out) {
+                std::cerr << "ERROR: Failed writing page file " << page_file << "\n";
+                return false;
+            }
+            return true;
+        }
+
+        // Opens a page file written by write(); `materials` maps the faces'
+        // material indices to MaterialTable ids.
+        PagedMesh(const std::string& page_file, const std::vector<uint32_t>& materials,
+                  size_t memory_cap = PagedMeshOptions().memory_cap)
+          : materials(materials), memory_cap(memory_cap), file(page_file, std::ios::binary)
+        {
+            using namespace paged_detail;
+            char header[8];
+            uint64_t count = 0;
+            if (!file.read(header, 8) || std::memcmp(header, magic(), 8) != 0
+                || !file.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+                std::cerr << "ERROR: " << page_file << " is not a page file\n";
+                return;
+            }
+            table.resize(size_t(count));
+            for (auto& info : table) {
+                if (!read_info(file, info)) {
+                    std::cerr << "ERROR: Truncated page file " << page_file << "\n";
+                    table.clear();
+                    return;
+                }
+            }
+
+            std::vector<AABB> boxes;
+            for (const auto& info : table) {
+                boxes.push_back(info.bbox);
+                bbox = AABB(bbox, info.bbox);
+                area += info.area;
+            }
+            BVHBuildOptions top;
+            top.spatial_splits = false;
+            top.max_leaf_size = 1;
+            BVHBuilder(boxes, top).build(nodes, cluster_indices);
+        }
+
+        size_t cluster_count() const { return table.size(); }
+
+        bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
+            if (nodes.empty()) return false;
+
+            bool hit_anything = false;
+            shared_ptr<const TriangleMesh> hit_cluster; // may be evicted before we finish
+            int stack[64];
+            int top = 0;
+            stack[top++] = 0;
+            while (top > 0) {
+                int index = stack[--top];
+                const BVHFlatNode& node = nodes[index];
+                if (!node.bbox.hit(r, ray_t)) continue;
+
+                if (node.count > 0) {
+                    for (int i = node.offset; i < node.offset + node.count; i++) {
+                        auto cluster = resident(size_t(cluster_indices[i]));
+                        if (cluster && cluster->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            hit_cluster = cluster;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                } else {
+                    int near_child = index + 1;
+                    int far_child = node.offset;
+                    if (r.d()[node.axis] < 0) std::swap(near_child, far_child);
+                    stack[top++] = far_child;
+                    stack[top++] = near_child;
+                }
+            }
+            // the cluster's deferred surface can't outlive its residency
+            if (hit_anything) rec.finish(r);
+            return hit_anything;
+        }
+
+        AABB bounding_box() const override { return bbox; }
+        double surface_area() const override { return area; }
+
+        PagingStats stats() const {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            return paging;
+        }
+
+    private:
+        struct ClusterInfo {
+            AABB bbox;
+            double area;
+            uint64_t offset, size; // blob position in the page file
+            size_t first_face, face_count; // only used while writing
+        };
+
+        struct CacheEntry {
+            shared_ptr<const TriangleMesh> mesh;
+            size_t bytes;
+            std::list<size_t>::iterator lru; // position in `recent`
+        };
+
+        static const char* magic() { return "RTWPAGE1"; }
+
+        std::vector<ClusterInfo> table;
+        std::vector<BVHFlatNode> nodes;     // resident top level over clusters
+        std::vector<int> cluster_indices;
+        std::vector<uint32_t> materials;
+        AABB bbox = AABB::empty;
+        double area = 0;
+        size_t memory_cap;
+
+        // page cache; mutable because hit() is const
+        mutable std::mutex cache_mutex;
+        mutable std::ifstream file;
+        mutable std::unordered_map<size_t, CacheEntry> cache;
+        mutable std::list<size_t> recent; // most recently used first
+        mutable PagingStats paging;
+
+        static void write_info(std::ostream& out, const ClusterInfo& info) {
+            paged_detail::write_box(out, info.bbox);
+            out.write(reinterpret_cast<const char*>(&info.area), sizeof(info.area));
+            out.write(reinterpret_cast<const char*>(&info.offset), sizeof(info.offset));
+            out.write(reinterpret_cast<const char*>(&info.size), sizeof(info.size));
+        }
+
+        static bool read_info(std::istream& in, ClusterInfo& info) {
+            info.first_face = info.face_count = 0;
+            return paged_detail::read_box(in, info.bbox)
+                && in.read(reinterpret_cast<char*>(&info.area), sizeof(info.area))
+                && in.read(reinterpret_cast<char*>(&info.offset), sizeof(info.offset))
+                && in.read(reinterpret_cast<char*>(&info.size), sizeof(info.size));
+        }
+
+        // The cluster, paged in if needed. The returned pointer stays valid
+        // even if the cluster is evicted while the caller still uses it.
+        shared_ptr<const TriangleMesh> resident(size_t c) const {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            auto it = cache.find(c);
+            if (it != cache.end()) {
+                paging.hits++;
+                recent.splice(recent.begin(), recent, it->second.lru);
+                return it->second.mesh;
+            }
+
+            paging.misses++;
+            auto cluster = make_shared<paged_detail::Cluster>();
+            file.clear();
+            file.seekg(std::streamoff(table[c].offset));
+            if (!cluster->read(file)) {
+                std::cerr << "ERROR: Could not read cluster " << c << " from the page file\n";
+                return nullptr;
+            }
+            cluster->materials = materials;
+            size_t bytes = cluster->memory_bytes();
+            paging.bytes_paged += size_t(table[c].size);
+
+            // make room, but always keep the cluster being returned
+            while (!recent.empty() && paging.resident_bytes + bytes > memory_cap) {
+                auto victim = cache.find(recent.back());
+                paging.resident_bytes -= victim->second.bytes;
+                cache.erase(victim);
+                recent.pop_back();
+                paging.evictions++;
+            }
+            recent.push_front(c);
+            cache[c] = {cluster, bytes, recent.begin()};
+            paging.resident_bytes += bytes;
+            paging.peak_resident_bytes = std::max(paging.peak_resident_bytes, paging.resident_bytes);
+            return cluster;
+        }
+};
+
+#endif
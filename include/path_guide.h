@@ -0,0 +1,255 @@
+#ifndef PATH_GUIDE_H
+#define PATH_GUIDE_H
+
+#include "pdf.h"
+#include <vector>
+
+// Learned distribution of incoming light over the sphere of directions at
+// one region of the scene: a quadtree over the square (cos theta, phi),
+// which maps the sphere with equal area, so a cell's share of the energy is
+// its probability. Bright directions get subdivided finer each pass.
+class DirectionalTree {
+    public:
+        DirectionalTree() : nodes(1) {}
+
+        bool empty() const { return nodes[0].total() <= 0; }
+        size_t samples() const { return sample_count; }
+        void halve_samples() { sample_count /= 2; }
+        size_t node_count() const { return nodes.size(); }
+
+        // radiance arriving along dir, over the density it was sampled with
+        void record(const vec4& dir, double value) {
+            double x, y;
+            to_square(dir, x, y);
+            sample_count++;
+            for (uint32_t n = 0;;) {
+                int c = quadrant(x, y);
+                nodes[n].sum[c] += value;
+                if (!nodes[n].child[c]) return;
+                n = nodes[n].child[c];
+            }
+        }
+
+        // Scales each node's sums to add up to 1 (or stay 0), so pdf() and
+        // sample() needn't divide on the way down. For the tree that's
+        // sampled; records after it would be out of scale.
+        void normalize() {
+            for (Node& node : nodes) {
+                double total = node.total();
+                if (total > 0) for (double& s : node.sum) s /= total;
+            }
+        }
+
+        // over solid angle; 0 in cells nothing came from (normalized trees)
+        double pdf(const vec4& dir) const {
+            double x, y;
+            to_square(dir, x, y);
+            double p = 1;
+            for (uint32_t n = 0;;) {
+                const Node& node = nodes[n];
+                int c = quadrant(x, y);
+                p *= 4 * node.sum[c];
+                if (!node.child[c] || p <= 0) break;
+                n = node.child[c];
+            }
+            return p / (4 * pi);
+        }
+
+        // (normalized trees)
+        vec4 sample() const {
+            double x0 = 0, y0 = 0, size = 1;
+            for (uint32_t n = 0;;) {
+                const Node& node = nodes[n];
+                double xi = gen_random_double();
+                int c = 3;
+                for (int k = 0; k < 3; k++) {
+                    if (xi < node.sum[k]) { c = k; break; }
+                    xi -= node.sum[k];
+                }
+                while (c > 0 && node.sum[c] <= 0) c--; // rounding past the last one
+                size *= 0.5;
+                x0 += (c & 1) * size;
+                y0 += (c >> 1) * size;
+                if (!node.child[c]) break;
+                n = node.child[c];
+            }
+            return from_square(x0 + gen_random_double() * size, y0 + gen_random_double() * size);
+        }
+
+        // Empty tree for the next pass, shaped by this one's energy: a cell
+        // holding more than `threshold` of the total is split (down to
+        // max_depth), the rest stay or become leaves. Where this tree was a
+        // leaf the energy is taken as even across it.
+        DirectionalTree refined(double threshold, int max_depth) const {
+            DirectionalTree next;
+            if (!empty()) subdivide(next, 0, 0, 1.0, threshold, 1, max_depth);
+            return next;
+        }
+
+    private:
+        struct Node {
+            double sum[4] = {0, 0, 0, 0}; // energy per quadrant, x + 2y
+            uint32_t child[4] = {0, 0, 0, 0}; // 0: leaf (the root is no one's child)
+            double total() const { return sum[0] + sum[1] + sum[2] + sum[3]; }
+        };
+
+        std::vector<Node> nodes;
+        size_t sample_count = 0;
+
+        // from: node of this tree covering the same cell, or -1 inside a leaf
+        void subdivide(DirectionalTree& next, uint32_t to, int from, double fraction,
+                       double threshold, int depth, int max_depth) const {
+            if (depth >= max_depth) return;
+            double total = (from >= 0) ? nodes[from].total() : 0;
+            for (int c = 0; c < 4; c++) {
+                double f = (from < 0) ? fraction / 4 : (total > 0 ? fraction * nodes[from].sum[c] / total : 0);
+                if (f <= threshold) continue;
+                uint32_t child = uint32_t(next.nodes.size());
+                next.nodes.emplace_back();
+                next.nodes[to].child[c] = child;
+                int from_child = (from >= 0 && nodes[from].child[c]) ? int(nodes[from].child[c]) : -1;
+                subdivide(next, child, from_child, f, threshold, depth + 1, max_depth);
+            }
+        }
+
+        // picks the quadrant of (x, y) and rescales them into it
+        static int quadrant(double& x, double& y) {
+            int cx = x >= 0.5, cy = y >= 0.5;
+            x = 2 * x - cx;
+            y = 2 * y - cy;
+            return cx + 2 * cy;
+        }
+
+        static void to_square(const vec4& dir, double& x, double& y) {
+            vec4 d = unit_vector(dir);
+            x = std::fmin(std::fmax(0.5 * (d.z() + 1), 0.0), 1 - 1e-9);
+            double phi = std::atan2(d.y(), d.x());
+            if (phi < 0) phi += 2 * pi;
+            y = std::fmin(phi / (2 * pi), 1 - 1e-9);
+        }
+
+        static vec4 from_square(double x, double y) {
+            double cos_theta = 2 * x - 1;
+            double sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+            double phi = 2 * pi * y;
+            return vec4(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+        }
+};
+
+// Online path guiding after Müller et al., "Practical Path Guiding" (2017):
+// an SD-tree, a binary tree over space (splitting the scene's box at
+// midpoints, cycling x, y, z) with a DirectionalTree in each leaf. The
+// render runs short training passes first; each one samples with what the
+// passes before it learned and records into a second tree per leaf, which
+// refine() then swaps in. During a pass the sampling trees are only read.
+class PathGuide {
+    public:
+        // a leaf splits once a pass records more than spatial_threshold *
+        // sqrt(that pass's samples per pixel) in it (the paper's 12000 left
+        // the Cornell box at 300 pixels with too few regions to help)
+        PathGuide(const AABB& bounds, double spatial_threshold = 4000)
+          : spatial_threshold(spatial_threshold), nodes(1)
+        {
+            for (int a = 0; a < 3; a++) {
+                const Interval& axis = bounds.axis_interval(a);
+                origin[a] = axis.min;
+                inv_size[a] = (axis.size() > 0) ? 1 / axis.size() : 0; // flat: all on one side
+            }
+        }
+
+        // the leaf around p, for learned() and record()
+        uint32_t region(const point4& p) const {
+            double x[3];
+            for (int a = 0; a < 3; a++)
+                x[a] = std::fmin(std::fmax((p[a] - origin[a]) * inv_size[a], 0.0), 1 - 1e-9);
+            uint32_t n = 0;
+            while (nodes[n].child[0]) {
+                int a = nodes[n].depth % 3;
+                int side = x[a] >= 0.5;
+                x[a] = 2 * x[a] - side;
+                n = nodes[n].child[side];
+            }
+            return n;
+        }
+
+        // what the passes so far learned there, or nullptr
+        const DirectionalTree* learned(uint32_t region) const {
+            const DirectionalTree& tree = nodes[region].sampling;
+            return tree.empty() ? nullptr : &tree;
+        }
+
+        void record(uint32_t region, const vec4& dir, double radiance) {
+            if (!(radiance >= 0) || radiance == infinity) return; // NaN and inf
+            nodes[region].building.record(dir, radiance);
+        }
+
+        // end of training pass `pass` (2^pass samples per pixel)
+        void refine(int pass) {
+            double threshold = spatial_threshold * std::sqrt(double(1 << pass));
+            // busy leaves split in two, halves starting from the parent's
+            // tree; the children are checked in turn as the loop reaches them
+            for (size_t i = 0; i < nodes.size(); i++) {
+                if (nodes[i].child[0] || nodes[i].building.samples() <= threshold) continue;
+                if (nodes[i].depth >= max_spatial_depth) continue;
+                DirectionalTree half = nodes[i].building;
+                half.halve_samples();
+                for (int k = 0; k < 2; k++) {
+                    nodes[i].child[k] = uint32_t(nodes.size());
+                    nodes.emplace_back();
+                    nodes.back().depth = nodes[i].depth + 1;
+                    nodes.back().building = half;
+                }
+                nodes[i].sampling = nodes[i].building = DirectionalTree();
+            }
+            for (Node& node : nodes) {
+                if (node.child[0]) continue;
+                node.sampling = std::move(node.building);
+                node.building = node.sampling.refined(0.01, 20);
+                node.sampling.normalize();
+            }
+        }
+
+        size_t leaf_count() const {
+            size_t n = 0;
+            for (const Node& node : nodes) n += !node.child[0];
+            return n;
+        }
+
+    private:
+        static const int max_spatial_depth = 48;
+
+        struct Node {
+            uint32_t child[2] = {0, 0}; // both 0 for a leaf
+            int depth = 0;              // split axis is depth % 3
+            DirectionalTree sampling, building; // leaves only
+        };
+
+        double spatial_threshold;
+        std::vector<Node> nodes;
+        double origin[3], inv_size[3]; // the scene's box
+};
+
+// The material's distribution with a learned one mixed in (half and half),
+// or just the material's where nothing's been learned.
+class GuidedPDF : public PDF {
+    public:
+        GuidedPDF(const PDF& surface, const DirectionalTree* learned, double fraction = 0.5)
+          : surface(surface), learned(learned), fraction(learned ? fraction : 0) {}
+
+        double value(const vec4& dir) const override {
+            double p = surface.value(dir);
+            return learned ? (1 - fraction) * p + fraction * learned->pdf(dir) : p;
+        }
+
+        vec4 generate() const override {
+            if (learned && gen_random_double() < fraction) return learned->sample();
+            return surface.generate();
+        }
+
+    private:
+        const PDF& surface;
+        const DirectionalTree* learned;
+        double fraction;
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "hittable_list.h"
 #include "onb.h"
+#include <algorithm>
 
 class PDF {
     public:
@@ -58,11 +59,55 @@ class HittablePDF : public PDF {
         point4 origin;
 };
 
+// The material's own sampling distribution, held by value in ScatterRecord
+// so a bounce doesn't allocate. A small tagged type instead of a PDF
+// subclass per material: the kinds are few and all fit in one ONB.
+class SurfacePDF : public PDF {
+    public:
+        enum Kind { none, cosine, sphere };
+
+        SurfacePDF() : kind(none) {}
+
+        static SurfacePDF cosine_about(const vec4& normal) {
+            SurfacePDF pdf;
+            pdf.kind = cosine;
+            pdf.uvw = ONB(normal);
+            return pdf;
+        }
+
+        static SurfacePDF uniform_sphere() {
+            SurfacePDF pdf;
+            pdf.kind = sphere;
+            return pdf;
+        }
+
+        double value(const vec4& dir) const override {
+            switch (kind) {
+                case cosine: return std::fmax(0, dot(unit_vector(dir), uvw.w()) / pi);
+                case sphere: return 1 / (4 * pi);
+                default:     return 0;
+            }
+        }
+
+        vec4 generate() const override {
+            switch (kind) {
+                case cosine: return uvw.transform(random_cosine_direction());
+                case sphere: return random_unit_vector();
+                default:     return vec4(0,0,0);
+            }
+        }
+
+    private:
+        Kind kind;
+        ONB uvw;
+};
+
+// Mixes two PDFs that outlive it (both usually sit on the caller's stack).
 class MixturePDF : public PDF {
     public:
-        MixturePDF(shared_ptr<PDF> p0, shared_ptr<PDF> p1) {
-            p[0] = p0;
-            p[1] = p1;
+        MixturePDF(const PDF& p0, const PDF& p1) {
+            p[0] = &p0;
+            p[1] = &p1;
         }
 
         double value(const vec4& dir) const override {
@@ -78,9 +123,83 @@ class MixturePDF : public PDF {
             }
         }
     private:
-        shared_ptr<PDF> p[2];
+        const PDF* p[2];
+
+};
 
+// Piecewise-constant density on [0, 1) from n non-negative cell weights,
+// sampled by inverting its CDF. All-zero weights give the uniform density.
+class Distribution1D {
+    public:
+        Distribution1D() {}
+        Distribution1D(const double* weights, int n) : func(weights, weights + n), cdf(n + 1) {
+            cdf[0] = 0;
+            for (int i = 0; i < n; i++) cdf[i + 1] = cdf[i] + func[i] / n;
+            integral = cdf[n];
+            for (int i = 1; i <= n; i++) cdf[i] = (integral > 0) ? cdf[i] / integral : double(i) / n;
+        }
+
+        int count() const { return int(func.size()); }
+        double total() const { return integral; } // mean weight
+
+        // x in [0, 1) for a uniform xi; pdf is the density at x, cell its index
+        double sample(double xi, double& pdf, int& cell) const {
+            cell = int(std::upper_bound(cdf.begin(), cdf.end(), xi) - cdf.begin()) - 1;
+            cell = std::min(std::max(cell, 0), count() - 1);
+            double width = cdf[cell + 1] - cdf[cell];
+            double offset = (width > 0) ? (xi - cdf[cell]) / width : 0;
+            pdf = density(cell);
+            return std::min((cell + offset) / count(), 1.0 - 1e-12);
+        }
+
+        double density(int cell) const { return (integral > 0) ? func[cell] / integral : 1; }
+
+    private:
+        std::vector<double> func;
+        std::vector<double> cdf;
+        double integral = 0;
+};
+
+// Density on the unit square from an nu x nv grid of weights (row-major,
+// v rows): a marginal over rows, then one conditional per row.
+class Distribution2D {
+    public:
+        Distribution2D() {}
+        Distribution2D(const std::vector<double>& weights, int nu, int nv) {
+            std::vector<double> row_totals(nv);
+            for (int v = 0; v < nv; v++) {
+                rows.emplace_back(&weights[size_t(v) * nu], nu);
+                row_totals[v] = rows.back().total();
+            }
+            marginal = Distribution1D(row_totals.data(), nv);
+        }
+
+        double total() const { return marginal.total(); }
+
+        void sample(double xi0, double xi1, double& u, double& v, double& pdf) const {
+            double pdf_v, pdf_u;
+            int row, column;
+            v = marginal.sample(xi1, pdf_v, row);
+            u = rows[row].sample(xi0, pdf_u, column);
+            pdf = pdf_u * pdf_v;
+        }
+
+        double density(double u, double v) const {
+            int row = std::min(int(v * marginal.count()), marginal.count() - 1);
+            int column = std::min(int(u * rows[row].count()), rows[row].count() - 1);
+            return marginal.density(row) * rows[row].density(column);
+        }
+
+    private:
+        std::vector<Distribution1D> rows;
+        Distribution1D marginal;
 };
 
+// MIS weight (Veach's power heuristic, beta = 2) for a sample drawn from the
+// strategy with density f_pdf, when the other strategy has density g_pdf
+inline double power_heuristic(double f_pdf, double g_pdf) {
+    double f2 = f_pdf * f_pdf, g2 = g_pdf * g_pdf;
+    return (f2 + g2 > 0) ? f2 / (f2 + g2) : 0;
+}
 
 #endif
\ No newline at end of file
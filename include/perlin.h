@@ -2,12 +2,16 @@
 #define PERLIN_H
 
 #include "rtweekend.h"
+#include "aabb.h"
+#include "simd.h"
+#include <vector>
 
 class Perlin {
     public: 
         Perlin() {
             for (int i = 0; i < point_count; i++) {
                 randvec[i] = unit_vector(vec4::random(-1, 1));
+                for (int k = 0; k < 3; k++) grad[k][i] = float(randvec[i][k]);
             }
             perlin_generate_perm(perm_x);
             perlin_generate_perm(perm_y);
@@ -44,15 +48,54 @@ class Perlin {
         }
 
         double turb(const point4& p, int depth) const {
-            // sum of multiple Perlin noises
+            // sum of multiple Perlin noises, one octave per SIMD lane: the
+            // lattice hashing and gradient fetches are per lane, the smoothing
+            // and the 8 corner dot products run on all octaves at once
             auto accum = 0.0;
             auto temp_p = p;
             auto weight = 1.0;
 
-            for (int i = 0; i < depth; i++) {
-                accum += weight * noise(temp_p);
-                weight *= 0.5;
-                temp_p *= 2;
+            for (int first = 0; first < depth; first += SIMD_WIDTH) {
+                float fu[SIMD_WIDTH], fv[SIMD_WIDTH], fw[SIMD_WIDTH], amp[SIMD_WIDTH];
+                float g[8][3][SIMD_WIDTH]; // corner (di dj dk in binary), axis, lane
+                for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+                    if (first + lane >= depth) { // no octave left: contributes 0
+                        fu[lane] = fv[lane] = fw[lane] = amp[lane] = 0;
+                        for (int c = 0; c < 8; c++) g[c][0][lane] = g[c][1][lane] = g[c][2][lane] = 0;
+                        continue;
+                    }
+                    int i = lattice(temp_p.x()), j = lattice(temp_p.y()), k = lattice(temp_p.z());
+                    fu[lane] = float(temp_p.x() - i);
+                    fv[lane] = float(temp_p.y() - j);
+                    fw[lane] = float(temp_p.z() - k);
+                    amp[lane] = float(weight);
+                    for (int c = 0; c < 8; c++) {
+                        int h = perm_x[(i + (c >> 2)) & 255] ^ perm_y[(j + ((c >> 1) & 1)) & 255]
+                              ^ perm_z[(k + (c & 1)) & 255];
+                        g[c][0][lane] = grad[0][h];
+                        g[c][1][lane] = grad[1][h];
+                        g[c][2][lane] = grad[2][h];
+                    }
+                    weight *= 0.5;
+                    temp_p *= 2;
+                }
+
+                vfloat one(1.0f), u = vfloat::load(fu), v = vfloat::load(fv), w = vfloat::load(fw);
+                // Hermitian smoothing
+                vfloat uu = u * u * (vfloat(3.0f) - vfloat(2.0f) * u);
+                vfloat vv = v * v * (vfloat(3.0f) - vfloat(2.0f) * v);
+                vfloat ww = w * w * (vfloat(3.0f) - vfloat(2.0f) * w);
+                vfloat sum(0.0f);
+                for (int c = 0; c < 8; c++) {
+                    bool di = c >> 2, dj = (c >> 1) & 1, dk = c & 1;
+                    vfloat dot = vfloat::load(g[c][0]) * (di ? u - one : u)
+                               + vfloat::load(g[c][1]) * (dj ? v - one : v)
+                               + vfloat::load(g[c][2]) * (dk ? w - one : w);
+                    sum = sum + (di ? uu : one - uu) * (dj ? vv : one - vv) * (dk ? ww : one - ww) * dot;
+                }
+                float octave[SIMD_WIDTH];
+                (sum * vfloat::load(amp)).store(octave);
+                for (int lane = 0; lane < SIMD_WIDTH; lane++) accum += octave[lane];
             }
 
             return std::fabs(accum);
@@ -60,10 +103,17 @@ class Perlin {
     private:
         static const int point_count = 256;
         vec4 randvec[point_count];
+        float grad[3][point_count]; // randvec by axis, for turb()
         int perm_x[point_count];
         int perm_y[point_count];
         int perm_z[point_count];
 
+        // floor to int; std::floor is a library call without SSE4.1
+        static int lattice(double x) {
+            int i = int(x);
+            return (x < i) ? i - 1 : i;
+        }
+
         static void perlin_generate_perm(int* p) {
             for (int i = 0; i < point_count; i++) {
                 p[i] = i;
@@ -100,4 +150,66 @@ class Perlin {
         }
 };
 
+// turb() baked into a grid over a box and sampled trilinearly, for objects
+// whose noise is looked up far more often than the grid has points. Detail
+// finer than a cell (size of the box / resolution) is lost, so it suits small
+// objects; outside the box, lookup() fails and the caller asks the noise.
+// The grid is stored in 8x8x8 bricks so that a lookup's 8 corners usually
+// sit in one brick.
+class NoiseVolume {
+    public:
+        NoiseVolume(const Perlin& noise, const AABB& bounds, int depth, int resolution = 128)
+          : bounds(bounds) {
+            double longest = std::fmax(bounds.x.size(), std::fmax(bounds.y.size(), bounds.z.size()));
+            double cell = longest / std::max(resolution, 1);
+            for (int a = 0; a < 3; a++) {
+                const Interval& ax = bounds.axis_interval(a);
+                n[a] = std::max(2, int(std::ceil(ax.size() / cell)) + 1); // points, ends included
+                step[a] = ax.size() / (n[a] - 1);
+                bricks[a] = (n[a] + brick - 1) / brick;
+            }
+            values.resize(size_t(bricks[0]) * bricks[1] * bricks[2] * brick * brick * brick, 0.0f);
+            for (int z = 0; z < n[2]; z++)
+                for (int y = 0; y < n[1]; y++)
+                    for (int x = 0; x < n[0]; x++) {
+                        point4 p(bounds.x.min + x * step[0], bounds.y.min + y * step[1], bounds.z.min + z * step[2]);
+                        values[index(x, y, z)] = float(noise.turb(p, depth));
+                    }
+        }
+
+        // false outside the box
+        bool lookup(const point4& p, double& turb) const {
+            double c[3];
+            int i[3];
+            for (int a = 0; a < 3; a++) {
+                c[a] = (p[a] - bounds.axis_interval(a).min) / step[a];
+                if (!(c[a] >= 0 && c[a] <= n[a] - 1)) return false; // also catches NaN
+                i[a] = std::min(int(c[a]), n[a] - 2);
+                c[a] -= i[a];
+            }
+            double accum = 0;
+            for (int dz = 0; dz < 2; dz++)
+                for (int dy = 0; dy < 2; dy++)
+                    for (int dx = 0; dx < 2; dx++)
+                        accum += (dx ? c[0] : 1 - c[0]) * (dy ? c[1] : 1 - c[1]) * (dz ? c[2] : 1 - c[2])
+                               * values[index(i[0] + dx, i[1] + dy, i[2] + dz)];
+            turb = accum;
+            return true;
+        }
+
+        size_t memory_bytes() const { return values.capacity() * sizeof(float); }
+
+    private:
+        static const int brick = 8;
+        AABB bounds;
+        int n[3], bricks[3];
+        double step[3];
+        std::vector<float> values;
+
+        size_t index(int x, int y, int z) const {
+            size_t b = (size_t(z / brick) * bricks[1] + y / brick) * bricks[0] + x / brick;
+            return b * (brick * brick * brick) + ((z % brick) * brick + y % brick) * brick + x % brick;
+        }
+};
+
 #endif
\ No newline at end of file
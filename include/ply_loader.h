@@ -0,0 +1,497 @@
+#ifndef PLY_LOADER_H
+#define PLY_LOADER_H
+
+#include "mesh.h"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PLY_USE_MMAP
+#endif
+
+// Binary PLY loader producing a single TriangleMesh.
+//
+// The file is memory-mapped and vertex/face elements are decoded straight
+// from the mapping into the mesh arrays; when positions or normals are stored
+// as tightly packed native-endian floats they are copied in one block. Faces
+// of any size are fan-triangulated (quads become two triangles). Optional
+// vertex normals, texture coordinates and colors are picked up by their
+// usual property names. ASCII PLY is not supported.
+
+struct PlyLoadOptions {
+    unsigned threads = 0;   // 0: one per hardware thread
+    bool report = true;     // print load throughput to std::clog
+    BVHBuildOptions bvh = TriangleMesh::default_build_options();
+    bool build = true;      // false: leave the BVH to the caller, e.g. to build once after moving vertices
+};
+
+struct PlyLoadStats {
+    size_t bytes = 0;
+    size_t vertices = 0;
+    size_t faces = 0;       // triangles after splitting quads and polygons
+    double parse_seconds = 0;
+    double build_seconds = 0;
+    bool built = false;     // PlyLoadOptions::build
+
+    void print(std::ostream& out) const {
+        double mb = bytes / (1024.0 * 1024.0);
+        out << "PLY: " << vertices << " vertices, " << faces << " triangles, " << mb << " MB parsed in "
+            << parse_seconds << " s (" << (parse_seconds > 0 ? mb / parse_seconds : 0.0) << " MB/s)";
+        if (built) out << ", BVH built in " << build_seconds << " s";
+        out << '\n';
+    }
+};
+
+namespace ply_detail {
+
+// Read-only view of a whole file; mmap where available, otherwise read into memory.
+class MappedFile {
+    public:
+        explicit MappedFile(const std::string& filename) {
+#ifdef PLY_USE_MMAP
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return;
+            struct stat st;
+            if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+                void* p = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    ::madvise(p, size_t(st.st_size), MADV_SEQUENTIAL);
+                    mapping = static_cast<const char*>(p);
+                    length = size_t(st.st_size);
+                }
+            }
+            ::close(fd);
+            if (mapping) return;
+#endif
+            std::ifstream file(filename, std::ios::binary);
+            if (!file) return;
+            buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            length = buffer.size();
+        }
+
+        ~MappedFile() {
+#ifdef PLY_USE_MMAP
+            if (mapping) ::munmap(const_cast<char*>(mapping), length);
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool ok() const { return length > 0; }
+        const char* data() const { return mapping ? mapping : buffer.data(); }
+        size_t size() const { return length; }
+
+    private:
+        const char* mapping = nullptr;
+        std::vector<char> buffer;
+        size_t length = 0;
+};
+
+enum class Type { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Invalid };
+
+inline Type parse_type(const std::string& name) {
+    if (name == "char" || name == "int8") return Type::Int8;
+    if (name == "uchar" || name == "uint8") return Type::UInt8;
+    if (name == "short" || name == "int16") return Type::Int16;
+    if (name == "ushort" || name == "uint16") return Type::UInt16;
+    if (name == "int" || name == "int32") return Type::Int32;
+    if (name == "uint" || name == "uint32") return Type::UInt32;
+    if (name == "float" || name == "float32") return Type::Float32;
+    if (name == "double" || name == "float64") return Type::Float64;
+    return Type::Invalid;
+}
+
+inline int type_size(Type t) {
+    static const int sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+    return sizes[int(t)];
+}
+
+inline bool host_is_little_endian() {
+    uint16_t one = 1;
+    unsigned char first;
+    std::memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+template <typename T>
+inline T load(const char* p, bool swap) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, p, sizeof(T));
+    if (swap) std::reverse(bytes, bytes + sizeof(T));
+    T value;
+    std::memcpy(&value, bytes, sizeof(T));
+    return value;
+}
+
+inline double read_scalar(const char* p, Type t, bool swap) {
+    switch (t) {
+        case Type::Int8:    return double(load<int8_t>(p, false));
+        case Type::UInt8:   return double(load<uint8_t>(p, false));
+        case Type::Int16:   return double(load<int16_t>(p, swap));
+        case Type::UInt16:  return double(load<uint16_t>(p, swap));
+        case Type::Int32:   return double(load<int32_t>(p, swap));
+        case Type::UInt32:  return double(load<uint32_t>(p, swap));
+        case Type::Float32: return double(load<float>(p, swap));
+        case Type::Float64: return load<double>(p, swap);
+        default:            return 0.0;
+    }
+}
+
+inline uint32_t read_index(const char* p, Type t, bool swap) {
+    switch (t) {
+        case Type::Int8:    return uint32_t(load<int8_t>(p, false));
+        case Type::UInt8:   return uint32_t(load<uint8_t>(p, false));
+        case Type::Int16:   return uint32_t(load<int16_t>(p, swap));
+        case Type::UInt16:  return uint32_t(load<uint16_t>(p, swap));
+        case Type::Int32:   return uint32_t(load<int32_t>(p, swap));
+        case Type::UInt32:  return load<uint32_t>(p, swap);
+        default:            return uint32_t(read_scalar(p, t, swap));
+    }
+}
+
+struct Property {
+    std::string name;
+    Type type = Type::Invalid;
+    bool is_list = false;
+    Type count_type = Type::Invalid; // lists only
+    int offset = -1;                 // byte offset within a fixed-size element
+};
+
+struct Element {
+    std::string name;
+    size_t count = 0;
+    std::vector<Property> properties;
+    int stride = 0;                  // bytes per item, 0 if it contains lists
+
+    const Property* find(const char* const* names) const {
+        for (const auto& prop : properties)
+            for (const char* const* n = names; *n; n++)
+                if (prop.name == *n && !prop.is_list) return &prop;
+        return nullptr;
+    }
+};
+
+struct Header {
+    bool binary = false;
+    bool swap = false;               // file endianness differs from the host
+    std::vector<Element> elements;
+    size_t data_offset = 0;
+};
+
+inline bool parse_header(const char* data, size_t size, Header& header, std::string& error) {
+    const char* end_marker = "end_header";
+    const char* p = data;
+    const char* end = data + size;
+    if (size < 4 || std::memcmp(data, "ply", 3) != 0) { error = "not a PLY file"; return false; }
+
+    while (p < end) {
+        const char* e = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!e) { error = "truncated header"; return false; }
+        std::string line(p, e);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        p = e + 1;
+
+        std::istringstream in(line);
+        std::string key;
+        in >> key;
+        if (key == "format") {
+            std::string format;
+            in >> format;
+            if (format == "ascii") { error = "ASCII PLY is not supported"; return false; }
+            bool little = (format == "binary_little_endian");
+            if (!little && format != "binary_big_endian") { error = "unknown format " + format; return false; }
+            header.binary = true;
+            header.swap = (little != host_is_little_endian());
+        } else if (key == "element") {
+            Element element;
+            in >> element.name >> element.count;
+            header.elements.push_back(element);
+        } else if (key == "property") {
+            if (header.elements.empty()) { error = "property before element"; return false; }
+            Property prop;
+            std::string type;
+            in >> type;
+            if (type == "list") {
+                std::string count_type, item_type;
+                in >> count_type >> item_type;
+                prop.is_list = true;
+                prop.count_type = parse_type(count_type);
+                prop.type = parse_type(item_type);
+            } else {
+                prop.type = parse_type(type);
+            }
+            in >> prop.name;
+            if (prop.type == Type::Invalid || (prop.is_list && prop.count_type == Type::Invalid)) {
+                error = "unknown property type in '" + line + "'";
+                return false;
+            }
+            header.elements.back().properties.push_back(prop);
+        } else if (key == end_marker) {
+            header.data_offset = size_t(p - data);
+            break;
+        }
+    }
+    if (!header.binary) { error = "missing format line"; return false; }
+
+    for (auto& element : header.elements) {
+        int offset = 0;
+        for (auto& prop : element.properties) {
+            if (prop.is_list) { offset = -1; break; }
+            prop.offset = offset;
+            offset += type_size(prop.type);
+        }
+        element.stride = (offset < 0) ? 0 : offset;
+    }
+    return true;
+}
+
+// Size in bytes of one item of an element that contains lists, or 0 if the
+// item doesn't fit before end (each list count is checked before it's read).
+inline size_t item_size(const Element& element, const char* p, const char* end, bool swap) {
+    size_t available = size_t(end - p);
+    size_t size = 0;
+    for (const auto& prop : element.properties) {
+        if (prop.is_list) {
+            size_t count_size = type_size(prop.count_type);
+            if (size + count_size > available) return 0;
+            uint32_t n = read_index(p + size, prop.count_type, swap);
+            size += count_size + size_t(n) * type_size(prop.type);
+        } else {
+            size += type_size(prop.type);
+        }
+    }
+    return (size <= available) ? size : 0;
+}
+
+template <typename Task>
+inline void parallel_for(size_t count, unsigned threads, Task task) {
+    // task(begin, end) over contiguous ranges
+    threads = std::max(1u, std::min<unsigned>(threads, unsigned(count / 65536 + 1)));
+    if (threads == 1) { task(size_t(0), count); return; }
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i++)
+        workers.push_back(std::thread(task, count * i / threads, count * (i + 1) / threads));
+    for (auto& worker : workers) worker.join();
+}
+
+// Copies up to three float components per vertex into dst (stride 3 floats
+// for vec3f, 2 for vec2f). Packed native floats are a single memcpy.
+inline void extract(float* dst, int components, const char* base, size_t count, int stride,
+                    const Property* const* props, bool swap, float scale, unsigned threads) {
+    bool packed_floats = !swap && scale == 1.0f;
+    for (int c = 0; c < components; c++) {
+        packed_floats = packed_floats && props[c]->type == Type::Float32
+                     && props[c]->offset == props[0]->offset + 4 * c;
+    }
+    if (count == 0) return;
+    if (packed_floats && stride == 4 * components) {
+        std::memcpy(dst, base + props[0]->offset, count * stride);
+        return;
+    }
+
+    parallel_for(count, threads, [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const char* item = base + i * stride;
+            float* out = dst + i * components;
+            if (packed_floats) {
+                std::memcpy(out, item + props[0]->offset, 4 * components);
+                continue;
+            }
+            for (int c = 0; c < components; c++)
+                out[c] = float(read_scalar(item + props[c]->offset, props[c]->type, swap)) * scale;
+        }
+    });
+}
+
+} // namespace ply_detail
+
+// Returns nullptr (after printing an error) if the file can't be read.
+inline shared_ptr<TriangleMesh> load_ply(const std::string& filename, shared_ptr<Material> material,
+                                         const PlyLoadOptions& options = PlyLoadOptions(),
+                                         PlyLoadStats* stats_out = nullptr) {
+    using namespace ply_detail;
+    auto start = std::chrono::steady_clock::now();
+
+    MappedFile file(filename);
+    if (!file.ok()) {
+        std::cerr << "ERROR: Could not load PLY file '" << filename << "'.\n";
+        return nullptr;
+    }
+
+    Header header;
+    std::string error;
+    if (!parse_header(file.data(), file.size(), header, error)) {
+        std::cerr << "ERROR: Could not load PLY file '" << filename << "': " << error << ".\n";
+        return nullptr;
+    }
+
+    unsigned threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+    threads = std::max(1u, threads);
+    const bool swap = header.swap;
+    const char* p = file.data() + header.data_offset;
+    const char* end = file.data() + file.size();
+
+    auto mesh = make_scene_shared<TriangleMesh>();
+    mesh->materials.push_back(material_id(material));
+
+    static const char* const x_names[] = { "x", nullptr };
+    static const char* const y_names[] = { "y", nullptr };
+    static const char* const z_names[] = { "z", nullptr };
+    static const char* const nx_names[] = { "nx", nullptr };
+    static const char* const ny_names[] = { "ny", nullptr };
+    static const char* const nz_names[] = { "nz", nullptr };
+    static const char* const u_names[] = { "u", "s", "texture_u", "texture_s", nullptr };
+    static const char* const v_names[] = { "v", "t", "texture_v", "texture_t", nullptr };
+    static const char* const r_names[] = { "red", "r", nullptr };
+    static const char* const g_names[] = { "green", "g", nullptr };
+    static const char* const b_names[] = { "blue", "b", nullptr };
+
+    for (const auto& element : header.elements) {
+        if (element.name == "vertex" && element.stride > 0) {
+            size_t n = element.count;
+            // divided, not n * stride: a huge count in the header would wrap
+            if (n > size_t(end - p) / element.stride) { error = "vertex data is truncated"; break; }
+
+            const Property* position[3] = { element.find(x_names), element.find(y_names),
+                                            element.find(z_names) };
+            if (!position[0] || !position[1] || !position[2]) { error = "vertices have no x/y/z"; break; }
+            mesh->positions.resize(n);
+            extract(reinterpret_cast<float*>(mesh->positions.data()), 3, p, n, element.stride, position, swap, 1.0f, threads);
+
+            const Property* normal[3] = { element.find(nx_names), element.find(ny_names),
+                                          element.find(nz_names) };
+            if (normal[0] && normal[1] && normal[2]) {
+                mesh->normals.resize(n);
+                extract(reinterpret_cast<float*>(mesh->normals.data()), 3, p, n, element.stride, normal, swap, 1.0f, threads);
+            }
+
+            const Property* uv[2] = { element.find(u_names), element.find(v_names) };
+            if (uv[0] && uv[1]) {
+                mesh->uvs.resize(n);
+                extract(reinterpret_cast<float*>(mesh->uvs.data()), 2, p, n, element.stride, uv, swap, 1.0f, threads);
+            }
+
+            const Property* color[3] = { element.find(r_names), element.find(g_names),
+                                         element.find(b_names) };
+            if (color[0] && color[1] && color[2]) {
+                // 8-bit colors are normalized to [0, 1]
+                float scale = (color[0]->type == Type::UInt8) ? 1.0f / 255 : 1.0f;
+                mesh->colors.resize(n);
+                extract(reinterpret_cast<float*>(mesh->colors.data()), 3, p, n, element.stride, color, swap, scale, threads);
+            }
+            p += n * element.stride;
+        } else if (element.name == "face") {
+            const Property* indices = nullptr;
+            size_t before = 0; // bytes of scalar properties ahead of the list
+            for (const auto& prop : element.properties) {
+                if (prop.is_list && (prop.name == "vertex_indices" || prop.name == "vertex_index")) {
+                    indices = &prop;
+                    break;
+                }
+                if (prop.is_list) break;
+                before += type_size(prop.type);
+            }
+            if (!indices) { error = "faces have no vertex_indices list"; break; }
+            bool only_indices = (element.properties.size() == 1);
+            int count_size = type_size(indices->count_type);
+            int index_size = type_size(indices->type);
+
+            // pass 1: walk the variable-sized records, counting triangles and
+            // remembering where each block of faces starts so pass 2 can run
+            // in parallel
+            const size_t block = 65536;
+            std::vector<const char*> block_start;
+            std::vector<size_t> block_triangle;
+            size_t triangles = 0;
+            const char* q = p;
+            bool truncated = false;
+            for (size_t f = 0; f < element.count; f++) {
+                if (f % block == 0) { block_start.push_back(q); block_triangle.push_back(triangles); }
+                if (size_t(end - q) < before + count_size) { truncated = true; break; }
+                uint32_t n = read_index(q + before, indices->count_type, swap);
+                if (n >= 3) triangles += n - 2;
+                size_t size = only_indices ? count_size + size_t(n) * index_size : item_size(element, q, end, swap);
+                if (size == 0 || size > size_t(end - q)) { truncated = true; break; }
+                q += size;
+            }
+            if (truncated) { error = "face data is truncated"; break; }
+
+            mesh->indices.resize(3 * triangles);
+            size_t vertex_count = mesh->positions.size();
+            uint32_t* out = mesh->indices.data();
+            const Element* faces = &element;
+            parallel_for(block_start.size(), threads, [=, &block_start, &block_triangle](size_t b0, size_t b1) {
+                for (size_t b = b0; b < b1; b++) {
+                    const char* r = block_start[b];
+                    uint32_t* dst = out + 3 * block_triangle[b];
+                    size_t last = std::min(faces->count, (b + 1) * block);
+                    for (size_t f = b * block; f < last; f++) {
+                        const char* list = r + before;
+                        uint32_t n = read_index(list, indices->count_type, swap);
+                        const char* item = list + count_size;
+                        auto index = [&](uint32_t k) {
+                            uint32_t i = read_index(item + size_t(k) * index_size, indices->type, swap);
+                            return (i < vertex_count) ? i : 0u; // out of range: degenerate face
+                        };
+                        // fan triangulation
+                        for (uint32_t k = 2; k < n; k++) {
+                            dst[0] = index(0);
+                            dst[1] = index(k - 1);
+                            dst[2] = index(k);
+                            dst += 3;
+                        }
+                        // pass 1 checked these fit
+                        r += only_indices ? count_size + size_t(n) * index_size : item_size(*faces, r, end, swap);
+                    }
+                }
+            });
+            p = q;
+        } else {
+            // skip elements we don't use
+            bool truncated = false;
+            if (element.stride > 0) {
+                truncated = element.count > size_t(end - p) / element.stride;
+                if (!truncated) p += element.count * element.stride;
+            } else if (!element.properties.empty()) {
+                for (size_t i = 0; i < element.count && !truncated; i++) {
+                    size_t size = item_size(element, p, end, swap);
+                    truncated = (size == 0);
+                    p += size;
+                }
+            }
+            if (truncated) { error = "element '" + element.name + "' is truncated"; break; }
+        }
+    }
+
+    if (!error.empty()) {
+        std::cerr << "ERROR: Could not load PLY file '" << filename << "': " << error << ".\n";
+        return nullptr;
+    }
+
+    PlyLoadStats stats;
+    stats.bytes = file.size();
+    stats.vertices = mesh->positions.size();
+    stats.faces = mesh->face_count();
+    auto parsed = std::chrono::steady_clock::now();
+    stats.parse_seconds = std::chrono::duration<double>(parsed - start).count();
+
+    if (options.build) {
+        mesh->build(options.bvh);
+        stats.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - parsed).count();
+        stats.built = true;
+    }
+
+    if (options.report) stats.print(std::clog);
+    if (stats_out) *stats_out = stats;
+    return mesh;
+}
+
+#endif
@@ -0,0 +1,487 @@
+#ifndef PRIMITIVE_POOL_H
+#define PRIMITIVE_POOL_H
+
+#include "hittable.h"
+#include "mesh.h"
+#include "sphere.h"
+#include "simd.h"
+
+// Pools of one primitive type stored as structure-of-arrays floats, for
+// scenes with many small spheres or quads (particles, boxes2, bouncing
+// spheres). A pool is one Hittable with its own BVH over primitive indices;
+// the primitives are kept in leaf order, so a leaf is a contiguous run and
+// SIMD_WIDTH of them are tested at once.
+//
+// The float lanes only cull, with generous margins. Lanes that survive are
+// hit in double from the stored floats, the same math as Sphere / Quad, so
+// the huge ground spheres still get accurate hit points.
+//
+// Usage: add(...) every primitive, then build() before rendering.
+// Pools don't act as lights (no pdf_value / random).
+
+class PrimitivePool : public Hittable {
+    public:
+        size_t size() const { return prim_materials.size(); }
+
+        // leaves of two SIMD groups; most rays stop at the first
+        static BVHBuildOptions default_build_options() {
+            BVHBuildOptions options;
+            options.spatial_splits = false;
+            options.max_leaf_size = 2 * SIMD_WIDTH;
+            return options;
+        }
+
+        AABB bounding_box() const override { return bbox; }
+        double surface_area() const override { return area; }
+
+    protected:
+        struct NodeBox { float lo[3], hi[3]; };
+
+        std::vector<MeshBVHNode> nodes;  // leaves: primitives [offset, offset + count)
+        std::vector<NodeBox> close_boxes; // node bounds at shutter close; empty if nothing moves
+        std::vector<uint32_t> prim_materials; // MaterialTable ids
+        AABB bbox;
+        double area = 0;
+
+        // Builds the BVH over the primitive boxes and returns the leaf order;
+        // the pool then permutes its arrays to it.
+        std::vector<int> build_nodes(const std::vector<AABB>& boxes, const BVHBuildOptions& options) {
+            BVHBuildOptions object_splits = options;
+            object_splits.spatial_splits = false; // every primitive must be in exactly one leaf
+            std::vector<BVHFlatNode> flat;
+            std::vector<int> order;
+            BVHBuilder(boxes, object_splits).build(flat, order);
+
+            nodes.resize(flat.size());
+            for (size_t i = 0; i < flat.size(); i++) {
+                const AABB& b = flat[i].bbox;
+                for (int a = 0; a < 3; a++) {
+                    nodes[i].lo[a] = float_below(b.axis_interval(a).min);
+                    nodes[i].hi[a] = float_above(b.axis_interval(a).max);
+                }
+                nodes[i].offset = flat[i].offset;
+                nodes[i].count = uint16_t(flat[i].count);
+                nodes[i].axis = uint16_t(flat[i].axis);
+            }
+            bbox = flat.empty() ? AABB::empty : flat[0].bbox;
+            permute(prim_materials, order);
+            return order;
+        }
+
+        // For moving primitives, after build_nodes: node bounds become the
+        // primitives' boxes at shutter open (open[i], unpermuted order) and
+        // close_boxes the ones at close, so a ray can test the box at its
+        // own time (as MotionBVH does). Motion is linear, so blending a
+        // node's two boxes bounds everything under it.
+        void set_motion_boxes(const std::vector<AABB>& open, const std::vector<AABB>& close,
+                              const std::vector<int>& order) {
+            std::vector<AABB> b0(nodes.size(), AABB::empty), b1(nodes.size(), AABB::empty);
+            // children always follow their parent, so a reverse sweep is bottom-up
+            for (int index = int(nodes.size()) - 1; index >= 0; index--) {
+                const MeshBVHNode& node = nodes[index];
+                if (node.count > 0) {
+                    for (int k = node.offset; k < node.offset + node.count; k++) {
+                        b0[index] = AABB(b0[index], open[size_t(order[k])]);
+                        b1[index] = AABB(b1[index], close[size_t(order[k])]);
+                    }
+                } else {
+                    b0[index] = AABB(b0[index + 1], b0[node.offset]);
+                    b1[index] = AABB(b1[index + 1], b1[node.offset]);
+                }
+            }
+            close_boxes.resize(nodes.size());
+            for (size_t i = 0; i < nodes.size(); i++) {
+                for (int a = 0; a < 3; a++) {
+                    nodes[i].lo[a] = float_below(b0[i].axis_interval(a).min);
+                    nodes[i].hi[a] = float_above(b0[i].axis_interval(a).max);
+                    close_boxes[i].lo[a] = float_below(b1[i].axis_interval(a).min);
+                    close_boxes[i].hi[a] = float_above(b1[i].axis_interval(a).max);
+                }
+            }
+            if (!nodes.empty()) bbox = AABB(b0[0], b1[0]);
+        }
+
+        // v = v[order], then padded so a full SIMD load at the last
+        // primitive stays inside the array
+        template <typename T>
+        static void permute(std::vector<T>& v, const std::vector<int>& order) {
+            if (v.empty()) return;
+            std::vector<T> result;
+            result.reserve(order.size() + SIMD_WIDTH);
+            for (int i : order) result.push_back(v[size_t(i)]);
+            result.resize(order.size() + SIMD_WIDTH - 1, T());
+            v.swap(result);
+        }
+};
+
+class SpherePool : public PrimitivePool {
+    public:
+        void add(const point4& center, double radius, shared_ptr<Material> mat) {
+            add(center, center, radius, mat);
+        }
+
+        // moving sphere, center1 at time 0 and center2 at time 1
+        void add(const point4& center1, const point4& center2, double radius,
+                 shared_ptr<Material> mat) {
+            vec4 motion = center2 - center1;
+            if (motion.norm2() > 0 && mx.empty()) {
+                mx.assign(cx.size(), 0.0f);
+                my.assign(cx.size(), 0.0f);
+                mz.assign(cx.size(), 0.0f);
+            }
+            cx.push_back(float(center1.x()));
+            cy.push_back(float(center1.y()));
+            cz.push_back(float(center1.z()));
+            r.push_back(float(std::fmax(0, radius)));
+            if (!mx.empty()) {
+                mx.push_back(float(motion.x()));
+                my.push_back(float(motion.y()));
+                mz.push_back(float(motion.z()));
+            }
+            prim_materials.push_back(material_id(mat));
+        }
+
+        void build(const BVHBuildOptions& options = default_build_options()) {
+            size_t n = size();
+            std::vector<AABB> open(n), close(n), boxes(n);
+            area = 0;
+            for (size_t i = 0; i < n; i++) {
+                bounds(i, 0, 1, open[i], close[i]);
+                // moving: the topology follows where spheres are mid-shutter
+                boxes[i] = mx.empty() ? open[i] : lerp(open[i], close[i], 0.5);
+                area += 4 * pi * double(r[i]) * r[i];
+            }
+            auto order = build_nodes(boxes, options);
+            close_boxes.clear();
+            if (!mx.empty()) set_motion_boxes(open, close, order);
+            for (auto* v : { &cx, &cy, &cz, &r, &mx, &my, &mz }) permute(*v, order);
+        }
+
+        bool hit(const Ray& ray, Interval ray_t, Hit& rec) const override {
+            const float ox = float(ray.o().x()), oy = float(ray.o().y()), oz = float(ray.o().z());
+            const vfloat dx(float(ray.d().x())), dy(float(ray.d().y())), dz(float(ray.d().z()));
+            const vfloat a = dx * dx + dy * dy + dz * dz;
+            const vfloat time(float(ray.time()));
+            const vfloat zero(0.0f), margin(1e-4f);
+
+            size_t hit_index = 0;
+            auto leaf = [&](const MeshBVHNode& node, Interval& t) {
+                bool found = false;
+                for (int first = node.offset; first < node.offset + node.count; first += SIMD_WIDTH) {
+                    int lanes = std::min(node.offset + node.count - first, SIMD_WIDTH);
+                    vfloat ocx = vfloat::load(&cx[first]) - vfloat(ox);
+                    vfloat ocy = vfloat::load(&cy[first]) - vfloat(oy);
+                    vfloat ocz = vfloat::load(&cz[first]) - vfloat(oz);
+                    if (!mx.empty()) {
+                        ocx = ocx + time * vfloat::load(&mx[first]);
+                        ocy = ocy + time * vfloat::load(&my[first]);
+                        ocz = ocz + time * vfloat::load(&mz[first]);
+                    }
+                    vfloat radius = vfloat::load(&r[first]);
+                    vfloat h = dx * ocx + dy * ocy + dz * ocz;
+                    vfloat oc2 = ocx * ocx + ocy * ocy + ocz * ocz;
+                    vfloat r2 = radius * radius;
+                    vfloat discriminant = h * h - a * (oc2 - r2);
+
+                    // cull with room for float error; the double test decides
+                    vfloat tolerance = margin * (h * h + a * (oc2 + r2));
+                    vbool keep = discriminant >= -tolerance;
+                    vfloat sqrtd = sqrt(max(discriminant, zero));
+                    vfloat slack = sqrt(tolerance) + margin * abs(h);
+                    keep = keep & (h - sqrtd - slack <= a * vfloat(float(t.max)))
+                                & (h + sqrtd + slack >= a * vfloat(float(t.min)));
+
+                    int candidates = keep.bits() & ((1 << lanes) - 1);
+                    for (int lane = 0; candidates; lane++, candidates >>= 1) {
+                        if (!(candidates & 1)) continue;
+                        double root;
+                        if (!hit_sphere(size_t(first + lane), ray, t, root)) continue;
+                        t.max = root;
+                        hit_index = size_t(first + lane);
+                        found = true;
+                    }
+                }
+                return found;
+            };
+            bool found;
+            if (close_boxes.empty()) {
+                found = traverse_float_bvh(nodes, ray.o(), ray.d(), ray_t, leaf);
+            } else {
+                // node boxes blended to the ray's time
+                double tau = Interval(0, 1).clamp(ray.time());
+                const point4& o = ray.o();
+                double inv_d[3] = { 1.0 / ray.d().x(), 1.0 / ray.d().y(), 1.0 / ray.d().z() };
+                auto node_hit = [&](int index, Interval& t) {
+                    const MeshBVHNode& b0 = nodes[index];
+                    const NodeBox& b1 = close_boxes[index];
+                    double lo[3], hi[3];
+                    for (int k = 0; k < 3; k++) {
+                        lo[k] = b0.lo[k] + tau * (double(b1.lo[k]) - b0.lo[k]);
+                        hi[k] = b0.hi[k] + tau * (double(b1.hi[k]) - b0.hi[k]);
+                    }
+                    return slab_hit(lo, hi, o, inv_d, t);
+                };
+                found = walk_float_bvh(nodes, ray.d(), ray_t, node_hit, leaf);
+            }
+            if (!found) return false;
+
+            rec.t = ray_t.max;
+            rec.prim_id = uint32_t(hit_index);
+            rec.object = this;
+            return true;
+        }
+
+        void surface(const Ray& ray, Hit& rec) const override {
+            size_t i = rec.prim_id;
+            rec.p = ray.at(rec.t);
+            vec4 normal_out = (rec.p - center(i, ray.time())) / double(r[i]);
+            rec.mat_id = prim_materials[i];
+            rec.set_face_normal(ray, normal_out);
+            // same mapping as Sphere
+            rec.u = (std::atan2(-normal_out.z(), normal_out.x()) + pi) / (2 * pi);
+            rec.v = std::acos(-normal_out.y()) / pi;
+            sphere_uv_derivatives(normal_out, r[i], rec.dpdu, rec.dpdv);
+        }
+
+        AABB transformed_bounds(const Mat34& m) const override {
+            AABB box = AABB::empty;
+            for (size_t i = 0; i < size(); i++) {
+                vec4 extent;
+                for (int k = 0; k < 3; k++)
+                    extent[k] = r[i] * vec4(m.m[k][0], m.m[k][1], m.m[k][2]).norm();
+                point4 c0 = m.point(center(i, 0)), c1 = m.point(center(i, 1));
+                box = AABB(box, AABB(AABB(c0 - extent, c0 + extent), AABB(c1 - extent, c1 + extent)));
+            }
+            return box;
+        }
+
+        void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const override {
+            b0 = b1 = AABB::empty;
+            for (size_t i = 0; i < size(); i++) {
+                AABB c0, c1;
+                bounds(i, t0, t1, c0, c1);
+                b0 = AABB(b0, c0);
+                b1 = AABB(b1, c1);
+            }
+        }
+
+        size_t memory_bytes() const {
+            return (cx.capacity() + cy.capacity() + cz.capacity() + r.capacity()
+                    + mx.capacity() + my.capacity() + mz.capacity()) * sizeof(float)
+                 + prim_materials.capacity() * sizeof(uint32_t)
+                 + nodes.capacity() * sizeof(MeshBVHNode) + close_boxes.capacity() * sizeof(NodeBox);
+        }
+
+    private:
+        std::vector<float> cx, cy, cz, r;
+        std::vector<float> mx, my, mz; // center motion over the shutter; empty if nothing moves
+
+        point4 center(size_t i, double time) const {
+            point4 c(cx[i], cy[i], cz[i]);
+            if (!mx.empty()) c += time * vec4(mx[i], my[i], mz[i]);
+            return c;
+        }
+
+        void bounds(size_t i, double t0, double t1, AABB& b0, AABB& b1) const {
+            vec4 rvec(r[i], r[i], r[i]);
+            b0 = AABB(center(i, t0) - rvec, center(i, t0) + rvec);
+            b1 = AABB(center(i, t1) - rvec, center(i, t1) + rvec);
+        }
+
+        // Sphere::hit in double
+        bool hit_sphere(size_t i, const Ray& ray, Interval ray_t, double& root) const {
+            vec4 oc = center(i, ray.time()) - ray.o();
+            double radius = r[i];
+            auto a = ray.d().norm2();
+            auto h = dot(ray.d(), oc);
+            auto c = oc.norm2() - radius * radius;
+            auto discriminant = h * h - a * c;
+            if (discriminant < 0) return false;
+
+            auto sqrtd = std::sqrt(discriminant);
+            root = (h - sqrtd) / a;
+            if (!ray_t.surrounds(root)) {
+                root = (h + sqrtd) / a;
+                if (!ray_t.surrounds(root)) return false;
+            }
+            return true;
+        }
+};
+
+// Shapes of a planar pool: points Q + a*u + b*v of the plane are inside when
+// (a, b) passes the shape's test, with `margin` of slack for the float cull.
+struct QuadShape {
+    static bool inside(double a, double b) { return a >= 0 && a <= 1 && b >= 0 && b <= 1; }
+    static vbool inside(vfloat a, vfloat b, vfloat margin) {
+        vfloat lo = -margin, hi = vfloat(1.0f) + margin;
+        return (a >= lo) & (a <= hi) & (b >= lo) & (b <= hi);
+    }
+    static double area(const vec4& u, const vec4& v) { return cross(u, v).norm(); }
+    static AABB bounds(const point4& Q, const vec4& u, const vec4& v) {
+        return AABB(AABB(Q, Q + u + v), AABB(Q + u, Q + v));
+    }
+};
+
+struct DiskShape {
+    static bool inside(double a, double b) { return std::sqrt(a*a + b*b) <= 1; }
+    static vbool inside(vfloat a, vfloat b, vfloat margin) {
+        vfloat hi = vfloat(1.0f) + margin;
+        return a * a + b * b <= hi * hi;
+    }
+    static double area(const vec4& u, const vec4& v) { return pi * cross(u, v).norm(); }
+    static AABB bounds(const point4& Q, const vec4& u, const vec4& v) {
+        vec4 extent(std::sqrt(u.x()*u.x() + v.x()*v.x()), std::sqrt(u.y()*u.y() + v.y()*v.y()),
+                    std::sqrt(u.z()*u.z() + v.z()*v.z()));
+        return AABB(Q - extent, Q + extent);
+    }
+};
+
+template <typename Shape>
+class PlanarPool : public PrimitivePool {
+    public:
+        void add(const point4& Q, const vec4& u, const vec4& v, shared_ptr<Material> mat) {
+            auto n = cross(u, v);
+            auto normal = unit_vector(n);
+            auto w = n / dot(n, n);
+            // alpha = w . (p x v) = p . (v x w), beta = w . (u x p) = p . (w x u)
+            auto alpha_axis = cross(v, w);
+            auto beta_axis = cross(w, u);
+            for (int k = 0; k < 3; k++) {
+                q[k].push_back(float(Q[k]));
+                nrm[k].push_back(float(normal[k]));
+                au[k].push_back(float(alpha_axis[k]));
+                bv[k].push_back(float(beta_axis[k]));
+            }
+            plane_d.push_back(float(dot(normal, Q)));
+            boxes.push_back(Shape::bounds(Q, u, v));
+            area += Shape::area(u, v);
+            prim_materials.push_back(material_id(mat));
+        }
+
+        void build(const BVHBuildOptions& options = default_build_options()) {
+            auto order = build_nodes(boxes, options);
+            for (int k = 0; k < 3; k++) {
+                permute(q[k], order);
+                permute(nrm[k], order);
+                permute(au[k], order);
+                permute(bv[k], order);
+            }
+            permute(plane_d, order);
+            std::vector<AABB>().swap(boxes);
+        }
+
+        bool hit(const Ray& ray, Interval ray_t, Hit& rec) const override {
+            float o[3], d[3];
+            for (int k = 0; k < 3; k++) {
+                o[k] = float(ray.o()[k]);
+                d[k] = float(ray.d()[k]);
+            }
+            const vfloat margin(1e-3f), min_denom(0.5e-8f);
+
+            size_t hit_index = 0;
+            double hit_alpha = 0, hit_beta = 0;
+            auto leaf = [&](const MeshBVHNode& node, Interval& t) {
+                bool found = false;
+                for (int first = node.offset; first < node.offset + node.count; first += SIMD_WIDTH) {
+                    int lanes = std::min(node.offset + node.count - first, SIMD_WIDTH);
+                    vfloat denom(0.0f), n_dot_o(0.0f), n_o_scale(0.0f);
+                    for (int k = 0; k < 3; k++) {
+                        vfloat n = vfloat::load(&nrm[k][first]);
+                        denom = denom + n * vfloat(d[k]);
+                        n_dot_o = n_dot_o + n * vfloat(o[k]);
+                        n_o_scale = n_o_scale + abs(n * vfloat(o[k]));
+                    }
+                    vfloat D = vfloat::load(&plane_d[first]);
+                    vfloat tp = (D - n_dot_o) / denom;
+                    vfloat slack = margin * (abs(tp) + (abs(D) + n_o_scale) / abs(denom));
+                    vbool keep = (abs(denom) >= min_denom)
+                               & (tp + slack >= vfloat(float(t.min)))
+                               & (tp - slack <= vfloat(float(t.max)));
+                    if (!(keep.bits() & ((1 << lanes) - 1))) continue;
+
+                    vfloat alpha(0.0f), beta(0.0f);
+                    for (int k = 0; k < 3; k++) {
+                        vfloat p = vfloat(o[k]) + tp * vfloat(d[k]) - vfloat::load(&q[k][first]);
+                        alpha = alpha + p * vfloat::load(&au[k][first]);
+                        beta = beta + p * vfloat::load(&bv[k][first]);
+                    }
+                    keep = keep & Shape::inside(alpha, beta, margin);
+
+                    int candidates = keep.bits() & ((1 << lanes) - 1);
+                    for (int lane = 0; candidates; lane++, candidates >>= 1) {
+                        if (!(candidates & 1)) continue;
+                        double root, a, b;
+                        if (!hit_plane(size_t(first + lane), ray, t, root, a, b)) continue;
+                        t.max = root;
+                        hit_index = size_t(first + lane);
+                        hit_alpha = a;
+                        hit_beta = b;
+                        found = true;
+                    }
+                }
+                return found;
+            };
+            if (!traverse_float_bvh(nodes, ray.o(), ray.d(), ray_t, leaf)) return false;
+
+            rec.t = ray_t.max;
+            rec.u = hit_alpha;
+            rec.v = hit_beta;
+            rec.prim_id = uint32_t(hit_index);
+            rec.object = this;
+            return true;
+        }
+
+        void surface(const Ray& ray, Hit& rec) const override {
+            rec.p = ray.at(rec.t);
+            rec.mat_id = prim_materials[rec.prim_id];
+            rec.set_face_normal(ray, normal(rec.prim_id));
+            edges(rec.prim_id, rec.dpdu, rec.dpdv);
+        }
+
+        size_t memory_bytes() const {
+            size_t floats = plane_d.capacity();
+            for (int k = 0; k < 3; k++)
+                floats += q[k].capacity() + nrm[k].capacity() + au[k].capacity() + bv[k].capacity();
+            return floats * sizeof(float) + prim_materials.capacity() * sizeof(uint32_t)
+                 + nodes.capacity() * sizeof(MeshBVHNode);
+        }
+
+    private:
+        std::vector<float> q[3];       // corner Q
+        std::vector<float> nrm[3];     // unit normal
+        std::vector<float> au[3], bv[3]; // alpha = (p - Q) . au, beta = (p - Q) . bv
+        std::vector<float> plane_d;    // normal . Q
+        std::vector<AABB> boxes;       // until build()
+
+        vec4 normal(size_t i) const { return vec4(nrm[0][i], nrm[1][i], nrm[2][i]); }
+
+        // the u and v edges back from the alpha / beta axes (their duals in the plane)
+        void edges(size_t i, vec4& u, vec4& v) const {
+            vec4 n = normal(i);
+            vec4 a(au[0][i], au[1][i], au[2][i]), b(bv[0][i], bv[1][i], bv[2][i]);
+            u = cross(b, n);
+            u /= dot(a, u);
+            v = cross(n, a);
+            v /= dot(b, v);
+        }
+
+        // Quad::hit in double
+        bool hit_plane(size_t i, const Ray& ray, Interval ray_t, double& t,
+                       double& alpha, double& beta) const {
+            vec4 n = normal(i);
+            auto denom = dot(n, ray.d());
+            if (std::fabs(denom) < 1e-8) return false;
+            t = (plane_d[i] - dot(n, ray.o())) / denom;
+            if (!ray_t.contains(t)) return false;
+
+            vec4 p = ray.at(t) - point4(q[0][i], q[1][i], q[2][i]);
+            alpha = dot(p, vec4(au[0][i], au[1][i], au[2][i]));
+            beta = dot(p, vec4(bv[0][i], bv[1][i], bv[2][i]));
+            return Shape::inside(alpha, beta);
+        }
+};
+
+typedef PlanarPool<QuadShape> QuadPool;
+typedef PlanarPool<DiskShape> DiskPool;
+
+#endif
@@ -2,12 +2,13 @@
 #define QUAD_H
 
 #include "hittable.h"
+#include "box.h"
 
 // Technically, creates parallelograms and not general quads
-class Quad : public Hittable {
+class Quad final : public Hittable {
   public:
     Quad(const point4& Q, const vec4& u, const vec4& v, shared_ptr<Material> mat)
-      : Q(Q), u(u), v(v), mat(mat)
+      : Q(Q), u(u), v(v), mat_id(material_id(mat))
     {
         auto n = cross(u,v);
         normal = unit_vector(n); // normal of plane (quad)
@@ -28,13 +29,25 @@ class Quad : public Hittable {
 
     AABB bounding_box() const override { return bbox; }
 
+    AABB transformed_bounds(const Mat34& m) const override {
+        point4 q = m.point(Q);
+        vec4 mu = m.vector(u), mv = m.vector(v);
+        return AABB(AABB(q, q + mu + mv), AABB(q + mu, q + mv));
+    }
+    double surface_area() const override { return area; }
+    uint32_t light_material() const override { return mat_id; }
+    vec4 normal_bounds(double& cos_theta) const override {
+        cos_theta = 1; // flat
+        return normal;
+    }
+
     double pdf_value(const point4& origin, const vec4& dir) const override {
         Hit rec;
         if (!this->hit(Ray(origin, dir), Interval(0.001, infinity), rec)) {
             return 0.0; // no intersection
         }
         auto distance_squared = rec.t * rec.t * dir.norm2();
-        auto cosine = std::fabs(dot(dir, rec.normal) / dir.norm());
+        auto cosine = std::fabs(dot(dir, normal) / dir.norm());
 
         return distance_squared / (cosine * area);
     }
@@ -61,15 +74,20 @@ class Quad : public Hittable {
 
         if (!is_interior(alpha, beta, rec)) { return false; }
         
-        // fill out rec if valid intersection
+        // u, v are set; the rest waits for surface()
         rec.t = t;
-        rec.p = intersection;
-        rec.mat = mat;
-        rec.set_face_normal(r, normal);
-
+        rec.object = this;
         return true;
     }
 
+    void surface(const Ray& r, Hit& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.mat_id = mat_id;
+        rec.set_face_normal(r, normal);
+        rec.dpdu = u; // u, v are the coordinates along the edges
+        rec.dpdv = v;
+    }
+
     virtual bool is_interior(double a, double b, Hit& rec) const {
         // hit point is interior to primitive's region of plane
         Interval unit_interval = Interval(0, 1);
@@ -86,7 +104,7 @@ class Quad : public Hittable {
     point4 Q;
     vec4 u, v;
     vec4 w;
-    shared_ptr<Material> mat;
+    uint32_t mat_id;
     AABB bbox;
     vec4 normal;
     double D;
@@ -96,24 +114,8 @@ class Quad : public Hittable {
 inline shared_ptr<Hittable> box(const point4& a, const point4& b, shared_ptr<Material> mat)
 {
     // Returns the 3D box (six sides) that contains the two opposite vertices a & b.
-    auto sides = make_shared<HittableList>();
-
-    // Construct the two opposite vertices with the minimum and maximum coordinates.
-    auto min = point4(std::fmin(a.x(),b.x()), std::fmin(a.y(),b.y()), std::fmin(a.z(),b.z()));
-    auto max = point4(std::fmax(a.x(),b.x()), std::fmax(a.y(),b.y()), std::fmax(a.z(),b.z()));
-
-    auto dx = vec4(max.x() - min.x(), 0, 0);
-    auto dy = vec4(0, max.y() - min.y(), 0);
-    auto dz = vec4(0, 0, max.z() - min.z());
-
-    sides->add(make_shared<Quad>(point4(min.x(), min.y(), max.z()),  dx,  dy, mat)); // front
-    sides->add(make_shared<Quad>(point4(max.x(), min.y(), max.z()), -dz,  dy, mat)); // right
-    sides->add(make_shared<Quad>(point4(max.x(), min.y(), min.z()), -dx,  dy, mat)); // back
-    sides->add(make_shared<Quad>(point4(min.x(), min.y(), min.z()),  dz,  dy, mat)); // left
-    sides->add(make_shared<Quad>(point4(min.x(), max.y(), max.z()),  dx, -dz, mat)); // top
-    sides->add(make_shared<Quad>(point4(min.x(), min.y(), min.z()),  dx,  dz, mat)); // bottom
-
-    return sides;
+    // One slab-tested primitive rather than a list of six quads.
+    return make_scene_shared<Box>(a, b, mat);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,369 @@
+#ifndef QUANTIZED_MESH_H
+#define QUANTIZED_MESH_H
+
+#include "mesh.h"
+#include <cstring>
+
+// Compressed counterpart of TriangleMesh for meshes that don't fit in memory
+// as floats.
+//
+//   positions   fixed point on a grid over the mesh bounds, 21 bits per axis
+//               packed in 8 bytes (or 16 bits per axis in 6 bytes)
+//   normals     octahedral encoding, 2 x 16-bit snorm
+//   uvs         2 half floats
+//
+// Leaves don't copy their triangles; the kernel decodes the vertices of a
+// leaf into a TrianglePacket and runs the same watertight test. Every vertex
+// decodes to the same floats wherever it is used, so the mesh stays
+// watertight. Vertex colors are not kept.
+
+inline uint16_t float_to_half(float value) {
+    uint32_t f;
+    std::memcpy(&f, &value, 4);
+    uint32_t sign = (f >> 16) & 0x8000;
+    uint32_t raw_exponent = (f >> 23) & 0xff;
+    int exponent = int(raw_exponent) - 127 + 15;
+    uint32_t mantissa = f & 0x7fffff;
+
+    if (raw_exponent == 0xff) return uint16_t(sign | 0x7c00 | (mantissa ? 0x200 : 0)); // inf, nan
+    if (exponent >= 31) return uint16_t(sign | 0x7c00);                               // overflow
+    if (exponent <= 0) {                                                               // subnormal
+        if (exponent < -10) return uint16_t(sign);
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return uint16_t(sign | half);
+    }
+    // round to nearest even; a carry correctly bumps the exponent
+    uint32_t half = sign | (uint32_t(exponent) << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return uint16_t(half);
+}
+
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t f;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            f = sign;
+        } else {
+            // subnormal: shift into a normal float
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400)) { mantissa <<= 1; exponent--; }
+            f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    } else if (exponent == 31) {
+        f = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+    float value;
+    std::memcpy(&value, &f, 4);
+    return value;
+}
+
+inline uint32_t oct_encode(const vec3f& n) {
+    // project onto the octahedron |x| + |y| + |z| = 1 and fold the lower half
+    float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+    if (l1 == 0) return 0;
+    float x = n.x / l1, y = n.y / l1;
+    if (n.z < 0) {
+        float fx = (1 - std::fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+        float fy = (1 - std::fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+    }
+    auto snorm = [](float v) {
+        v = std::max(-1.0f, std::min(1.0f, v));
+        return uint32_t(uint16_t(int16_t(std::lround(v * 32767))));
+    };
+    return snorm(x) | (snorm(y) << 16);
+}
+
+inline vec3f oct_decode(uint32_t e) {
+    float x = std::max(float(int16_t(e & 0xffff)) / 32767, -1.0f);
+    float y = std::max(float(int16_t(e >> 16)) / 32767, -1.0f);
+    float z = 1 - std::fabs(x) - std::fabs(y);
+    if (z < 0) {
+        float fx = (1 - std::fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+        float fy = (1 - std::fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+    }
+    float length = std::sqrt(x*x + y*y + z*z);
+    return {x / length, y / length, z / length};
+}
+
+class QuantizedMesh : public Hittable {
+    public:
+        // position_bits: 16 (6 bytes per position) or up to 21 (8 bytes)
+        QuantizedMesh(const TriangleMesh& source, int position_bits = 21,
+                      const BVHBuildOptions& options = default_build_options())
+          : indices(source.indices), normal_indices(source.normal_indices),
+            uv_indices(source.uv_indices), face_materials(source.face_materials),
+            materials(source.materials)
+        {
+            bits = std::max(8, std::min(21, position_bits));
+            quantize_positions(source.positions);
+            normals.reserve(source.normals.size());
+            for (const auto& n : source.normals) normals.push_back(oct_encode(n));
+            uvs.reserve(source.uvs.size());
+            for (const auto& t : source.uvs)
+                uvs.push_back(uint32_t(float_to_half(t.u)) | (uint32_t(float_to_half(t.v)) << 16));
+            drop_redundant_indices();
+            build(options);
+        }
+
+        // two packets per leaf: nodes are the biggest cost left after compression
+        static BVHBuildOptions default_build_options() {
+            BVHBuildOptions options;
+            options.max_leaf_size = 2 * SIMD_WIDTH;
+            return options;
+        }
+
+        size_t face_count() const { return indices.size() / 3; }
+        size_t vertex_count() const { return (bits > 16) ? packed.size() : packed16.size() / 3; }
+
+        bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
+            uint32_t hit_face = 0;
+            double hit_b1 = 0, hit_b2 = 0;
+            auto leaf = [&](const MeshBVHNode& node, const PacketRay& pr, Interval& t) {
+                bool found = false;
+                for (int first = 0; first < node.count; first += SIMD_WIDTH) {
+                    int lanes = std::min(int(node.count) - first, SIMD_WIDTH);
+                    TrianglePacket packet;
+                    decode_packet(uint32_t(node.offset + first), lanes, packet);
+                    if (intersect_packet(packet, lanes, pr, t, hit_face, hit_b1, hit_b2))
+                        found = true;
+                }
+                return found;
+            };
+            if (!traverse_mesh_bvh(nodes, r, ray_t, leaf)) return false;
+            rec.t = ray_t.max;
+            rec.u = hit_b1;
+            rec.v = hit_b2;
+            rec.prim_id = hit_face;
+            rec.object = this;
+            return true;
+        }
+
+        void surface(const Ray& r, Hit& rec) const override {
+            fill_hit(r, rec.t, rec.prim_id, rec.u, rec.v, rec);
+        }
+
+        AABB bounding_box() const override { return bbox; }
+        double surface_area() const override { return area; }
+
+        size_t memory_bytes() const {
+            return packed.capacity() * sizeof(uint64_t) + packed16.capacity() * sizeof(uint16_t)
+                 + (normals.capacity() + uvs.capacity() + indices.capacity()
+                    + normal_indices.capacity() + uv_indices.capacity()
+                    + face_materials.capacity()) * sizeof(uint32_t)
+                 + nodes.capacity() * sizeof(MeshBVHNode);
+        }
+
+        // decoded position of vertex i
+        vec3f position(uint32_t i) const {
+            uint32_t q[3];
+            if (bits > 16) {
+                uint64_t word = packed[i];
+                q[0] = uint32_t(word) & 0x1fffff;
+                q[1] = uint32_t(word >> 21) & 0x1fffff;
+                q[2] = uint32_t(word >> 42) & 0x1fffff;
+            } else {
+                q[0] = packed16[3*i];
+                q[1] = packed16[3*i + 1];
+                q[2] = packed16[3*i + 2];
+            }
+            return {origin[0] + float(q[0]) * step[0], origin[1] + float(q[1]) * step[1],
+                    origin[2] + float(q[2]) * step[2]};
+        }
+
+    private:
+        int bits;
+        float origin[3], step[3];      // position = origin + q * step
+        std::vector<uint64_t> packed;  // bits > 16: 21 bits per axis
+        std::vector<uint16_t> packed16; // bits <= 16: 3 per vertex
+        std::vector<uint32_t> normals; // octahedral
+        std::vector<uint32_t> uvs;     // half u | half v << 16
+        std::vector<uint32_t> indices, normal_indices, uv_indices, face_materials;
+        std::vector<uint32_t> materials;  // MaterialTable ids
+
+        std::vector<MeshBVHNode> nodes; // faces are stored in leaf order: [offset, offset + count)
+        AABB bbox;
+        double area = 0;
+
+        void quantize_positions(const std::vector<vec3f>& positions) {
+            float lo[3] = { 0, 0, 0 }, hi[3] = { 0, 0, 0 };
+            for (size_t i = 0; i < positions.size(); i++) {
+                for (int a = 0; a < 3; a++) {
+                    lo[a] = (i == 0) ? positions[i][a] : std::min(lo[a], positions[i][a]);
+                    hi[a] = (i == 0) ? positions[i][a] : std::max(hi[a], positions[i][a]);
+                }
+            }
+            double levels = double((1u << bits) - 1);
+            for (int a = 0; a < 3; a++) {
+                origin[a] = lo[a];
+                step[a] = float((double(hi[a]) - lo[a]) / levels);
+            }
+
+            if (bits > 16) packed.resize(positions.size());
+            else packed16.resize(3 * positions.size());
+            for (size_t i = 0; i < positions.size(); i++) {
+                uint32_t q[3];
+                for (int a = 0; a < 3; a++) {
+                    double x = (step[a] > 0) ? (positions[i][a] - origin[a]) / step[a] : 0.0;
+                    q[a] = uint32_t(std::max(0.0, std::min(levels, std::round(x))));
+                }
+                if (bits > 16) {
+                    packed[i] = uint64_t(q[0]) | (uint64_t(q[1]) << 21) | (uint64_t(q[2]) << 42);
+                } else {
+                    for (int a = 0; a < 3; a++) packed16[3*i + a] = uint16_t(q[a]);
+                }
+            }
+        }
+
+        void drop_redundant_indices() {
+            // attribute indices that repeat the position indices (all PLY
+            // files, most OBJ exports) and a single shared material cost
+            // as much as the whole compressed geometry
+            if (normal_indices == indices) std::vector<uint32_t>().swap(normal_indices);
+            if (uv_indices == indices) std::vector<uint32_t>().swap(uv_indices);
+            if (!face_materials.empty()
+                && std::all_of(face_materials.begin(), face_materials.end(),
+                               [this](uint32_t m) { return m == face_materials[0]; })) {
+                uint32_t m = face_materials[0];
+                uint32_t material = (m < materials.size()) ? materials[m] : 0;
+                materials.assign(1, material);
+                std::vector<uint32_t>().swap(face_materials);
+            }
+        }
+
+        void face_vertices(size_t f, vec4& p0, vec4& p1, vec4& p2) const {
+            p0 = to_vec4(position(indices[3*f]));
+            p1 = to_vec4(position(indices[3*f + 1]));
+            p2 = to_vec4(position(indices[3*f + 2]));
+        }
+
+        void decode_packet(uint32_t first_face, int lanes, TrianglePacket& packet) const {
+            for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+                bool used = lane < lanes;
+                uint32_t f = used ? first_face + lane : 0;
+                packet.face[lane] = f;
+                for (int i = 0; i < 3; i++) {
+                    vec3f p = used ? position(indices[3*f + i]) : vec3f{0, 0, 0};
+                    packet.v[i][0][lane] = p.x;
+                    packet.v[i][1][lane] = p.y;
+                    packet.v[i][2][lane] = p.z;
+                }
+            }
+        }
+
+        void build(const BVHBuildOptions& options) {
+            size_t n = face_count();
+            std::vector<AABB> boxes(n);
+            area = 0;
+            for (size_t f = 0; f < n; f++) {
+                vec4 p0, p1, p2;
+                face_vertices(f, p0, p1, p2);
+                boxes[f] = AABB(AABB(p0, p1), AABB(p2, p2));
+                area += 0.5 * cross(p1 - p0, p2 - p0).norm();
+            }
+
+            // spatial splits would need the clipped triangles; quantized
+            // meshes are big enough that plain object splits are the better
+            // trade for build time anyway
+            BVHBuildOptions object_splits = options;
+            object_splits.spatial_splits = false;
+
+            std::vector<BVHFlatNode> flat;
+            std::vector<int> refs;
+            BVHBuilder(boxes, object_splits).build(flat, refs);
+
+            // reorder the faces so every leaf is a contiguous range
+            reorder_faces(refs);
+
+            nodes.resize(flat.size());
+            for (size_t i = 0; i < flat.size(); i++) {
+                const AABB& b = flat[i].bbox;
+                for (int a = 0; a < 3; a++) {
+                    nodes[i].lo[a] = float_below(b.axis_interval(a).min);
+                    nodes[i].hi[a] = float_above(b.axis_interval(a).max);
+                }
+                nodes[i].offset = flat[i].offset;
+                nodes[i].count = uint16_t(flat[i].count);
+                nodes[i].axis = uint16_t(flat[i].axis);
+            }
+            bbox = flat.empty() ? AABB::empty : flat[0].bbox;
+        }
+
+        void reorder_faces(const std::vector<int>& order) {
+            auto permute = [&order](std::vector<uint32_t>& v, size_t per_face) {
+                if (v.empty()) return;
+                std::vector<uint32_t> result(v.size());
+                for (size_t i = 0; i < order.size(); i++)
+                    for (size_t k = 0; k < per_face; k++)
+                        result[per_face * i + k] = v[per_face * size_t(order[i]) + k];
+                v.swap(result);
+            };
+            permute(indices, 3);
+            permute(normal_indices, 3);
+            permute(uv_indices, 3);
+            permute(face_materials, 1);
+        }
+
+        void fill_hit(const Ray& r, double t, uint32_t f, double b1, double b2, Hit& rec) const {
+            double b0 = 1 - b1 - b2;
+            vec4 p0, p1, p2;
+            face_vertices(f, p0, p1, p2);
+
+            rec.t = t;
+            rec.p = r.at(t);
+            rec.set_face_normal(r, unit_vector(cross(p1 - p0, p2 - p0)));
+
+            // same fallbacks as TriangleMesh for missing normals and uvs
+            const std::vector<uint32_t>& ni = normal_indices.empty() ? indices : normal_indices;
+            if (!normals.empty() && ni[3*f] < normals.size() && ni[3*f + 1] < normals.size()
+                && ni[3*f + 2] < normals.size()) {
+                vec4 n = b0 * to_vec4(oct_decode(normals[ni[3*f]]))
+                       + b1 * to_vec4(oct_decode(normals[ni[3*f + 1]]))
+                       + b2 * to_vec4(oct_decode(normals[ni[3*f + 2]]));
+                if (n.norm2() > 0) {
+                    n = unit_vector(n);
+                    rec.normal = rec.front_face ? n : -n;
+                }
+            }
+
+            const std::vector<uint32_t>& ti = uv_indices.empty() ? indices : uv_indices;
+            if (!uvs.empty() && ti[3*f] < uvs.size() && ti[3*f + 1] < uvs.size()
+                && ti[3*f + 2] < uvs.size()) {
+                rec.u = rec.v = 0;
+                double w[3] = { b0, b1, b2 };
+                double corner_uv[3][2];
+                for (int i = 0; i < 3; i++) {
+                    uint32_t uv = uvs[ti[3*f + i]];
+                    corner_uv[i][0] = half_to_float(uint16_t(uv));
+                    corner_uv[i][1] = half_to_float(uint16_t(uv >> 16));
+                    rec.u += w[i] * corner_uv[i][0];
+                    rec.v += w[i] * corner_uv[i][1];
+                }
+                triangle_uv_derivatives(p0, p1, p2, corner_uv, rec.dpdu, rec.dpdv);
+            } else {
+                rec.u = b1;
+                rec.v = b2;
+                rec.dpdu = p1 - p0;
+                rec.dpdv = p2 - p0;
+            }
+
+            size_t m = face_materials.empty() ? 0 : face_materials[f];
+            rec.mat_id = (m < materials.size()) ? materials[m] : 0;
+        }
+};
+
+#endif
@@ -5,23 +5,38 @@
 
 class Ray {
   public:
-    Ray() {}
+    Ray() : t(0), shadow(false) {}
 
-    Ray(const point4& origin, const vec4& direction, double time) : orig(origin), dir(direction), t(time) {}
+    Ray(const point4& origin, const vec4& direction, real time, bool shadow = false)
+      : orig(origin), dir(direction), t(time), shadow(shadow) {}
     Ray(const point4& origin, const vec4& direction) : Ray(origin, direction, 0.0) {}
 
     const point4& o() const  { return orig; }
     const vec4& d() const { return dir; }
-    double time() const { return t; }
+    real time() const { return t; }
+    // Shadow rays test visibility only. Media they reach directly (through
+    // lists and BVHs) let them pass, and the camera weights the light by
+    // those media's transmittance() instead. Instances build a new ray, so
+    // media inside them still block at random as they would any other ray.
+    bool is_shadow() const { return shadow; }
 
-    point4 at(double t) const {
+    point4 at(real t) const {
         return orig + t*dir;
     }
 
   private:
     point4 orig;
     vec4 dir;
-    double t; // time 
+    real t; // time 
+    bool shadow;
+};
+
+// Rays through the neighbouring pixel samples (x: one column over, y: one
+// row down), carried next to a camera ray to tell how much of a texture one
+// sample covers where it lands.
+struct RayDifferential {
+    point4 rx_o, ry_o;
+    vec4 rx_d, ry_d;
 };
 
 #endif
\ No newline at end of file
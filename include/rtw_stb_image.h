@@ -78,6 +78,18 @@ class rtw_image {
         return bdata + y*bytes_per_scanline + x*bytes_per_pixel;
     }
 
+    const float* float_pixel_data(int x, int y) const {
+        // Same as pixel_data(), but the linear floats the image was loaded as. For HDR files
+        // these aren't limited to [0, 1]. If there is no image data, returns magenta.
+        static float magenta[] = { 1, 0, 1 };
+        if (fdata == nullptr) return magenta;
+
+        x = clamp(x, 0, image_width);
+        y = clamp(y, 0, image_height);
+
+        return fdata + y*bytes_per_scanline + x*bytes_per_pixel;
+    }
+
   private:
     const int      bytes_per_pixel = 3;
     float         *fdata = nullptr;         // Linear floating point pixel data
@@ -14,6 +14,16 @@
 using std::make_shared;
 using std::shared_ptr;
 
+// Geometry precision: vectors, rays, intervals, boxes and hit records use
+// `real`. Double by default; RTW_REAL_FLOAT (cmake -DRTW_FLOAT=ON) halves the
+// memory traffic of the geometry and BVH at the cost of precision on large
+// or far-from-origin scenes.
+#ifdef RTW_REAL_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
+
 // Constants
 
 const double infinity = std::numeric_limits<double>::infinity();
@@ -45,6 +55,7 @@ inline int gen_random_int(int min, int max) {
 }
 // Common Headers
 
+#include "arena.h"
 #include "color.h"
 #include "ray.h"
 #include "vec4.h"
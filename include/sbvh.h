@@ -0,0 +1,499 @@
+#ifndef SBVH_H
+#define SBVH_H
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include <algorithm>
+#include <functional>
+
+// Spatial-split BVH (Stich, Friedrich & Dietrich 2009).
+// Besides the usual object partitions (binned SAH), a node may be split by
+// an axis-aligned plane, clipping every reference that straddles it into a
+// left and a right piece. Big or skewed primitives (Cornell walls, the huge
+// ground/fog spheres, thin triangles) then stop inflating their siblings.
+// The price is that a primitive can be referenced from several leaves, so
+// the number of extra references is capped by a duplication budget.
+
+struct BVHBuildOptions {
+    bool spatial_splits = true;       // allow reference splitting at all
+    int max_leaf_size = 4;            // nodes with this many refs (or fewer) become leaves
+    int object_bins = 32;             // binned SAH candidates per axis for object splits
+    int spatial_bins = 32;            // bins per axis for spatial splits
+    double traversal_cost = 1.0;      // SAH cost of visiting an interior node
+    double intersection_cost = 1.0;   // SAH cost of one primitive test
+    double overlap_threshold = 1e-5;  // child overlap (relative to root area) needed to try a spatial split
+    double duplication_budget = 0.5;  // extra references allowed, as a fraction of the primitive count
+};
+
+// Flattened node; children of interior nodes are laid out depth-first, so the
+// left child always directly follows its parent.
+struct BVHFlatNode {
+    AABB bbox;
+    int offset; // leaf: first entry in the reference list, interior: right child
+    int count;  // number of references, 0 for interior nodes
+    int axis;   // split axis, used to visit the nearer child first
+};
+
+class BVHBuilder {
+    public:
+        // Clips a reference of primitive `prim` (currently bounded by `ref`)
+        // against the plane axis = pos. Returns false if the primitive must
+        // not be split (e.g. participating media), in which case the builder
+        // keeps the reference whole.
+        using Splitter = std::function<bool(int prim, int axis, double pos, const AABB& ref,
+                                            AABB& left, AABB& right)>;
+
+        BVHBuilder(const std::vector<AABB>& prim_boxes, const BVHBuildOptions& options,
+                   Splitter splitter = nullptr)
+          : prim_boxes(prim_boxes), options(options), splitter(splitter) {}
+
+        void build(std::vector<BVHFlatNode>& nodes, std::vector<int>& prim_indices) {
+            nodes.clear();
+            prim_indices.clear();
+            if (prim_boxes.empty()) return;
+
+            std::vector<Reference> refs;
+            refs.reserve(prim_boxes.size());
+            AABB bounds = AABB::empty;
+            for (size_t i = 0; i < prim_boxes.size(); i++) {
+                refs.push_back({prim_boxes[i], int(i)});
+                bounds = AABB(bounds, prim_boxes[i]);
+            }
+
+            root_area = bounds.surface_area();
+            ref_limit = size_t(prim_boxes.size() * (1.0 + options.duplication_budget));
+            ref_count = refs.size();
+            spatial_split_count = 0;
+
+            build_node(refs, bounds, 0, nodes, prim_indices);
+        }
+
+        int spatial_splits() const { return spatial_split_count; }
+
+    private:
+        struct Reference {
+            AABB bbox;
+            int prim;
+        };
+
+        struct Bin {
+            AABB bounds = AABB::empty;
+            int count = 0; // object bins: references, spatial bins: entering references
+            int exits = 0; // spatial bins only: references leaving through this bin
+        };
+
+        struct Split {
+            double cost = infinity;
+            int axis = -1;
+            double pos = 0;       // split plane (spatial splits)
+            int bin = 0;          // first right-hand centroid bin (object splits)
+            double bin_min = 0, bin_scale = 0;
+            bool spatial = false;
+            AABB left, right;
+            int left_count = 0, right_count = 0;
+        };
+
+        static const int max_depth = 60;
+
+        const std::vector<AABB>& prim_boxes;
+        BVHBuildOptions options;
+        Splitter splitter;
+        double root_area = 0;
+        size_t ref_limit = 0;
+        size_t ref_count = 0;
+        int spatial_split_count = 0;
+
+        bool split_reference(const Reference& ref, int axis, double pos,
+                             Reference& left, Reference& right) const {
+            left = right = ref;
+            if (splitter) {
+                if (!splitter(ref.prim, axis, pos, ref.bbox, left.bbox, right.bbox)) return false;
+            } else {
+                left.bbox = ref.bbox.clip(axis, -infinity, pos);
+                right.bbox = ref.bbox.clip(axis, pos, infinity);
+            }
+            // clipped pieces can never grow past the reference they came from
+            left.bbox = AABB::intersection(left.bbox, ref.bbox.clip(axis, -infinity, pos));
+            right.bbox = AABB::intersection(right.bbox, ref.bbox.clip(axis, pos, infinity));
+            return true;
+        }
+
+        double sah(double left_area, int left_count, double right_area, int right_count,
+                   double node_area) const {
+            return options.traversal_cost + options.intersection_cost
+                 * (left_area * left_count + right_area * right_count) / node_area;
+        }
+
+        Split find_object_split(const std::vector<Reference>& refs, double node_area) const {
+            Split best;
+            AABB centroids = AABB::empty;
+            for (const auto& ref : refs) {
+                point4 c(ref.bbox.centroid(0), ref.bbox.centroid(1), ref.bbox.centroid(2));
+                centroids = AABB(centroids, AABB(c, c));
+            }
+
+            int nbins = options.object_bins;
+            std::vector<Bin> bins(nbins);
+            std::vector<AABB> right_bounds(nbins);
+
+            for (int axis = 0; axis < 3; axis++) {
+                const Interval& range = centroids.axis_interval(axis);
+                if (range.size() <= 0) continue;
+                double scale = nbins / range.size();
+
+                std::fill(bins.begin(), bins.end(), Bin());
+                for (const auto& ref : refs) {
+                    int b = std::min(nbins - 1, int((ref.bbox.centroid(axis) - range.min) * scale));
+                    bins[b].bounds = AABB(bins[b].bounds, ref.bbox);
+                    bins[b].count++;
+                }
+
+                // sweep from the right to get the bounds of every right side
+                AABB acc = AABB::empty;
+                for (int i = nbins - 1; i > 0; i--) {
+                    acc = AABB(acc, bins[i].bounds);
+                    right_bounds[i] = acc;
+                }
+
+                AABB left = AABB::empty;
+                int left_count = 0;
+                for (int i = 0; i < nbins - 1; i++) {
+                    left = AABB(left, bins[i].bounds);
+                    left_count += bins[i].count;
+                    int right_count = int(refs.size()) - left_count;
+                    if (left_count == 0 || right_count == 0) continue;
+
+                    double cost = sah(left.surface_area(), left_count,
+                                      right_bounds[i + 1].surface_area(), right_count, node_area);
+                    if (cost < best.cost) {
+                        best.cost = cost;
+                        best.axis = axis;
+                        best.bin = i + 1;
+                        best.bin_min = range.min;
+                        best.bin_scale = scale;
+                        best.spatial = false;
+                        best.left = left;
+                        best.right = right_bounds[i + 1];
+                        best.left_count = left_count;
+                        best.right_count = right_count;
+                    }
+                }
+            }
+            return best;
+        }
+
+        Split find_spatial_split(const std::vector<Reference>& refs, const AABB& bounds,
+                                 double node_area) const {
+            Split best;
+            int nbins = options.spatial_bins;
+            std::vector<Bin> bins(nbins);
+            std::vector<AABB> right_bounds(nbins);
+            std::vector<int> right_counts(nbins);
+
+            for (int axis = 0; axis < 3; axis++) {
+                const Interval& range = bounds.axis_interval(axis);
+                if (range.size() <= 0) continue;
+                double width = range.size() / nbins;
+                auto bin_of = [&](double x) {
+                    return std::max(0, std::min(nbins - 1, int((x - range.min) / width)));
+                };
+
+                std::fill(bins.begin(), bins.end(), Bin());
+                for (const auto& ref : refs) {
+                    const Interval& ax = ref.bbox.axis_interval(axis);
+                    int first = bin_of(ax.min);
+                    int last  = bin_of(ax.max);
+
+                    // chop the reference into one piece per bin it overlaps
+                    Reference rest = ref;
+                    bool whole = false;
+                    for (int b = first; b < last && !whole; b++) {
+                        Reference left, right;
+                        if (!split_reference(rest, axis, range.min + (b + 1) * width, left, right)) {
+                            whole = true;
+                            break;
+                        }
+                        bins[b].bounds = AABB(bins[b].bounds, left.bbox);
+                        rest = right;
+                    }
+
+                    if (whole) {
+                        // unsplittable references live in the bin of their centroid
+                        int b = bin_of(ref.bbox.centroid(axis));
+                        bins[b].bounds = AABB(bins[b].bounds, ref.bbox);
+                        bins[b].count++;
+                        bins[b].exits++;
+                        continue;
+                    }
+
+                    bins[last].bounds = AABB(bins[last].bounds, rest.bbox);
+                    bins[first].count++;
+                    bins[last].exits++;
+                }
+
+                AABB acc = AABB::empty;
+                int acc_count = 0;
+                for (int i = nbins - 1; i > 0; i--) {
+                    acc = AABB(acc, bins[i].bounds);
+                    acc_count += bins[i].exits;
+                    right_bounds[i] = acc;
+                    right_counts[i] = acc_count;
+                }
+
+                AABB left = AABB::empty;
+                int left_count = 0;
+                for (int i = 0; i < nbins - 1; i++) {
+                    left = AABB(left, bins[i].bounds);
+                    left_count += bins[i].count;
+                    int right_count = right_counts[i + 1];
+                    if (left_count == 0 || right_count == 0) continue;
+
+                    double cost = sah(left.surface_area(), left_count,
+                                      right_bounds[i + 1].surface_area(), right_count, node_area);
+                    if (cost < best.cost) {
+                        best.cost = cost;
+                        best.axis = axis;
+                        best.pos = range.min + (i + 1) * width;
+                        best.spatial = true;
+                        best.left = left;
+                        best.right = right_bounds[i + 1];
+                        best.left_count = left_count;
+                        best.right_count = right_count;
+                    }
+                }
+            }
+            return best;
+        }
+
+        void partition_object(const std::vector<Reference>& refs, const Split& split,
+                              std::vector<Reference>& left, std::vector<Reference>& right) const {
+            // same binning as find_object_split, so the counts match exactly
+            int nbins = options.object_bins;
+            for (const auto& ref : refs) {
+                double c = ref.bbox.centroid(split.axis);
+                int b = std::min(nbins - 1, int((c - split.bin_min) * split.bin_scale));
+                if (b < split.bin) left.push_back(ref);
+                else right.push_back(ref);
+            }
+        }
+
+        void partition_spatial(const std::vector<Reference>& refs, const Split& split,
+                               std::vector<Reference>& left, std::vector<Reference>& right) {
+            AABB left_box = AABB::empty, right_box = AABB::empty;
+            std::vector<const Reference*> straddling;
+
+            for (const auto& ref : refs) {
+                const Interval& ax = ref.bbox.axis_interval(split.axis);
+                if (ax.max <= split.pos) {
+                    left.push_back(ref);
+                    left_box = AABB(left_box, ref.bbox);
+                } else if (ax.min >= split.pos) {
+                    right.push_back(ref);
+                    right_box = AABB(right_box, ref.bbox);
+                } else {
+                    straddling.push_back(&ref);
+                }
+            }
+
+            // Reference unsplitting: a straddling reference goes to one side
+            // only when that is cheaper than duplicating it.
+            int left_count = split.left_count, right_count = split.right_count;
+            AABB left_bounds = split.left, right_bounds = split.right;
+            for (const Reference* ref : straddling) {
+                Reference lpart, rpart;
+                bool splittable = split_reference(*ref, split.axis, split.pos, lpart, rpart);
+
+                double c_split = left_bounds.surface_area() * left_count
+                               + right_bounds.surface_area() * right_count;
+                double c_left  = AABB(left_bounds, ref->bbox).surface_area() * left_count
+                               + right_bounds.surface_area() * (right_count - 1);
+                double c_right = left_bounds.surface_area() * (left_count - 1)
+                               + AABB(right_bounds, ref->bbox).surface_area() * right_count;
+                if (!splittable) {
+                    c_split = infinity;
+                    bool by_centroid = ref->bbox.centroid(split.axis) < split.pos;
+                    (by_centroid ? c_right : c_left) = infinity;
+                }
+
+                if (c_split < c_left && c_split < c_right && !lpart.bbox.is_empty()
+                    && !rpart.bbox.is_empty()) {
+                    left.push_back(lpart);
+                    right.push_back(rpart);
+                    left_box = AABB(left_box, lpart.bbox);
+                    right_box = AABB(right_box, rpart.bbox);
+                    ref_count++;
+                } else if (c_left <= c_right) {
+                    left.push_back(*ref);
+                    left_bounds = AABB(left_bounds, ref->bbox);
+                    left_box = AABB(left_box, ref->bbox);
+                    right_count--;
+                } else {
+                    right.push_back(*ref);
+                    right_bounds = AABB(right_bounds, ref->bbox);
+                    right_box = AABB(right_box, ref->bbox);
+                    left_count--;
+                }
+            }
+        }
+
+        int build_node(std::vector<Reference>& refs, const AABB& bounds, int depth,
+                       std::vector<BVHFlatNode>& nodes, std::vector<int>& prim_indices) {
+            int index = int(nodes.size());
+            nodes.push_back({bounds, 0, 0, bounds.longest_axis()});
+
+            int n = int(refs.size());
+            if (n <= options.max_leaf_size || depth >= max_depth) {
+                make_leaf(refs, nodes[index], prim_indices);
+                return index;
+            }
+
+            double node_area = bounds.surface_area();
+            Split split;
+            if (node_area > 0 && node_area < infinity) {
+                split = find_object_split(refs, node_area);
+
+                // only bother with spatial splits when the object split leaves
+                // children that overlap noticeably, and the budget still allows it
+                double overlap = (split.axis >= 0)
+                    ? AABB::intersection(split.left, split.right).surface_area() : root_area;
+                if (options.spatial_splits && ref_count < ref_limit
+                    && overlap > options.overlap_threshold * root_area) {
+                    Split spatial = find_spatial_split(refs, bounds, node_area);
+                    size_t extra = size_t(std::max(0, spatial.left_count + spatial.right_count - n));
+                    if (spatial.cost < split.cost && ref_count + extra <= ref_limit) split = spatial;
+                }
+            }
+
+            std::vector<Reference> left, right;
+            if (split.axis >= 0) {
+                if (split.spatial) partition_spatial(refs, split, left, right);
+                else partition_object(refs, split, left, right);
+            }
+
+            if (left.empty() || right.empty()) {
+                // degenerate input (e.g. identical centroids): fall back to a median split
+                left.clear();
+                right.clear();
+                int axis = bounds.longest_axis();
+                std::sort(refs.begin(), refs.end(), [axis](const Reference& a, const Reference& b) {
+                    return a.bbox.centroid(axis) < b.bbox.centroid(axis);
+                });
+                left.assign(refs.begin(), refs.begin() + n / 2);
+                right.assign(refs.begin() + n / 2, refs.end());
+            } else {
+                nodes[index].axis = split.axis;
+                if (split.spatial) spatial_split_count++;
+            }
+            refs.clear();
+            refs.shrink_to_fit();
+
+            AABB left_bounds = AABB::empty, right_bounds = AABB::empty;
+            for (const auto& ref : left) left_bounds = AABB(left_bounds, ref.bbox);
+            for (const auto& ref : right) right_bounds = AABB(right_bounds, ref.bbox);
+
+            build_node(left, left_bounds, depth + 1, nodes, prim_indices);
+            int right_index = build_node(right, right_bounds, depth + 1, nodes, prim_indices);
+            nodes[index].offset = right_index;
+            return index;
+        }
+
+        static void make_leaf(const std::vector<Reference>& refs, BVHFlatNode& node,
+                              std::vector<int>& prim_indices) {
+            node.offset = int(prim_indices.size());
+            node.count = int(refs.size());
+            for (const auto& ref : refs) prim_indices.push_back(ref.prim);
+        }
+};
+
+// Flat BVH over arbitrary hittables, built with optional spatial splits.
+class SBVH : public Hittable {
+    public:
+        SBVH(const HittableList& list, const BVHBuildOptions& options = BVHBuildOptions())
+          : objects(list.objects) {
+            std::vector<AABB> boxes;
+            boxes.reserve(objects.size());
+            for (const auto& object : objects) boxes.push_back(object->bounding_box());
+
+            BVHBuilder builder(boxes, options,
+                [this](int prim, int axis, double pos, const AABB& ref, AABB& left, AABB& right) {
+                    if (objects[prim]->contains_media()) return false;
+                    left = ref.clip(axis, -infinity, pos);
+                    right = ref.clip(axis, pos, infinity);
+                    return true;
+                });
+            builder.build(nodes, prim_indices);
+            bbox = nodes.empty() ? AABB::empty : nodes[0].bbox;
+            has_media = list.contains_media();
+        }
+
+        bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
+            if (nodes.empty()) return false;
+
+            bool hit_anything = false;
+            int stack[64];
+            int top = 0;
+            stack[top++] = 0;
+
+            while (top > 0) {
+                int index = stack[--top];
+                const BVHFlatNode& node = nodes[index];
+                if (!node.bbox.hit(r, ray_t)) continue;
+
+                if (node.count > 0) {
+                    // a duplicated primitive may be tested more than once; the
+                    // shrinking interval keeps the closest hit correct
+                    for (int i = node.offset; i < node.offset + node.count; i++) {
+                        if (objects[prim_indices[i]]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                } else {
+                    // push the far child first so the near one is visited next
+                    int near_child = index + 1;
+                    int far_child = node.offset;
+                    if (r.d()[node.axis] < 0) std::swap(near_child, far_child);
+                    stack[top++] = far_child;
+                    stack[top++] = near_child;
+                }
+            }
+            return hit_anything;
+        }
+
+        AABB bounding_box() const override { return bbox; }
+        AABB transformed_bounds(const Mat34& m) const override {
+            AABB box = AABB::empty;
+            for (const auto& object : objects) box = AABB(box, object->transformed_bounds(m));
+            return box;
+        }
+        void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const override {
+            b0 = b1 = AABB::empty;
+            for (const auto& object : objects) {
+                AABB c0, c1;
+                object->motion_bounds(t0, t1, c0, c1);
+                b0 = AABB(b0, c0);
+                b1 = AABB(b1, c1);
+            }
+        }
+        bool contains_media() const override { return has_media; }
+
+        double surface_area() const override {
+            double sum = 0.0;
+            for (const auto& object : objects) sum += object->surface_area();
+            return sum;
+        }
+
+        const std::vector<BVHFlatNode>& flat_nodes() const { return nodes; }
+        const std::vector<int>& references() const { return prim_indices; }
+        const std::vector<shared_ptr<Hittable>>& primitives() const { return objects; }
+
+    private:
+        std::vector<shared_ptr<Hittable>> objects;
+        std::vector<BVHFlatNode> nodes;
+        std::vector<int> prim_indices;
+        AABB bbox;
+        bool has_media = false;
+};
+
+#endif
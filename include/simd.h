@@ -0,0 +1,178 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE
+#endif
+#if defined(__AVX__)
+#define SIMD_SSE
+#define SIMD_AVX
+#endif
+
+// Minimal float SIMD wrappers for the geometry kernels. vfloat4 is SSE (or
+// plain arrays without it), vfloat8 is AVX and only exists when compiled for
+// it. `vfloat` / `vbool` / SIMD_WIDTH name the widest available type.
+//
+// Masks are full lanes (all bits set or clear), as the hardware compares give.
+// Loads and stores are unaligned: std::vector won't over-align in C++11.
+
+#ifdef SIMD_SSE
+
+struct vbool4 {
+    __m128 m;
+    vbool4() {}
+    vbool4(__m128 m) : m(m) {}
+    int bits() const { return _mm_movemask_ps(m); } // one bit per lane
+};
+
+struct vfloat4 {
+    __m128 v;
+    vfloat4() {}
+    vfloat4(__m128 v) : v(v) {}
+    explicit vfloat4(float x) : v(_mm_set1_ps(x)) {}
+    static vfloat4 load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+inline vfloat4 operator+(vfloat4 a, vfloat4 b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat4 operator-(vfloat4 a, vfloat4 b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat4 operator*(vfloat4 a, vfloat4 b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat4 operator/(vfloat4 a, vfloat4 b) { return _mm_div_ps(a.v, b.v); }
+inline vfloat4 operator-(vfloat4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+inline vfloat4 min(vfloat4 a, vfloat4 b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat4 max(vfloat4 a, vfloat4 b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat4 abs(vfloat4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline vfloat4 sqrt(vfloat4 a) { return _mm_sqrt_ps(a.v); }
+// a with the sign of b flipped in: a * sign(b) without the multiply
+inline vfloat4 xor_sign(vfloat4 a, vfloat4 b) {
+    return _mm_xor_ps(a.v, _mm_and_ps(b.v, _mm_set1_ps(-0.0f)));
+}
+
+inline vbool4 operator<(vfloat4 a, vfloat4 b)  { return _mm_cmplt_ps(a.v, b.v); }
+inline vbool4 operator>(vfloat4 a, vfloat4 b)  { return _mm_cmpgt_ps(a.v, b.v); }
+inline vbool4 operator<=(vfloat4 a, vfloat4 b) { return _mm_cmple_ps(a.v, b.v); }
+inline vbool4 operator>=(vfloat4 a, vfloat4 b) { return _mm_cmpge_ps(a.v, b.v); }
+inline vbool4 operator==(vfloat4 a, vfloat4 b) { return _mm_cmpeq_ps(a.v, b.v); }
+inline vbool4 operator!=(vfloat4 a, vfloat4 b) { return _mm_cmpneq_ps(a.v, b.v); }
+inline vbool4 operator&(vbool4 a, vbool4 b) { return _mm_and_ps(a.m, b.m); }
+inline vbool4 operator|(vbool4 a, vbool4 b) { return _mm_or_ps(a.m, b.m); }
+inline vbool4 andnot(vbool4 a, vbool4 b) { return _mm_andnot_ps(b.m, a.m); } // a & ~b
+
+// lanes of a where mask is set, b elsewhere
+inline vfloat4 select(vbool4 mask, vfloat4 a, vfloat4 b) {
+    return _mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v));
+}
+
+#else // scalar fallback with the same interface
+
+struct vbool4 {
+    bool m[4];
+    int bits() const { return int(m[0]) | int(m[1]) << 1 | int(m[2]) << 2 | int(m[3]) << 3; }
+};
+
+struct vfloat4 {
+    float v[4];
+    vfloat4() {}
+    explicit vfloat4(float x) : v{x, x, x, x} {}
+    static vfloat4 load(const float* p) { vfloat4 r; std::copy(p, p + 4, r.v); return r; }
+    void store(float* p) const { std::copy(v, v + 4, p); }
+};
+
+#define SIMD_LANEWISE(result_type, expr) \
+    result_type r; for (int i = 0; i < 4; i++) r.expr; return r;
+
+inline vfloat4 operator+(vfloat4 a, vfloat4 b) { SIMD_LANEWISE(vfloat4, v[i] = a.v[i] + b.v[i]) }
+inline vfloat4 operator-(vfloat4 a, vfloat4 b) { SIMD_LANEWISE(vfloat4, v[i] = a.v[i] - b.v[i]) }
+inline vfloat4 operator*(vfloat4 a, vfloat4 b) { SIMD_LANEWISE(vfloat4, v[i] = a.v[i] * b.v[i]) }
+inline vfloat4 operator/(vfloat4 a, vfloat4 b) { SIMD_LANEWISE(vfloat4, v[i] = a.v[i] / b.v[i]) }
+inline vfloat4 operator-(vfloat4 a) { SIMD_LANEWISE(vfloat4, v[i] = -a.v[i]) }
+inline vfloat4 min(vfloat4 a, vfloat4 b) { SIMD_LANEWISE(vfloat4, v[i] = std::min(a.v[i], b.v[i])) }
+inline vfloat4 max(vfloat4 a, vfloat4 b) { SIMD_LANEWISE(vfloat4, v[i] = std::max(a.v[i], b.v[i])) }
+inline vfloat4 abs(vfloat4 a) { SIMD_LANEWISE(vfloat4, v[i] = std::fabs(a.v[i])) }
+inline vfloat4 sqrt(vfloat4 a) { SIMD_LANEWISE(vfloat4, v[i] = std::sqrt(a.v[i])) }
+inline vfloat4 xor_sign(vfloat4 a, vfloat4 b) {
+    SIMD_LANEWISE(vfloat4, v[i] = std::signbit(b.v[i]) ? -a.v[i] : a.v[i])
+}
+
+inline vbool4 operator<(vfloat4 a, vfloat4 b)  { SIMD_LANEWISE(vbool4, m[i] = a.v[i] < b.v[i]) }
+inline vbool4 operator>(vfloat4 a, vfloat4 b)  { SIMD_LANEWISE(vbool4, m[i] = a.v[i] > b.v[i]) }
+inline vbool4 operator<=(vfloat4 a, vfloat4 b) { SIMD_LANEWISE(vbool4, m[i] = a.v[i] <= b.v[i]) }
+inline vbool4 operator>=(vfloat4 a, vfloat4 b) { SIMD_LANEWISE(vbool4, m[i] = a.v[i] >= b.v[i]) }
+inline vbool4 operator==(vfloat4 a, vfloat4 b) { SIMD_LANEWISE(vbool4, m[i] = a.v[i] == b.v[i]) }
+inline vbool4 operator!=(vfloat4 a, vfloat4 b) { SIMD_LANEWISE(vbool4, m[i] = a.v[i] != b.v[i]) }
+inline vbool4 operator&(vbool4 a, vbool4 b) { SIMD_LANEWISE(vbool4, m[i] = a.m[i] && b.m[i]) }
+inline vbool4 operator|(vbool4 a, vbool4 b) { SIMD_LANEWISE(vbool4, m[i] = a.m[i] || b.m[i]) }
+inline vbool4 andnot(vbool4 a, vbool4 b) { SIMD_LANEWISE(vbool4, m[i] = a.m[i] && !b.m[i]) }
+
+inline vfloat4 select(vbool4 mask, vfloat4 a, vfloat4 b) {
+    SIMD_LANEWISE(vfloat4, v[i] = mask.m[i] ? a.v[i] : b.v[i])
+}
+
+#undef SIMD_LANEWISE
+
+#endif // SIMD_SSE
+
+#ifdef SIMD_AVX
+
+struct vbool8 {
+    __m256 m;
+    vbool8() {}
+    vbool8(__m256 m) : m(m) {}
+    int bits() const { return _mm256_movemask_ps(m); }
+};
+
+struct vfloat8 {
+    __m256 v;
+    vfloat8() {}
+    vfloat8(__m256 v) : v(v) {}
+    explicit vfloat8(float x) : v(_mm256_set1_ps(x)) {}
+    static vfloat8 load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+};
+
+inline vfloat8 operator+(vfloat8 a, vfloat8 b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat8 operator-(vfloat8 a, vfloat8 b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat8 operator*(vfloat8 a, vfloat8 b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat8 operator/(vfloat8 a, vfloat8 b) { return _mm256_div_ps(a.v, b.v); }
+inline vfloat8 operator-(vfloat8 a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+inline vfloat8 min(vfloat8 a, vfloat8 b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat8 max(vfloat8 a, vfloat8 b) { return _mm256_max_ps(a.v, b.v); }
+inline vfloat8 abs(vfloat8 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline vfloat8 sqrt(vfloat8 a) { return _mm256_sqrt_ps(a.v); }
+inline vfloat8 xor_sign(vfloat8 a, vfloat8 b) {
+    return _mm256_xor_ps(a.v, _mm256_and_ps(b.v, _mm256_set1_ps(-0.0f)));
+}
+
+inline vbool8 operator<(vfloat8 a, vfloat8 b)  { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline vbool8 operator>(vfloat8 a, vfloat8 b)  { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline vbool8 operator<=(vfloat8 a, vfloat8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline vbool8 operator>=(vfloat8 a, vfloat8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline vbool8 operator==(vfloat8 a, vfloat8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+inline vbool8 operator!=(vfloat8 a, vfloat8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_NEQ_UQ); }
+inline vbool8 operator&(vbool8 a, vbool8 b) { return _mm256_and_ps(a.m, b.m); }
+inline vbool8 operator|(vbool8 a, vbool8 b) { return _mm256_or_ps(a.m, b.m); }
+inline vbool8 andnot(vbool8 a, vbool8 b) { return _mm256_andnot_ps(b.m, a.m); }
+
+inline vfloat8 select(vbool8 mask, vfloat8 a, vfloat8 b) {
+    return _mm256_blendv_ps(b.v, a.v, mask.m);
+}
+
+typedef vfloat8 vfloat;
+typedef vbool8 vbool;
+#define SIMD_WIDTH 8
+
+#else
+
+typedef vfloat4 vfloat;
+typedef vbool4 vbool;
+#define SIMD_WIDTH 4
+
+#endif // SIMD_AVX
+
+#endif
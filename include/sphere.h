@@ -5,10 +5,18 @@
 #include "onb.h"
 // #include "vec4.h"
 
-class Sphere : public Hittable {
+// dp/du and dp/dv of the uv mapping Sphere uses, at unit normal n
+inline void sphere_uv_derivatives(const vec4& n, double radius, vec4& dpdu, vec4& dpdv) {
+    // u follows phi around y, v follows theta down from +y to -y
+    double s = std::fmax(std::sqrt(n.x() * n.x() + n.z() * n.z()), 1e-9); // sin(theta)
+    dpdu = (2 * pi * radius) * vec4(n.z(), 0, -n.x());
+    dpdv = (pi * radius) * vec4(-n.x() * n.y() / s, s, -n.y() * n.z() / s);
+}
+
+class Sphere final : public Hittable {
     public:
         Sphere(const point4& static_center, double r, shared_ptr<Material> mat)
-         : center(static_center, vec4(0,0,0)), radius(std::fmax(0,r)), mat(mat) {
+         : center(static_center, vec4(0,0,0)), radius(std::fmax(0,r)), mat_id(material_id(mat)) {
             // sphere extremes are the bounds of the cube that embeds the sphere
             auto rvec = vec4(radius,radius,radius);
             bbox = AABB(static_center - rvec, static_center + rvec);
@@ -17,7 +25,7 @@ class Sphere : public Hittable {
         // center2 - center1 is the vector that goes from c1 to c2
         Sphere(const point4& center1, const point4& center2,
                double r, shared_ptr<Material> mat)
-         : center(center1, center2 - center1), radius(std::fmax(0,r)), mat(mat) {
+         : center(center1, center2 - center1), radius(std::fmax(0,r)), mat_id(material_id(mat)) {
             auto rvec = vec4(radius,radius,radius);
             AABB box1(center.at(0) - rvec, center.at(0) + rvec);
             AABB box2(center.at(1) - rvec, center.at(1) + rvec);
@@ -66,26 +74,65 @@ class Sphere : public Hittable {
                     return false;
             }
 
-            // fill out hit record
+            // the rest waits for surface(), if this stays the closest hit
             rec.t = root;
+            rec.object = this;
+            return true;
+        }
+
+        void surface(const Ray& r, Hit& rec) const override {
             rec.p = r.at(rec.t);
             // normal unit vec from center sphere to hit point
-            vec4 normal_out = (rec.p - current_center) / radius;
-            rec.mat = mat;
+            vec4 normal_out = (rec.p - center.at(r.time())) / radius;
+            rec.mat_id = mat_id;
             rec.set_face_normal(r, normal_out);
             get_sphere_uv(normal_out, rec.u, rec.v);
+            sphere_uv_derivatives(normal_out, radius, rec.dpdu, rec.dpdv);
+        }
+
+        bool span(const Ray& r, double& t_in, double& t_out) const override {
+            // both roots of the quadratic in hit()
+            vec4 oc = center.at(r.time()) - r.o();
+            auto a = r.d().norm2();
+            auto h = dot(r.d(), oc);
+            auto discriminant = h*h - a*(oc.norm2() - radius*radius);
+            if (discriminant <= 0) return false;
+            auto sqrtd = std::sqrt(discriminant);
+            t_in = (h - sqrtd) / a;
+            t_out = (h + sqrtd) / a;
             return true;
         }
 
         AABB bounding_box() const override { return bbox; }
+
+        AABB transformed_bounds(const Mat34& m) const override {
+            // an ellipsoid: row k of the linear part stretches axis k by its length
+            vec4 extent;
+            for (int k = 0; k < 3; k++)
+                extent[k] = radius * vec4(m.m[k][0], m.m[k][1], m.m[k][2]).norm();
+            point4 c0 = m.point(center.at(0)), c1 = m.point(center.at(1));
+            return AABB(AABB(c0 - extent, c0 + extent), AABB(c1 - extent, c1 + extent));
+        }
+
+        double surface_area() const override { return 4 * pi * radius * radius; }
+        uint32_t light_material() const override {
+            return center.d().norm2() == 0 ? mat_id : 0; // sampling assumes it stays put
+        }
+
+        void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const override {
+            // the center moves linearly, so the end boxes interpolate exactly
+            auto rvec = vec4(radius,radius,radius);
+            b0 = AABB(center.at(t0) - rvec, center.at(t0) + rvec);
+            b1 = AABB(center.at(t1) - rvec, center.at(t1) + rvec);
+        }
     private:
         //point4 center;
         Ray center;
         double radius;
-        shared_ptr<Material> mat;
+        uint32_t mat_id;
         AABB bbox;
 
-        static void get_sphere_uv(const point4& p, double& u, double& v) {
+        static void get_sphere_uv(const point4& p, real& u, real& v) {
             // p: point on unit sphere 
             // u,v: normalized [0,1] mapping from spherical coords
 
@@ -2,19 +2,31 @@
 #define TEXTURE_H
 
 #include "rtweekend.h"
-#include "rtw_stb_image.h"
+#include "texture_cache.h"
 #include "perlin.h"
 
+// The built-in textures are a closed set: each tags itself so
+// texture_value() can switch to the concrete (final) class and inline its
+// value() instead of a virtual call. Other subclasses stay `custom`.
+enum class TextureKind { custom, solid, checkered, image, noise };
+
 class Texture {
     public:
         virtual ~Texture() = default;
         virtual Color value(double u, double v, const point4& p) const = 0;
         // u, v texture coords, p is hit point
+
+        TextureKind kind() const { return tag; }
+
+    protected:
+        TextureKind tag = TextureKind::custom;
 };
 
-class SolidColor : public Texture {
+inline Color texture_value(const Texture& tex, double u, double v, const point4& p, double footprint = 0);
+
+class SolidColor final : public Texture {
     public:
-        SolidColor(const Color& albedo) : albedo(albedo) {}
+        SolidColor(const Color& albedo) : albedo(albedo) { tag = TextureKind::solid; }
         SolidColor(double r, double g, double b) : SolidColor(Color(r,g,b)) {}
         Color value(double u, double v, const point4& p) const override {
             return albedo;
@@ -23,12 +35,12 @@ class SolidColor : public Texture {
         Color albedo;
 };
 
-class CheckeredTexture : public Texture {
+class CheckeredTexture final : public Texture {
     public:
         CheckeredTexture(double scale, shared_ptr<Texture> even, shared_ptr<Texture> odd)
-            : inv_scale(1.0 / scale), even(even), odd(odd) {}
+            : inv_scale(1.0 / scale), even(even), odd(odd) { tag = TextureKind::checkered; }
         CheckeredTexture(double scale, const Color& c1, const Color& c2)
-            : CheckeredTexture(scale, make_shared<SolidColor>(c1), make_shared<SolidColor>(c2)) {}
+            : CheckeredTexture(scale, make_scene_shared<SolidColor>(c1), make_scene_shared<SolidColor>(c2)) {}
 
         Color value(double u, double v, const point4& p) const override {
             auto x = int(std::floor(inv_scale * p.x()));
@@ -36,7 +48,7 @@ class CheckeredTexture : public Texture {
             auto z = int(std::floor(inv_scale * p.z()));
             bool isEven = (x + y + z) % 2 == 0;
 
-            return isEven ? even->value(u, v, p) : odd->value(u, v, p);
+            return texture_value(isEven ? *even : *odd, u, v, p);
         }
     private:
         double inv_scale;
@@ -44,35 +56,44 @@ class CheckeredTexture : public Texture {
         shared_ptr<Texture> odd;
 };
 
-class ImageTexture : public Texture {
+class ImageTexture final : public Texture {
     public: 
-        ImageTexture(const char* filename) : image(filename) {}
+        // images are shared and paged through TextureCache::global()
+        ImageTexture(const char* filename) : image(TextureCache::global().get(filename)) {
+            tag = TextureKind::image;
+        }
 
         Color value(double u, double v, const point4& p) const override {
             // no texture data, default color fill
-            if(image.height() <= 0) return Color(0,1,1);
+            if(image->empty()) return Color(0,1,1);
             u = Interval(0,1).clamp(u);
             v = 1.0 - Interval(0,1).clamp(v); // flip 'v' to image coordinates
             // if not, the texture is upside down
 
-            auto i = int(u * image.width());
-            auto j = int(v * image.height());
-            auto pixel = image.pixel_data(i,j); // 0-255, need normalize
+            auto i = int(u * image->width());
+            auto j = int(v * image->height());
+            return image->texel(0, i, j); // nearest texel of the full-size level
+        }
 
-            auto color_scale = 1.0 / 255.0;
-            return Color(
-                color_scale*pixel[0],
-                color_scale*pixel[1],
-                color_scale*pixel[2]);
+        // filtered over `footprint` (uv units) from the matching mip levels
+        Color value(double u, double v, const point4& p, double footprint) const {
+            if (footprint <= 0 || image->empty()) return value(u, v, p);
+            return image->trilinear(Interval(0,1).clamp(u), Interval(0,1).clamp(v), footprint);
         }
     private:
-        rtw_image image;
+        shared_ptr<const TiledImage> image;
 };
 
-class NoiseTexture : public Texture {
+class NoiseTexture final : public Texture {
     public:
-        NoiseTexture() {}
-        NoiseTexture(double scale) : scale(scale) {}
+        NoiseTexture() { tag = TextureKind::noise; }
+        NoiseTexture(double scale) : scale(scale) { tag = TextureKind::noise; }
+        // turbulence baked over `bounds` (the object's box) at `resolution`
+        // points along its longest side; see NoiseVolume
+        NoiseTexture(double scale, const AABB& bounds, int resolution = 128)
+          : scale(scale), baked(make_shared<NoiseVolume>(noise, bounds, depth, resolution)) {
+            tag = TextureKind::noise;
+        }
         Color value(double u, double v, const point4& p) const override {
             //return Color(1,1,1) * (1.0 + noise.noise(scale * p)) * 0.5;
             // why 0.5? => Perlin interpolation can give negative values
@@ -82,11 +103,26 @@ class NoiseTexture : public Texture {
             //return Color(1,1,1) * noise.turb(p, 7);
             // make color proportional to something like a sin function
             // use turbulenec to adjust the phase
-            return Color(0.5,0.5,0.5) * (1 + std::sin(scale * p.z() + 10 * noise.turb(p ,7)));
+            double turb;
+            if (!baked || !baked->lookup(p, turb)) turb = noise.turb(p, depth);
+            return Color(0.5,0.5,0.5) * (1 + std::sin(scale * p.z() + 10 * turb));
         }
     private:
+        static const int depth = 7; // octaves
         Perlin noise;
         double scale; // frequency
+        shared_ptr<const NoiseVolume> baked; // null: always procedural
 };
 
+// footprint: uv width to filter over, from ray differentials; 0 looks up a point
+inline Color texture_value(const Texture& tex, double u, double v, const point4& p, double footprint) {
+    switch (tex.kind()) {
+        case TextureKind::solid:     return static_cast<const SolidColor&>(tex).value(u, v, p);
+        case TextureKind::checkered: return static_cast<const CheckeredTexture&>(tex).value(u, v, p);
+        case TextureKind::image:     return static_cast<const ImageTexture&>(tex).value(u, v, p, footprint);
+        case TextureKind::noise:     return static_cast<const NoiseTexture&>(tex).value(u, v, p);
+        default:                     return tex.value(u, v, p);
+    }
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,418 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "rtweekend.h"
+#include "rtw_stb_image.h"
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <sys/stat.h>
+
+// Image textures through one process-wide cache.
+//
+// Each image path is decoded once. Its pixels are turned into a mip pyramid
+// (2x2 box filter down to 1x1) cut into square tiles of 8-bit RGB, and the
+// tiles are written to a tile file in `tile_dir` (the system's temporary
+// directory unless set; empty puts it next to the image). Later runs read
+// that file directly instead of decoding. Lookups page tiles in on demand
+// through a single LRU shared by all images, so resident texture memory is
+// capped by `memory_cap` however many textures the scene uses. A tile is a
+// small square, so the texels a filtered lookup touches are usually in one
+// tile rather than spread over whole scanlines; a bilinear lookup fetches
+// each tile it needs once.
+//
+// If the tile file can't be written (or `bake` is off) the tiles of that
+// image stay in memory instead, and the cap doesn't apply to them.
+//
+// A tile file is reused only if the source's size and modification time
+// match the ones recorded in it.
+//
+// File layout (native endian):
+//   "RTWTILE2", source file size, source mtime, width, height, tile size,
+//   level count, then every tile of every level, level 0 first, tiles row by
+//   row, each tile_size^2 RGB texels (edge tiles padded).
+
+// $TMPDIR (or %TEMP%), else /tmp: writable, and outside the source tree
+inline std::string default_tile_dir() {
+    for (const char* var : { "TMPDIR", "TEMP", "TMP" }) {
+        const char* dir = std::getenv(var);
+        if (dir && *dir) return dir;
+    }
+    return "/tmp";
+}
+
+struct TextureCacheOptions {
+    int tile_size = 32;                    // texels per tile side
+    size_t memory_cap = size_t(64) << 20;  // bytes of resident tiles, over all images
+    bool bake = true;                      // write / reuse tile files
+    std::string tile_dir = default_tile_dir(); // where they go (must exist); empty: next to each image
+};
+
+struct TileCacheStats {
+    size_t hits = 0;          // tile lookups served from memory
+    size_t misses = 0;        // lookups that read from a tile file
+    size_t evictions = 0;
+    size_t bytes_paged = 0;
+    size_t resident_bytes = 0;
+    size_t peak_resident_bytes = 0;
+
+    void print(std::ostream& out) const {
+        auto lookups = hits + misses;
+        out << "Textures: " << lookups << " tile lookups, " << misses << " misses ("
+            << (lookups ? 100.0 * misses / lookups : 0.0) << "%), " << evictions << " evictions, "
+            << bytes_paged / (1024.0 * 1024.0) << " MB paged in, peak resident "
+            << peak_resident_bytes / (1024.0 * 1024.0) << " MB\n";
+    }
+};
+
+class TextureCache;
+
+// One image as a tiled mip pyramid. Get it from TextureCache::global().
+class TiledImage {
+    public:
+        typedef std::vector<unsigned char> Tile;
+
+        int width(int level = 0) const { return level_width[size_t(level)]; }
+        int height(int level = 0) const { return level_height[size_t(level)]; }
+        int levels() const { return int(level_width.size()); }
+        bool empty() const { return level_width.empty(); }
+
+        // texel x, y (clamped to the edges) of a level, components in [0, 1]
+        inline Color texel(int level, int x, int y) const;
+
+        // bilinear lookup in a level; u, v in [0, 1] with v = 0 at the bottom
+        inline Color bilinear(int level, double u, double v) const;
+
+        // trilinear lookup for a footprint `footprint` across (in uv units)
+        Color trilinear(double u, double v, double footprint) const {
+            double level = levels() - 1 + std::log2(std::fmax(footprint, 1e-8));
+            if (level <= 0) return bilinear(0, u, v);
+            if (level >= levels() - 1) return bilinear(levels() - 1, u, v);
+            int l0 = int(level);
+            double t = level - l0;
+            return (1 - t) * bilinear(l0, u, v) + t * bilinear(l0 + 1, u, v);
+        }
+
+    private:
+        friend class TextureCache;
+
+        uint32_t id = 0; // cache key prefix
+        int tile_size = 32;
+        std::vector<int> level_width, level_height;
+        std::vector<size_t> level_first_tile; // global index of each level's first tile
+        std::vector<shared_ptr<const Tile>> in_memory; // all tiles, when there's no tile file
+        TextureCache* cache = nullptr;
+        std::string tile_file;
+        mutable std::ifstream file; // read under the cache's lock
+
+        int tiles_across(int level) const { return (width(level) + tile_size - 1) / tile_size; }
+        int tiles_down(int level) const { return (height(level) + tile_size - 1) / tile_size; }
+        size_t tile_bytes() const { return size_t(tile_size) * tile_size * 3; }
+        static size_t header_bytes() { return 8 + 8 + 8 + 4 * 4; }
+
+        void clamp(int level, int& x, int& y) const {
+            x = std::min(std::max(x, 0), width(level) - 1);
+            y = std::min(std::max(y, 0), height(level) - 1);
+        }
+
+        // global index of the tile holding in-range texel x, y
+        size_t tile_index(int level, int x, int y) const {
+            return level_first_tile[size_t(level)]
+                 + size_t(y / tile_size) * tiles_across(level) + size_t(x / tile_size);
+        }
+
+        Color color(const Tile& tile, int x, int y) const {
+            const unsigned char* c = &tile[(size_t(y % tile_size) * tile_size + x % tile_size) * 3];
+            auto color_scale = 1.0 / 255.0;
+            return Color(color_scale * c[0], color_scale * c[1], color_scale * c[2]);
+        }
+
+        void set_levels(int w, int h) {
+            level_width.clear();
+            level_height.clear();
+            level_first_tile.clear();
+            if (w <= 0 || h <= 0) return;
+            size_t tiles = 0;
+            for (;;) {
+                level_width.push_back(w);
+                level_height.push_back(h);
+                level_first_tile.push_back(tiles);
+                tiles += size_t(tiles_across(levels() - 1)) * tiles_down(levels() - 1);
+                if (w == 1 && h == 1) break;
+                w = std::max(1, w / 2);
+                h = std::max(1, h / 2);
+            }
+            level_first_tile.push_back(tiles);
+        }
+
+        bool read_tile(size_t index, Tile& tile) const {
+            tile.resize(tile_bytes());
+            file.clear();
+            file.seekg(std::streamoff(header_bytes() + index * tile_bytes()));
+            return bool(file.read(reinterpret_cast<char*>(tile.data()), std::streamsize(tile.size())));
+        }
+};
+
+class TextureCache {
+    public:
+        TextureCacheOptions options;
+
+        static TextureCache& global() {
+            static TextureCache cache;
+            return cache;
+        }
+
+        // The image at `filename`, loaded (or its tile file opened) the first
+        // time the path is asked for. Never null; empty() if it couldn't load.
+        shared_ptr<const TiledImage> get(const std::string& filename) {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            auto it = images.find(filename);
+            if (it != images.end()) return it->second;
+
+            auto image = make_shared<TiledImage>();
+            image->id = uint32_t(images.size());
+            image->cache = this;
+            image->tile_size = options.tile_size;
+            image->tile_file = tile_path(filename);
+            if (!open_tiles(*image, filename)) bake(*image, filename);
+            images[filename] = image;
+            return image;
+        }
+
+        TileCacheStats stats() const {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            return paging;
+        }
+
+    private:
+        struct CacheEntry {
+            shared_ptr<const TiledImage::Tile> tile;
+            std::list<uint64_t>::iterator lru; // position in `recent`
+        };
+
+        mutable std::mutex cache_mutex;
+        std::unordered_map<std::string, shared_ptr<TiledImage>> images;
+        std::unordered_map<uint64_t, CacheEntry> cache; // key: image id << 40 | tile index
+        std::list<uint64_t> recent; // most recently used first
+        TileCacheStats paging;
+
+        friend class TiledImage;
+
+        static const char* magic() { return "RTWTILE2"; }
+
+        static uint64_t file_size(const std::string& filename) {
+            std::ifstream in(filename, std::ios::binary | std::ios::ate);
+            return in ? uint64_t(in.tellg()) : 0;
+        }
+
+        static int64_t modified_time(const std::string& filename) {
+            struct stat st;
+            return stat(filename.c_str(), &st) == 0 ? int64_t(st.st_mtime) : 0;
+        }
+
+        // in tile_dir, the image's whole path goes into the name so images
+        // with the same file name don't share a tile file (if two still do,
+        // the size and mtime check rebakes rather than reusing the wrong one)
+        std::string tile_path(const std::string& filename) const {
+            if (options.tile_dir.empty()) return filename + ".tiles";
+            std::string name = filename;
+            for (char& c : name)
+                if (c == '/' || c == '\\' || c == ':') c = '_';
+            return options.tile_dir + "/rtw_" + name + ".tiles";
+        }
+
+        static unsigned char to_byte(float value) {
+            // same rounding as rtw_image, so level 0 matches its bytes exactly
+            if (value <= 0.0) return 0;
+            if (1.0 <= value) return 255;
+            return static_cast<unsigned char>(256.0 * value);
+        }
+
+        // Reuses an existing tile file if it was baked from this very source.
+        bool open_tiles(TiledImage& image, const std::string& filename) {
+            if (!options.bake) return false;
+            image.file.open(image.tile_file, std::ios::binary);
+            char header[8];
+            uint64_t source_size = 0;
+            int64_t source_time = 0;
+            int32_t dims[4];
+            if (!image.file.read(header, 8) || std::memcmp(header, magic(), 8) != 0
+                || !image.file.read(reinterpret_cast<char*>(&source_size), sizeof(source_size))
+                || !image.file.read(reinterpret_cast<char*>(&source_time), sizeof(source_time))
+                || !image.file.read(reinterpret_cast<char*>(dims), sizeof(dims))
+                || source_size != file_size(filename) || source_time != modified_time(filename)
+                || dims[2] != options.tile_size) {
+                image.file.close();
+                return false;
+            }
+            image.set_levels(dims[0], dims[1]);
+            if (image.levels() != dims[3]) {
+                image.file.close();
+                image.set_levels(0, 0);
+                return false;
+            }
+            return true;
+        }
+
+        // Decodes the image, builds its pyramid and tiles it, into the tile
+        // file if possible and into memory otherwise.
+        void bake(TiledImage& image, const std::string& filename) {
+            std::vector<float> pixels;
+            int w, h;
+            {
+                rtw_image source(filename.c_str()); // gone before the tiles are built
+                w = source.width();
+                h = source.height();
+                if (w <= 0 || h <= 0) return;
+                pixels.resize(size_t(w) * h * 3);
+                for (int y = 0; y < h; y++)
+                    for (int x = 0; x < w; x++)
+                        std::memcpy(&pixels[(size_t(y) * w + x) * 3], source.float_pixel_data(x, y), 3 * sizeof(float));
+            }
+            image.set_levels(w, h);
+
+            if (options.bake) {
+                std::ofstream out(image.tile_file, std::ios::binary | std::ios::trunc);
+                uint64_t source_size = file_size(filename);
+                int64_t source_time = modified_time(filename);
+                int32_t dims[4] = { w, h, options.tile_size, image.levels() };
+                out.write(magic(), 8);
+                out.write(reinterpret_cast<const char*>(&source_size), sizeof(source_size));
+                out.write(reinterpret_cast<const char*>(&source_time), sizeof(source_time));
+                out.write(reinterpret_cast<const char*>(dims), sizeof(dims));
+                tile_pyramid(image, pixels, &out);
+                out.close();
+                if (out) {
+                    image.file.open(image.tile_file, std::ios::binary);
+                    return;
+                }
+                std::cerr << "WARNING: Could not write " << image.tile_file
+                          << "; keeping its tiles in memory\n";
+            }
+            tile_pyramid(image, pixels, nullptr);
+        }
+
+        // Cuts every level into tiles, appended to `out` or kept in memory.
+        void tile_pyramid(TiledImage& image, std::vector<float> level, std::ofstream* out) {
+            for (int l = 0; l < image.levels(); l++) {
+                if (l > 0) level = downsample(level, image.width(l - 1), image.height(l - 1),
+                                              image.width(l), image.height(l));
+                write_level(image, l, level, out);
+            }
+        }
+
+        static std::vector<float> downsample(const std::vector<float>& src, int sw, int sh, int w, int h) {
+            // 2x2 box filter; an odd last row or column is folded into its neighbour
+            std::vector<float> dst(size_t(w) * h * 3);
+            for (int y = 0; y < h; y++) {
+                int y0 = std::min(2 * y, sh - 1), y1 = std::min(2 * y + 1, sh - 1);
+                for (int x = 0; x < w; x++) {
+                    int x0 = std::min(2 * x, sw - 1), x1 = std::min(2 * x + 1, sw - 1);
+                    for (int c = 0; c < 3; c++) {
+                        dst[(size_t(y) * w + x) * 3 + c] = 0.25f * (
+                            src[(size_t(y0) * sw + x0) * 3 + c] + src[(size_t(y0) * sw + x1) * 3 + c]
+                          + src[(size_t(y1) * sw + x0) * 3 + c] + src[(size_t(y1) * sw + x1) * 3 + c]);
+                    }
+                }
+            }
+            return dst;
+        }
+
+        void write_level(TiledImage& image, int l, const std::vector<float>& level, std::ofstream* out) {
+            int w = image.width(l), h = image.height(l), t = image.tile_size;
+            for (int ty = 0; ty < image.tiles_down(l); ty++) {
+                for (int tx = 0; tx < image.tiles_across(l); tx++) {
+                    auto tile = make_shared<TiledImage::Tile>(image.tile_bytes(), 0);
+                    for (int y = 0; y < t && ty * t + y < h; y++) {
+                        for (int x = 0; x < t && tx * t + x < w; x++) {
+                            const float* c = &level[(size_t(ty * t + y) * w + tx * t + x) * 3];
+                            unsigned char* d = &(*tile)[(size_t(y) * t + x) * 3];
+                            d[0] = to_byte(c[0]);
+                            d[1] = to_byte(c[1]);
+                            d[2] = to_byte(c[2]);
+                        }
+                    }
+                    if (out) out->write(reinterpret_cast<const char*>(tile->data()), std::streamsize(tile->size()));
+                    else image.in_memory.push_back(tile);
+                }
+            }
+        }
+
+        // The tile, paged in if needed. The returned pointer stays valid even
+        // if the tile is evicted while the caller still uses it.
+        shared_ptr<const TiledImage::Tile> tile(const TiledImage& image, size_t index) {
+            if (!image.in_memory.empty()) return image.in_memory[index];
+
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            uint64_t key = (uint64_t(image.id) << 40) | index;
+            auto it = cache.find(key);
+            if (it != cache.end()) {
+                paging.hits++;
+                recent.splice(recent.begin(), recent, it->second.lru);
+                return it->second.tile;
+            }
+
+            paging.misses++;
+            auto tile = make_shared<TiledImage::Tile>();
+            if (!image.read_tile(index, *tile)) {
+                std::cerr << "ERROR: Could not read tile " << index << " from " << image.tile_file << "\n";
+                tile->assign(image.tile_bytes(), 0);
+            }
+            size_t bytes = tile->size();
+            paging.bytes_paged += bytes;
+
+            // make room, but always keep the tile being returned
+            while (!recent.empty() && paging.resident_bytes + bytes > options.memory_cap) {
+                auto victim = cache.find(recent.back());
+                paging.resident_bytes -= victim->second.tile->size();
+                cache.erase(victim);
+                recent.pop_back();
+                paging.evictions++;
+            }
+            recent.push_front(key);
+            cache[key] = {tile, recent.begin()};
+            paging.resident_bytes += bytes;
+            paging.peak_resident_bytes = std::max(paging.peak_resident_bytes, paging.resident_bytes);
+            return tile;
+        }
+};
+
+inline Color TiledImage::texel(int level, int x, int y) const {
+    if (empty()) return Color(0,0,0);
+    clamp(level, x, y);
+    return color(*cache->tile(*this, tile_index(level, x, y)), x, y);
+}
+
+inline Color TiledImage::bilinear(int level, double u, double v) const {
+    if (empty()) return Color(0,0,0);
+    double x = u * width(level) - 0.5, y = (1 - v) * height(level) - 0.5;
+    int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+    double fx = x - x0, fy = y - y0;
+    int x1 = x0 + 1, y1 = y0 + 1;
+    clamp(level, x0, y0);
+    clamp(level, x1, y1);
+
+    // the four texels are mostly in one tile, at most in four; each tile
+    // is looked up (and the cache locked) once
+    size_t index[4];
+    shared_ptr<const Tile> tiles[4];
+    int fetched = 0;
+    auto at = [&](int tx, int ty) {
+        size_t i = tile_index(level, tx, ty);
+        int k = 0;
+        while (k < fetched && index[k] != i) k++;
+        if (k == fetched) {
+            index[k] = i;
+            tiles[k] = cache->tile(*this, i);
+            fetched++;
+        }
+        return color(*tiles[k], tx, ty);
+    };
+    return (1 - fx) * (1 - fy) * at(x0, y0) + fx * (1 - fy) * at(x1, y0)
+         + (1 - fx) * fy * at(x0, y1) + fx * fy * at(x1, y1);
+}
+
+#endif
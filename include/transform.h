@@ -0,0 +1,90 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "hittable.h"
+#include "mat34.h"
+
+// General affine instance: one matrix instead of a Translate / Rotate chain.
+// The inverse (world -> object) and the normal matrix are computed once, so a
+// hit is two matrix-vector products each way and no allocation. Wrapping a
+// Transform in another collapses the two into a single matrix.
+class Transform : public Hittable {
+    public:
+        Transform(shared_ptr<Hittable> object, const Mat34& to_world)
+          : object(object), to_world(to_world) {
+            // fold nested transforms into one matrix
+            if (auto inner = std::dynamic_pointer_cast<Transform>(object)) {
+                this->object = inner->object;
+                this->to_world = to_world * inner->to_world;
+            }
+            to_object = this->to_world.inverse();
+            bbox = this->object->transformed_bounds(this->to_world);
+            // a surface scales by about |det|^(2/3) (exact for uniform scale)
+            area_scale = std::pow(std::fabs(this->to_world.determinant()), 2.0 / 3.0);
+        }
+
+        bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
+            // t is the same in both spaces since the direction isn't renormalized
+            Ray object_ray(to_object.point(r.o()), to_object.vector(r.d()), r.time());
+            if (!object->hit(object_ray, ray_t, rec)) return false;
+            rec.finish(object_ray);
+
+            rec.p = to_world.point(rec.p);
+            // inverse transpose; the side of the surface facing the ray doesn't change
+            rec.normal = unit_vector(to_object.transpose_vector(rec.normal));
+            rec.dpdu = to_world.vector(rec.dpdu);
+            rec.dpdv = to_world.vector(rec.dpdv);
+            return true;
+        }
+
+        AABB bounding_box() const override { return bbox; }
+
+        AABB transformed_bounds(const Mat34& m) const override {
+            return object->transformed_bounds(m * to_world);
+        }
+
+        void motion_bounds(double t0, double t1, AABB& b0, AABB& b1) const override {
+            // the transform is linear, so moving both end boxes stays conservative
+            object->motion_bounds(t0, t1, b0, b1);
+            b0 = to_world.transform_box(b0);
+            b1 = to_world.transform_box(b1);
+        }
+
+        bool contains_media() const override { return object->contains_media(); }
+        double surface_area() const override { return area_scale * object->surface_area(); }
+
+        // Light sampling goes through the object's own pdf. Exact for rigid
+        // transforms; scaling would also change the solid angle.
+        double pdf_value(const point4& origin, const vec4& dir) const override {
+            return object->pdf_value(to_object.point(origin), to_object.vector(dir));
+        }
+
+        vec4 random(const point4& origin) const override {
+            return to_world.vector(object->random(to_object.point(origin)));
+        }
+
+        const Mat34& matrix() const { return to_world; }
+
+    private:
+        shared_ptr<Hittable> object;
+        Mat34 to_world;
+        Mat34 to_object;
+        AABB bbox;
+        double area_scale;
+};
+
+// Shorthands. Each returns a Transform, so chains like
+// translated(rotated(obj, 15, Y), offset) end up as a single matrix.
+inline shared_ptr<Transform> translated(shared_ptr<Hittable> object, const vec4& offset) {
+    return make_scene_shared<Transform>(object, Mat34::translation(offset));
+}
+
+inline shared_ptr<Transform> rotated(shared_ptr<Hittable> object, double degrees, int axis) {
+    return make_scene_shared<Transform>(object, Mat34::rotation(axis, degrees));
+}
+
+inline shared_ptr<Transform> scaled(shared_ptr<Hittable> object, const vec4& factors) {
+    return make_scene_shared<Transform>(object, Mat34::scaling(factors));
+}
+
+#endif
@@ -3,16 +3,77 @@
 
 #include "hittable.h"
 
+// Ray prepared for the watertight triangle test of Woop, Benthin & Wald
+// (2013): axes are permuted so z is the dominant direction, and the shear
+// (sx, sy, sz) maps the ray onto the +z axis. Edge functions are then 2D and
+// computed from the same products for both triangles sharing an edge, so a
+// ray can never slip between them.
+struct WatertightRay {
+    int kx, ky, kz;
+    double sx, sy, sz;
+
+    WatertightRay(const vec4& d) {
+        kz = 0;
+        if (std::fabs(d[1]) > std::fabs(d[kz])) kz = 1;
+        if (std::fabs(d[2]) > std::fabs(d[kz])) kz = 2;
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (d[kz] < 0) std::swap(kx, ky); // keep the winding
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1.0 / d[kz];
+    }
+};
+
+// Watertight ray/triangle test. b0, b1, b2 are the barycentric weights of
+// p0, p1, p2. Edges are inclusive, so hits on a shared edge report either
+// triangle but never neither.
+inline bool hit_triangle(const WatertightRay& wr, const point4& o, const point4& p0,
+                         const point4& p1, const point4& p2, Interval ray_t,
+                         double& t, double& b0, double& b1, double& b2) {
+    vec4 a = p0 - o, b = p1 - o, c = p2 - o;
+    double ax = a[wr.kx] - wr.sx * a[wr.kz], ay = a[wr.ky] - wr.sy * a[wr.kz];
+    double bx = b[wr.kx] - wr.sx * b[wr.kz], by = b[wr.ky] - wr.sy * b[wr.kz];
+    double cx = c[wr.kx] - wr.sx * c[wr.kz], cy = c[wr.ky] - wr.sy * c[wr.kz];
+
+    double u = cx * by - cy * bx;
+    double v = ax * cy - ay * cx;
+    double w = bx * ay - by * ax;
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+
+    double det = u + v + w;
+    if (det == 0) return false;
+
+    double T = u * wr.sz * a[wr.kz] + v * wr.sz * b[wr.kz] + w * wr.sz * c[wr.kz];
+    t = T / det;
+    if (!ray_t.surrounds(t)) return false;
+
+    b0 = u / det;
+    b1 = v / det;
+    b2 = w / det;
+    return true;
+}
+
+// dp/du and dp/dv across a triangle from its corners and their uvs (ti[k] =
+// {u, v} of corner k); left zero when the uvs don't span an area
+inline void triangle_uv_derivatives(const point4& p0, const point4& p1, const point4& p2,
+                                    const double ti[3][2], vec4& dpdu, vec4& dpdv) {
+    double du02 = ti[0][0] - ti[2][0], dv02 = ti[0][1] - ti[2][1];
+    double du12 = ti[1][0] - ti[2][0], dv12 = ti[1][1] - ti[2][1];
+    double det = du02 * dv12 - dv02 * du12;
+    if (std::fabs(det) < 1e-12) return;
+    vec4 dp02 = p0 - p2, dp12 = p1 - p2;
+    dpdu = (dv12 * dp02 - dv02 * dp12) / det;
+    dpdv = (du02 * dp12 - du12 * dp02) / det;
+}
+
 // setup like general quads, but different
-class Triangle : public Hittable {
+class Triangle final : public Hittable {
   public:
     Triangle(const point4& Q, const vec4& u, const vec4& v, shared_ptr<Material> mat)
-      : Q(Q), u(u), v(v), mat(mat)
+      : Q(Q), u(u), v(v), p1(Q + u), p2(Q + v), mat_id(material_id(mat))
     {
-        auto n = cross(u,v);
-        normal = unit_vector(n); // normal of plane (quad)
-        D = dot(normal, Q); // Q lies on plane, which is enough to solve for D
-        w = n / dot(n, n); // unit normal
+        normal = unit_vector(cross(u,v)); // normal of plane (quad)
         set_bounding_box();
     }
 
@@ -26,53 +87,61 @@ class Triangle : public Hittable {
     }
 
     AABB bounding_box() const override { return bbox; }
+    double surface_area() const override { return 0.5 * cross(u, v).norm(); }
+    uint32_t light_material() const override { return mat_id; }
+    vec4 normal_bounds(double& cos_theta) const override {
+        cos_theta = 1;
+        return normal;
+    }
 
-    bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
-        auto denom = dot(normal, r.d());
+    double pdf_value(const point4& origin, const vec4& dir) const override {
+        Hit rec;
+        if (!this->hit(Ray(origin, dir), Interval(0.001, infinity), rec)) {
+            return 0.0;
+        }
+        auto distance_squared = rec.t * rec.t * dir.norm2();
+        auto cosine = std::fabs(dot(dir, normal) / dir.norm());
 
-        // ray parallel to plane case: no hit
-        if (std::fabs(denom) < 1e-8) { return false; }
+        return distance_squared / (cosine * surface_area());
+    }
 
-        // no hit when 't' is outside the ray interval
-        auto t = (D - dot(normal, r.o())) / denom;
-        if (!ray_t.contains(t)) { return false; }
+    vec4 random(const point4& origin) const override {
+        // uniform barycentrics: fold the unit square onto the triangle
+        auto a = gen_random_double();
+        auto b = gen_random_double();
+        if (a + b > 1) { a = 1 - a; b = 1 - b; }
+        return Q + (a * u) + (b * v) - origin;
+    }
 
-        auto intersection = r.at(t); // hits plane
-        vec4 planar_hit_vec = intersection - Q; // P - Q
-        auto alpha = dot(w, cross(planar_hit_vec, v));
-        auto beta  = dot(w, cross(u, planar_hit_vec));
+    bool hit(const Ray& r, Interval ray_t, Hit& rec) const override {
+        // watertight test against the stored corners; adjacent triangles
+        // built from the same points don't leak along their shared edge
+        double t, b0, alpha, beta;
+        if (!hit_triangle(WatertightRay(r.d()), r.o(), Q, p1, p2, ray_t, t, b0, alpha, beta))
+            return false;
 
-        if (!is_interior(alpha, beta, rec)) { return false; }
-        
-        // fill out rec if valid intersection
         rec.t = t;
-        rec.p = intersection;
-        rec.mat = mat;
-        rec.set_face_normal(r, normal);
-
+        rec.u = alpha;
+        rec.v = beta;
+        rec.object = this;
         return true;
     }
 
-    virtual bool is_interior(double a, double b, Hit& rec) const {
-        // hit point is interior to primitive's region of plane
-        Interval unit_interval = Interval(0, 1);
-        if(!unit_interval.contains(a) || !unit_interval.contains(b) || !unit_interval.contains(a + b)) {
-            return false;
-        }
-
-        rec.u = a;
-        rec.v = b;
-        return true;
+    void surface(const Ray& r, Hit& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.mat_id = mat_id;
+        rec.set_face_normal(r, normal);
+        rec.dpdu = u; // u, v are the coordinates along the edges
+        rec.dpdv = v;
     }
 
   private:
     point4 Q;
     vec4 u, v;
-    vec4 w;
-    shared_ptr<Material> mat;
+    point4 p1, p2; // the other two corners, Q + u and Q + v
+    uint32_t mat_id;
     AABB bbox;
     vec4 normal;
-    double D;
 };
 
 #endif
\ No newline at end of file
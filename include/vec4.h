@@ -2,25 +2,31 @@
 #define VEC4_H
 
 #include "rtweekend.h"
+#include "simd.h"
 
-class vec4 {
+// Four-lane vector over the geometry precision `real` (rtweekend.h). The
+// arithmetic goes through vec4_ops<T> below, which is plain scalar code by
+// default and SSE / AVX where the lane type allows.
+template <typename T>
+class basic_vec4 {
   public:
-    double e[4];
+    typedef T scalar;
+    T e[4];
 
-    vec4() : e{0,0,0,0} {}
-    vec4(double e0, double e1, double e2) : e{e0, e1, e2, 0.0} {} // vec3
-    vec4(double e0, double e1, double e2, double e3) : e{e0, e1, e2, e3} {}
+    basic_vec4() : e{0,0,0,0} {}
+    basic_vec4(T e0, T e1, T e2) : e{e0, e1, e2, 0} {} // vec3
+    basic_vec4(T e0, T e1, T e2, T e3) : e{e0, e1, e2, e3} {}
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
-    double w() const { return e[3]; }
+    T x() const { return e[0]; }
+    T y() const { return e[1]; }
+    T z() const { return e[2]; }
+    T w() const { return e[3]; }
 
-    vec4 operator-() const { return vec4(-e[0], -e[1], -e[2], -e[3]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    basic_vec4 operator-() const { return basic_vec4(-e[0], -e[1], -e[2], -e[3]); }
+    T operator[](int i) const { return e[i]; }
+    T& operator[](int i) { return e[i]; }
 
-    vec4& operator+=(const vec4& v) {
+    basic_vec4& operator+=(const basic_vec4& v) {
         e[0] += v.e[0];
         e[1] += v.e[1];
         e[2] += v.e[2];
@@ -28,7 +34,7 @@ class vec4 {
         return *this;
     }
 
-    vec4& operator*=(double t) {
+    basic_vec4& operator*=(T t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
@@ -36,33 +42,33 @@ class vec4 {
         return *this;
     }
 
-    vec4& operator/=(double t) {
+    basic_vec4& operator/=(T t) {
         return *this *= 1/t;
     }
 
-    double norm() const {
+    T norm() const {
         return std::sqrt(norm2());
     }
 
-    double norm2() const { // squared norm
+    T norm2() const { // squared norm
         return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
     }
 
     bool near_zero() const {
-        double s = 1e-8;
+        T s = T(1e-8);
         return (std::fabs(e[0]) < s && std::fabs(e[1]) < s && std::fabs(e[2]) < s);
     }
 
-    static vec4 random() {
-        return vec4(
+    static basic_vec4 random() {
+        return basic_vec4(
             gen_random_double(),
             gen_random_double(),
             gen_random_double(),
             0.0);
     }
 
-    static vec4 random(double min, double max) {
-        return vec4(
+    static basic_vec4 random(double min, double max) {
+        return basic_vec4(
             gen_random_double(min, max),
             gen_random_double(min, max),
             gen_random_double(min, max),
@@ -71,77 +77,165 @@ class vec4 {
 
 };
 
+using vec4 = basic_vec4<real>;
+
 // point3 is just an alias for vec4, but useful for geometric clarity in the code.
 using point4 = vec4; // w component is locked to 1 here
 
 
+// Lane kernels. + and - keep u's w, dot ignores w and cross clears it.
+template <typename T>
+struct vec4_scalar_ops {
+    typedef basic_vec4<T> V;
+
+    static V add(const V& u, const V& v) {
+        return V(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2], u.e[3]);
+    }
+    static V sub(const V& u, const V& v) {
+        return V(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2], u.e[3]);
+    }
+    static V mul(const V& u, const V& v) {
+        return V(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2], u.e[3] * v.e[3]);
+    }
+    static V scale(const V& v, T t) {
+        return V(t*v.e[0], t*v.e[1], t*v.e[2], t*v.e[3]);
+    }
+    static T dot(const V& u, const V& v) {
+        return u.e[0] * v.e[0]
+             + u.e[1] * v.e[1]
+             + u.e[2] * v.e[2];
+             // + u.e[3] * v.e[3];
+    }
+    static V cross(const V& u, const V& v) {
+        return V(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                 u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                 u.e[0] * v.e[1] - u.e[1] * v.e[0],
+                 0);
+    }
+};
+
+template <typename T>
+struct vec4_ops : vec4_scalar_ops<T> {};
+
+#ifdef SIMD_SSE
+// Whole-register versions. Loads and stores are unaligned, so vec4s can sit
+// anywhere (std::vector, packed structs); in inlined code they mostly vanish.
+template <>
+struct vec4_ops<float> : vec4_scalar_ops<float> {
+    typedef basic_vec4<float> V;
+
+    static __m128 load(const V& v) { return _mm_loadu_ps(v.e); }
+    static V store(__m128 a) { V r; _mm_storeu_ps(r.e, a); return r; }
+    static __m128 xyz(__m128 a) { // zero the w lane
+        return _mm_and_ps(a, _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1)));
+    }
+
+    static V add(const V& u, const V& v) { return store(_mm_add_ps(load(u), xyz(load(v)))); }
+    static V sub(const V& u, const V& v) { return store(_mm_sub_ps(load(u), xyz(load(v)))); }
+    static V mul(const V& u, const V& v) { return store(_mm_mul_ps(load(u), load(v))); }
+    static V scale(const V& v, float t) { return store(_mm_mul_ps(load(v), _mm_set1_ps(t))); }
+
+    static float dot(const V& u, const V& v) {
+        // (x+y)+z like the scalar one, so results don't depend on the ISA
+        __m128 p = _mm_mul_ps(load(u), load(v));
+        __m128 s = _mm_add_ss(p, _mm_shuffle_ps(p, p, 1));
+        s = _mm_add_ss(s, _mm_movehl_ps(p, p));
+        return _mm_cvtss_f32(s);
+    }
+
+    static V cross(const V& u, const V& v) {
+        // u * v.yzx - u.yzx * v comes out in zxy order
+        __m128 a = load(u), b = load(v);
+        __m128 a1 = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+        __m128 b1 = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+        __m128 c = _mm_sub_ps(_mm_mul_ps(a, b1), _mm_mul_ps(a1, b));
+        return store(xyz(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1))));
+    }
+};
+#endif
+
+#ifdef SIMD_AVX
+// AVX1 has no cross-lane double shuffle, so cross stays scalar
+template <>
+struct vec4_ops<double> : vec4_scalar_ops<double> {
+    typedef basic_vec4<double> V;
+
+    static __m256d load(const V& v) { return _mm256_loadu_pd(v.e); }
+    static V store(__m256d a) { V r; _mm256_storeu_pd(r.e, a); return r; }
+    static __m256d xyz(__m256d a) {
+        return _mm256_and_pd(a, _mm256_castsi256_pd(_mm256_set_epi64x(0, -1, -1, -1)));
+    }
+
+    static V add(const V& u, const V& v) { return store(_mm256_add_pd(load(u), xyz(load(v)))); }
+    static V sub(const V& u, const V& v) { return store(_mm256_sub_pd(load(u), xyz(load(v)))); }
+    static V mul(const V& u, const V& v) { return store(_mm256_mul_pd(load(u), load(v))); }
+    static V scale(const V& v, double t) { return store(_mm256_mul_pd(load(v), _mm256_set1_pd(t))); }
+
+    static double dot(const V& u, const V& v) {
+        // (x+y)+z like the scalar one, so results don't depend on the ISA
+        __m256d p = _mm256_mul_pd(load(u), load(v));
+        __m128d xy = _mm256_castpd256_pd128(p);
+        __m128d s = _mm_add_sd(xy, _mm_unpackhi_pd(xy, xy));
+        s = _mm_add_sd(s, _mm256_extractf128_pd(p, 1));
+        return _mm_cvtsd_f64(s);
+    }
+};
+#endif
+
+
 // Vector Utility Functions
+//
+// Scalars are taken as basic_vec4<T>::scalar so T is deduced from the vector
+// alone and `2 * v` or `0.5 * v` work in either precision.
 
-inline std::ostream& operator<<(std::ostream& out, const vec4& v) {
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const basic_vec4<T>& v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2] << ' ' << v.e[3];
 }
 
-inline vec4 operator+(const vec4& u, const vec4& v) {
-    return vec4(
-        u.e[0] + v.e[0],
-        u.e[1] + v.e[1],
-        u.e[2] + v.e[2],
-        u.e[3]
-    );
+template <typename T>
+inline basic_vec4<T> operator+(const basic_vec4<T>& u, const basic_vec4<T>& v) {
+    return vec4_ops<T>::add(u, v);
 }
 
-inline vec4 operator-(const vec4& u, const vec4& v) {
-    return vec4(
-        u.e[0] - v.e[0],
-        u.e[1] - v.e[1],
-        u.e[2] - v.e[2],
-        u.e[3]
-    );
+template <typename T>
+inline basic_vec4<T> operator-(const basic_vec4<T>& u, const basic_vec4<T>& v) {
+    return vec4_ops<T>::sub(u, v);
 }
 
-inline vec4 operator*(const vec4& u, const vec4& v) {
-    return vec4(
-        u.e[0] * v.e[0],
-        u.e[1] * v.e[1],
-        u.e[2] * v.e[2],
-        u.e[3] * v.e[3]
-    );
+template <typename T>
+inline basic_vec4<T> operator*(const basic_vec4<T>& u, const basic_vec4<T>& v) {
+    return vec4_ops<T>::mul(u, v);
 }
 
-inline vec4 operator*(double t, const vec4& v) {
-    return vec4(
-        t*v.e[0],
-        t*v.e[1],
-        t*v.e[2],
-        t*v.e[3]
-    );
+template <typename T>
+inline basic_vec4<T> operator*(typename basic_vec4<T>::scalar t, const basic_vec4<T>& v) {
+    return vec4_ops<T>::scale(v, t);
 }
 
-inline vec4 operator*(const vec4& v, double t) {
-    return t * v;
+template <typename T>
+inline basic_vec4<T> operator*(const basic_vec4<T>& v, typename basic_vec4<T>::scalar t) {
+    return vec4_ops<T>::scale(v, t);
 }
 
-inline vec4 operator/(const vec4& v, double t) {
-    return (1/t) * v;
+template <typename T>
+inline basic_vec4<T> operator/(const basic_vec4<T>& v, typename basic_vec4<T>::scalar t) {
+    return vec4_ops<T>::scale(v, 1/t);
 }
 
-inline double dot(const vec4& u, const vec4& v) {
-    return u.e[0] * v.e[0]
-         + u.e[1] * v.e[1]
-         + u.e[2] * v.e[2];
-         // + u.e[3] * v.e[3];
+template <typename T>
+inline T dot(const basic_vec4<T>& u, const basic_vec4<T>& v) {
+    return vec4_ops<T>::dot(u, v);
 }
 
-inline vec4 cross(const vec4& u, const vec4& v) {
-    return vec4(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-                u.e[2] * v.e[0] - u.e[0] * v.e[2],
-                u.e[0] * v.e[1] - u.e[1] * v.e[0],
-                0.0
-    );
+template <typename T>
+inline basic_vec4<T> cross(const basic_vec4<T>& u, const basic_vec4<T>& v) {
+    return vec4_ops<T>::cross(u, v);
 }
 
-inline vec4 unit_vector(const vec4& v) {
-    return v / v.norm();
+template <typename T>
+inline basic_vec4<T> unit_vector(const basic_vec4<T>& v) {
+    return vec4_ops<T>::scale(v, 1 / std::sqrt(vec4_ops<T>::dot(v, v)));
 }
 
 inline vec4 random_in_unit_disk() {
@@ -5,9 +5,20 @@
 #include "camera.h"
 #include "material.h"
 #include "bvh.h"
+#include "sbvh.h"
+#include "motion.h"
+#include "bvh_stats.h"
 #include "texture.h"
 #include "primitives.h"
 #include "constant_medium.h"
+#include "grid_medium.h"
+#include "obj_loader.h"
+#include "ply_loader.h"
+#include "quantized_mesh.h"
+#include "paged_mesh.h"
+#include "primitive_pool.h"
+#include "transform.h"
+#include "compiled_scene.h"
 
 
 void set_camera_settings(Camera& cam) {
@@ -25,21 +36,17 @@ void set_camera_settings(Camera& cam) {
 
 void part1full() {
     HittableList world;
-auto empty_mat = shared_ptr<Material>();
-Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
-
-
-    auto material_ground = make_shared<Lambertian>(Color(0.8, 0.8, 0.0));
-    auto material_center = make_shared<Lambertian>(Color(0.1, 0.2, 0.5));
-    auto material_left   = make_shared<Dielectric>(1.50);
-    auto material_bubble = make_shared<Dielectric>(1.00 / 1.50);
-    auto material_right  = make_shared<Metal>(Color(0.8, 0.6, 0.2), 1.0);
-
-    world.add(make_shared<Sphere>(point4( 0.0, -100.5, -1.0), 100.0, material_ground));
-    world.add(make_shared<Sphere>(point4( 0.0,    0.0, -1.2),   0.5, material_center));
-    world.add(make_shared<Sphere>(point4(-1.0,    0.0, -1.0),   0.5, material_left));
-    world.add(make_shared<Sphere>(point4(-1.0,    0.0, -1.0),   0.4, material_bubble));
-    world.add(make_shared<Sphere>(point4( 1.0,    0.0, -1.0),   0.5, material_right));
+    auto material_ground = make_scene_shared<Lambertian>(Color(0.8, 0.8, 0.0));
+    auto material_center = make_scene_shared<Lambertian>(Color(0.1, 0.2, 0.5));
+    auto material_left   = make_scene_shared<Dielectric>(1.50);
+    auto material_bubble = make_scene_shared<Dielectric>(1.00 / 1.50);
+    auto material_right  = make_scene_shared<Metal>(Color(0.8, 0.6, 0.2), 1.0);
+
+    world.add(make_scene_shared<Sphere>(point4( 0.0, -100.5, -1.0), 100.0, material_ground));
+    world.add(make_scene_shared<Sphere>(point4( 0.0,    0.0, -1.2),   0.5, material_center));
+    world.add(make_scene_shared<Sphere>(point4(-1.0,    0.0, -1.0),   0.5, material_left));
+    world.add(make_scene_shared<Sphere>(point4(-1.0,    0.0, -1.0),   0.4, material_bubble));
+    world.add(make_scene_shared<Sphere>(point4( 1.0,    0.0, -1.0),   0.5, material_right));
 
     Camera cam;
     // intrinsics
@@ -55,20 +62,20 @@ Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
     // depth of field effect
     cam.defocus_angle = 10.0;
     cam.focus_dist = 3.4;
-    cam.render(world, lights);
+    cam.render(world);
 }
 
 // 14. Final Render
 void bouncing_spheres() {
     HittableList world;
-auto empty_mat = shared_ptr<Material>();
-Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
-
-
-    // auto ground_material = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
-    auto checker = make_shared<CheckeredTexture>(0.32, Color(.2,.3,.1), Color(.9,.9,.9));
-    world.add(make_shared<Sphere>(point4(0,-1000,0), 1000, make_shared<Lambertian>(checker)));
-
+    // auto ground_material = make_scene_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+    auto checker = make_scene_shared<CheckeredTexture>(0.32, Color(.2,.3,.1), Color(.9,.9,.9));
+    world.add(make_scene_shared<Sphere>(point4(0,-1000,0), 1000, make_scene_shared<Lambertian>(checker)));
+
+    // the small spheres go in one SoA pool instead of ~480 objects; its
+    // nodes keep their bounds at both ends of the shutter, so moving
+    // spheres are culled where they are at each ray's time
+    auto small_spheres = make_scene_shared<SpherePool>();
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
             auto choose_mat = gen_random_double();
@@ -80,35 +87,37 @@ Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
                 if (choose_mat < 0.8) {
                     // diffuse
                     auto albedo = Color::random() * Color::random();
-                    Sphere_material = make_shared<Lambertian>(albedo);
+                    Sphere_material = make_scene_shared<Lambertian>(albedo);
                     auto center2 = center + vec4(0, gen_random_double(0, .5), 0);
-                    world.add(make_shared<Sphere>(center, center2, 0.2, Sphere_material));
+                    small_spheres->add(center, center2, 0.2, Sphere_material);
                 } else if (choose_mat < 0.95) {
                     // Metal
                     auto albedo = Color::random(0.5, 1);
                     auto fuzz = gen_random_double(0, 0.5);
-                    Sphere_material = make_shared<Metal>(albedo, fuzz);
-                    world.add(make_shared<Sphere>(center, 0.2, Sphere_material));
+                    Sphere_material = make_scene_shared<Metal>(albedo, fuzz);
+                    small_spheres->add(center, 0.2, Sphere_material);
                 } else {
                     // glass
-                    Sphere_material = make_shared<Dielectric>(1.5);
-                    world.add(make_shared<Sphere>(center, 0.2, Sphere_material));
+                    Sphere_material = make_scene_shared<Dielectric>(1.5);
+                    small_spheres->add(center, 0.2, Sphere_material);
                 }
             }
         }
     }
+    small_spheres->build();
+    world.add(small_spheres);
 
-    auto material1 = make_shared<Dielectric>(1.5);
-    world.add(make_shared<Sphere>(point4(0, 1, 0), 1.0, material1));
+    auto material1 = make_scene_shared<Dielectric>(1.5);
+    world.add(make_scene_shared<Sphere>(point4(0, 1, 0), 1.0, material1));
 
-    auto material2 = make_shared<Lambertian>(Color(0.4, 0.2, 0.1));
-    world.add(make_shared<Sphere>(point4(-4, 1, 0), 1.0, material2));
+    auto material2 = make_scene_shared<Lambertian>(Color(0.4, 0.2, 0.1));
+    world.add(make_scene_shared<Sphere>(point4(-4, 1, 0), 1.0, material2));
 
-    auto material3 = make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<Sphere>(point4(4, 1, 0), 1.0, material3));
+    auto material3 = make_scene_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0);
+    world.add(make_scene_shared<Sphere>(point4(4, 1, 0), 1.0, material3));
 
-    // structure objects as BVH
-    world = HittableList(make_shared<BVH_node>(world));
+    // structure objects as BVH, bounded per ray time (the pool moves too)
+    world = HittableList(make_scene_shared<MotionBVH>(world));
     
     Camera cam;
     cam.aspect_ratio      = 16.0 / 9.0;
@@ -124,19 +133,15 @@ Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
     cam.defocus_angle = 0.6;
     cam.focus_dist    = 10.0;
 
-    cam.render(world, lights);
+    cam.render(world);
 }
 
 void checkered_spheres() {
     HittableList world;
-auto empty_mat = shared_ptr<Material>();
-Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
-
-
-    auto checker = make_shared<CheckeredTexture>(0.32, Color(.2, .3, .1), Color(.9, .9, .9));
+    auto checker = make_scene_shared<CheckeredTexture>(0.32, Color(.2, .3, .1), Color(.9, .9, .9));
 
-    world.add(make_shared<Sphere>(point4(0,-10, 0), 10, make_shared<Lambertian>(checker)));
-    world.add(make_shared<Sphere>(point4(0, 10, 0), 10, make_shared<Lambertian>(checker)));
+    world.add(make_scene_shared<Sphere>(point4(0,-10, 0), 10, make_scene_shared<Lambertian>(checker)));
+    world.add(make_scene_shared<Sphere>(point4(0, 10, 0), 10, make_scene_shared<Lambertian>(checker)));
 
     Camera cam;
     cam.aspect_ratio      = 16.0 / 9.0;
@@ -150,24 +155,20 @@ Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
     cam.vup      = vec4(0,1,0);
     cam.defocus_angle = 0;
 
-    cam.render(world, lights);
+    cam.render(world);
 }
 
 void debug_spheres() {
     HittableList world;
-auto empty_mat = shared_ptr<Material>();
-Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
-
-
     auto R = std::cos(pi/4);
 
-    auto material_left  = make_shared<Lambertian>(Color(0,0,1));
-    auto material_right = make_shared<Lambertian>(Color(1,0,0));
+    auto material_left  = make_scene_shared<Lambertian>(Color(0,0,1));
+    auto material_right = make_scene_shared<Lambertian>(Color(1,0,0));
 
-    world.add(make_shared<Sphere>(point4(-R, 0, -1), R, material_left));
-    world.add(make_shared<Sphere>(point4( R, 0, -1), R, material_right));
+    world.add(make_scene_shared<Sphere>(point4(-R, 0, -1), R, material_left));
+    world.add(make_scene_shared<Sphere>(point4( R, 0, -1), R, material_right));
 
-    world = HittableList(make_shared<BVH_node>(world));
+    world = HittableList(make_scene_shared<BVH_node>(world));
 
     Camera cam;
 
@@ -185,17 +186,13 @@ Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
 
     cam.defocus_angle = 0;
 
-    cam.render(world, lights);
+    cam.render(world);
 }
 
 void earth() {
-    auto earth_texture = make_shared<ImageTexture>("src/earthmap.jpg");
-    auto earth_surface = make_shared<Lambertian>(earth_texture);
-    auto globe = make_shared<Sphere>(point4(0,0,0), 2, earth_surface);
-    auto empty_mat = shared_ptr<Material>();
-    Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
-
-
+    auto earth_texture = make_scene_shared<ImageTexture>("src/earthmap.jpg");
+    auto earth_surface = make_scene_shared<Lambertian>(earth_texture);
+    auto globe = make_scene_shared<Sphere>(point4(0,0,0), 2, earth_surface);
     Camera cam;
     // set_camera_settings(cam);
     cam.aspect_ratio      = 16.0 / 9.0;
@@ -208,43 +205,36 @@ void earth() {
     cam.lookat   = point4(0,0,0);
     cam.vup      = vec4(0,1,0);
     cam.defocus_angle = 0;
-    cam.render(HittableList(globe), lights);
+    cam.render(HittableList(globe));
+    TextureCache::global().stats().print(std::clog);
 }
 
 void perlin_spheres() {
     HittableList world;
-auto empty_mat = shared_ptr<Material>();
-Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
-
-
-    auto perlin_texture = make_shared<NoiseTexture>(4);
-    world.add(make_shared<Sphere>(point4(0,-1000,0), 1000, make_shared<Lambertian>(perlin_texture)));
-    world.add(make_shared<Sphere>(point4(0,2,0), 2, make_shared<Lambertian>(perlin_texture)));
+    auto perlin_texture = make_scene_shared<NoiseTexture>(4);
+    world.add(make_scene_shared<Sphere>(point4(0,-1000,0), 1000, make_scene_shared<Lambertian>(perlin_texture)));
+    world.add(make_scene_shared<Sphere>(point4(0,2,0), 2, make_scene_shared<Lambertian>(perlin_texture)));
 
     Camera cam;
     set_camera_settings(cam);
-    cam.render(world, lights);
+    cam.render(world);
 }
 
 void quads() {
     HittableList world;
-auto empty_mat = shared_ptr<Material>();
-Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
-
-
     // Materials
-    auto left_red     = make_shared<Lambertian>(Color(1.0, 0.2, 0.2));
-    auto back_green   = make_shared<Lambertian>(Color(0.2, 1.0, 0.2));
-    auto right_blue   = make_shared<Lambertian>(Color(0.2, 0.2, 1.0));
-    auto upper_orange = make_shared<Lambertian>(Color(1.0, 0.5, 0.0));
-    auto lower_teal   = make_shared<Lambertian>(Color(0.2, 0.8, 0.8));
+    auto left_red     = make_scene_shared<Lambertian>(Color(1.0, 0.2, 0.2));
+    auto back_green   = make_scene_shared<Lambertian>(Color(0.2, 1.0, 0.2));
+    auto right_blue   = make_scene_shared<Lambertian>(Color(0.2, 0.2, 1.0));
+    auto upper_orange = make_scene_shared<Lambertian>(Color(1.0, 0.5, 0.0));
+    auto lower_teal   = make_scene_shared<Lambertian>(Color(0.2, 0.8, 0.8));
 
     // Quads
-    world.add(make_shared<Quad>(point4(-3,-2, 5), vec4(0, 0,-4), vec4(0, 4, 0), left_red));
-    world.add(make_shared<Quad>(point4(-2,-2, 0), vec4(4, 0, 0), vec4(0, 4, 0), back_green));
-    world.add(make_shared<Quad>(point4( 3,-2, 1), vec4(0, 0, 4), vec4(0, 4, 0), right_blue));
-    world.add(make_shared<Quad>(point4(-2, 3, 1), vec4(4, 0, 0), vec4(0, 0, 4), upper_orange));
-    world.add(make_shared<Quad>(point4(-2,-3, 5), vec4(4, 0, 0), vec4(0, 0,-4), lower_teal));
+    world.add(make_scene_shared<Quad>(point4(-3,-2, 5), vec4(0, 0,-4), vec4(0, 4, 0), left_red));
+    world.add(make_scene_shared<Quad>(point4(-2,-2, 0), vec4(4, 0, 0), vec4(0, 4, 0), back_green));
+    world.add(make_scene_shared<Quad>(point4( 3,-2, 1), vec4(0, 0, 4), vec4(0, 4, 0), right_blue));
+    world.add(make_scene_shared<Quad>(point4(-2, 3, 1), vec4(4, 0, 0), vec4(0, 0, 4), upper_orange));
+    world.add(make_scene_shared<Quad>(point4(-2,-3, 5), vec4(4, 0, 0), vec4(0, 0,-4), lower_teal));
 
     Camera cam;
 
@@ -261,21 +251,17 @@ Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
     cam.defocus_angle = 0;
     cam.background = Color(0.70, 0.80, 1.00);
 
-    cam.render(world, lights);
+    cam.render(world);
 }
 
 void simple_light() {
     HittableList world;
-auto empty_mat = shared_ptr<Material>();
-Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
-
-
-    auto pertext = make_shared<NoiseTexture>(4);
-    world.add(make_shared<Sphere>(point4(0,-1000,0), 1000, make_shared<Lambertian>(pertext)));
-    world.add(make_shared<Sphere>(point4(0,2,0), 2, make_shared<Lambertian>(pertext)));
-    auto difflight = make_shared<DiffuseLight>(Color(4,4,4));
-    world.add(make_shared<Sphere>(point4(0,7,0), 2, difflight));
-    world.add(make_shared<Quad>(point4(3,1,-2), vec4(2,0,0), vec4(0,2,0), difflight));
+    auto pertext = make_scene_shared<NoiseTexture>(4);
+    world.add(make_scene_shared<Sphere>(point4(0,-1000,0), 1000, make_scene_shared<Lambertian>(pertext)));
+    world.add(make_scene_shared<Sphere>(point4(0,2,0), 2, make_scene_shared<Lambertian>(pertext)));
+    auto difflight = make_scene_shared<DiffuseLight>(Color(4,4,4));
+    world.add(make_scene_shared<Sphere>(point4(0,7,0), 2, difflight));
+    world.add(make_scene_shared<Quad>(point4(3,1,-2), vec4(2,0,0), vec4(0,2,0), difflight));
 
     Camera cam;
 
@@ -292,45 +278,127 @@ Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
 
     cam.defocus_angle = 0;
 
-    cam.render(world, lights);
+    cam.render(world);
 }
 
 void cornell_box() {
     HittableList world;
 
-    auto red   = make_shared<Lambertian>(Color(.65, .05, .05));
-    auto white = make_shared<Lambertian>(Color(.73, .73, .73));
-    auto green = make_shared<Lambertian>(Color(.12, .45, .15));
-    auto light = make_shared<DiffuseLight>(Color(15, 15, 15));
-
-    world.add(make_shared<Quad>(point4(555,0,0), vec4(0,555,0), vec4(0,0,555), green));
-    world.add(make_shared<Quad>(point4(0,0,0), vec4(0,555,0), vec4(0,0,555), red));
-    world.add(make_shared<Quad>(point4(343, 554, 332), vec4(-130,0,0), vec4(0,0,-105), light));
-    world.add(make_shared<Quad>(point4(0,0,0), vec4(555,0,0), vec4(0,0,555), white));
-    world.add(make_shared<Quad>(point4(555,555,555), vec4(-555,0,0), vec4(0,0,-555), white));
-    world.add(make_shared<Quad>(point4(0,0,555), vec4(555,0,0), vec4(0,555,0), white));
-
-    shared_ptr<Material> aluminum = make_shared<Metal>(Color(0.8, 0.85, 0.88), 0.0);
-    shared_ptr<Hittable> box1 = box(point4(0,0,0), point4(165,330,165), white);
-    box1 = make_shared<Rotate_y>(box1, 15);
-    box1 = make_shared<Translate>(box1, vec4(265,0,295));
+    auto red   = make_scene_shared<Lambertian>(Color(.65, .05, .05));
+    auto white = make_scene_shared<Lambertian>(Color(.73, .73, .73));
+    auto green = make_scene_shared<Lambertian>(Color(.12, .45, .15));
+    auto light = make_scene_shared<DiffuseLight>(Color(15, 15, 15));
+
+    world.add(make_scene_shared<Quad>(point4(555,0,0), vec4(0,555,0), vec4(0,0,555), green));
+    world.add(make_scene_shared<Quad>(point4(0,0,0), vec4(0,555,0), vec4(0,0,555), red));
+    world.add(make_scene_shared<Quad>(point4(343, 554, 332), vec4(-130,0,0), vec4(0,0,-105), light));
+    world.add(make_scene_shared<Quad>(point4(0,0,0), vec4(555,0,0), vec4(0,0,555), white));
+    world.add(make_scene_shared<Quad>(point4(555,555,555), vec4(-555,0,0), vec4(0,0,-555), white));
+    world.add(make_scene_shared<Quad>(point4(0,0,555), vec4(555,0,0), vec4(0,555,0), white));
+
+    shared_ptr<Material> aluminum = make_scene_shared<Metal>(Color(0.8, 0.85, 0.88), 0.0);
+    shared_ptr<Hittable> box1 = rotated_box(point4(0,0,0), point4(165,330,165), 15, vec4(265,0,295), white);
     world.add(box1);
 
     // shared_ptr<Hittable> box2 = box(point4(0,0,0), point4(165,165,165), white);
-    // // shared_ptr<Hittable> box2 = make_shared<Sphere>(point4(85,85,85), 50, white);
-    // box2 = make_shared<Rotate_y>(box2, -18);
-    // box2 = make_shared<Translate>(box2, vec4(130,0,65));
+    // // shared_ptr<Hittable> box2 = make_scene_shared<Sphere>(point4(85,85,85), 50, white);
+    // box2 = make_scene_shared<Rotate_y>(box2, -18);
+    // box2 = make_scene_shared<Translate>(box2, vec4(130,0,65));
     // world.add(box2);
 
-    auto glass = make_shared<Dielectric>(1.5);
-    world.add(make_shared<Sphere>(point4(190,90,190), 90, glass));
+    auto glass = make_scene_shared<Dielectric>(1.5);
+    world.add(make_scene_shared<Sphere>(point4(190,90,190), 90, glass));
 
-    auto empty_mat = shared_ptr<Material>();
-    
-    HittableList lights;
-    lights.add(make_shared<Quad>(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat));
-    lights.add(make_shared<Sphere>(point4(190, 90, 190), 90, empty_mat));
-    world = HittableList(make_shared<BVH_node>(world));
+    // the big walls overlap everything, so let the builder split them
+    auto compiled = make_scene_shared<CompiledScene>(world);
+    #ifdef BVH_REPORT
+      bvh_stats(*compiled).print(std::clog);
+    #endif
+    world = HittableList(compiled);
+
+    Camera cam;
+
+    cam.aspect_ratio      = 1.0;
+    cam.image_width       = 600;
+    cam.samples_per_pixel = 100;
+    cam.max_depth         = 50;
+    cam.background        = Color(0,0,0);
+
+    cam.fovy     = 40;
+    cam.lookfrom = point4(278, 278, -800);
+    cam.lookat   = point4(278, 278, 0);
+    cam.vup      = vec4(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    cam.render(world);
+}
+
+enum class MeshStorage {
+    flat,      // TriangleMesh in memory
+    quantized, // QuantizedMesh, about half the memory
+    paged      // PagedMesh: clusters paged in from disk under a memory cap
+};
+
+void mesh_model(const std::string& filename, MeshStorage storage = MeshStorage::flat) {
+    HittableList world;
+
+    auto red   = make_scene_shared<Lambertian>(Color(.65, .05, .05));
+    auto white = make_scene_shared<Lambertian>(Color(.73, .73, .73));
+    auto green = make_scene_shared<Lambertian>(Color(.12, .45, .15));
+    auto light = make_scene_shared<DiffuseLight>(Color(15, 15, 15));
+
+    world.add(make_scene_shared<Quad>(point4(555,0,0), vec4(0,555,0), vec4(0,0,555), green));
+    world.add(make_scene_shared<Quad>(point4(0,0,0), vec4(0,555,0), vec4(0,0,555), red));
+    world.add(make_scene_shared<Quad>(point4(343, 554, 332), vec4(-130,0,0), vec4(0,0,-105), light));
+    world.add(make_scene_shared<Quad>(point4(0,0,0), vec4(555,0,0), vec4(0,0,555), white));
+    world.add(make_scene_shared<Quad>(point4(555,555,555), vec4(-555,0,0), vec4(0,0,-555), white));
+    world.add(make_scene_shared<Quad>(point4(0,0,555), vec4(555,0,0), vec4(0,555,0), white));
+
+    // scale the model to fit the box and stand it on the floor
+    bool ply = filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".ply") == 0;
+    // the vertices move below, so the face BVH is built once, after that
+    ObjLoadOptions obj_options;
+    obj_options.build = false;
+    PlyLoadOptions ply_options;
+    ply_options.build = false;
+    auto mesh = ply ? load_ply(filename, white, ply_options) : load_obj(filename, white, obj_options);
+    shared_ptr<PagedMesh> paged;
+    if (mesh) {
+        std::clog << "Loaded " << mesh->face_count() << " triangles ("
+                  << mesh->memory_bytes() / (1024 * 1024) << " MB)\n";
+        AABB b; // of the vertices; the mesh has no BVH (or box) yet
+        for (const auto& p : mesh->positions) {
+            b.x = Interval(b.x, Interval(p.x, p.x));
+            b.y = Interval(b.y, Interval(p.y, p.y));
+            b.z = Interval(b.z, Interval(p.z, p.z));
+        }
+        double extent = std::max(b.x.size(), std::max(b.y.size(), b.z.size()));
+        double scale = (extent > 0) ? 350 / extent : 1;
+        for (auto& p : mesh->positions) {
+            p.x = float((p.x - b.x.min - 0.5 * b.x.size()) * scale + 278);
+            p.y = float((p.y - b.y.min) * scale);
+            p.z = float((p.z - b.z.min - 0.5 * b.z.size()) * scale + 278);
+        }
+        if (storage == MeshStorage::quantized) {
+            auto quantized = make_scene_shared<QuantizedMesh>(*mesh);
+            std::clog << "Compressed to " << quantized->memory_bytes() / (1024 * 1024) << " MB\n";
+            mesh.reset(); // the float copy isn't needed to render
+            world.add(quantized);
+        } else if (storage == MeshStorage::paged) {
+            paged = PagedMesh::create(*mesh, filename + ".pages");
+            if (paged) {
+                std::clog << "Paged into " << paged->cluster_count() << " clusters\n";
+                mesh.reset(); // only the clusters on disk are left
+                world.add(paged);
+            }
+        } else {
+            mesh->build();
+            world.add(mesh);
+        }
+    }
+
+    world = HittableList(make_scene_shared<BVH_node>(world));
 
     Camera cam;
 
@@ -347,37 +415,83 @@ void cornell_box() {
 
     cam.defocus_angle = 0;
 
-    cam.render(world, lights);
+    cam.render(world);
+    if (paged) paged->stats().print(std::clog);
 }
 
 void cornell_smoke() {
     HittableList world;
-auto empty_mat = shared_ptr<Material>();
-Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
+    auto red   = make_scene_shared<Lambertian>(Color(.65, .05, .05));
+    auto white = make_scene_shared<Lambertian>(Color(.73, .73, .73));
+    auto green = make_scene_shared<Lambertian>(Color(.12, .45, .15));
+    auto light = make_scene_shared<DiffuseLight>(Color(7, 7, 7));
+
+    world.add(make_scene_shared<Quad>(point4(555,0,0), vec4(0,555,0), vec4(0,0,555), green));
+    world.add(make_scene_shared<Quad>(point4(0,0,0), vec4(0,555,0), vec4(0,0,555), red));
+    world.add(make_scene_shared<Quad>(point4(113,554,127), vec4(330,0,0), vec4(0,0,305), light));
+    world.add(make_scene_shared<Quad>(point4(0,555,0), vec4(555,0,0), vec4(0,0,555), white));
+    world.add(make_scene_shared<Quad>(point4(0,0,0), vec4(555,0,0), vec4(0,0,555), white));
+    world.add(make_scene_shared<Quad>(point4(0,0,555), vec4(555,0,0), vec4(0,555,0), white));
+
+    shared_ptr<Hittable> box1 = rotated_box(point4(0,0,0), point4(165,330,165), 15, vec4(265,0,295), white);
+    shared_ptr<Hittable> box2 = rotated_box(point4(0,0,0), point4(165,165,165), -18, vec4(130,0,65), white);
 
+    world.add(make_scene_shared<ConstantMedium>(box1, 0.01, Color(0,0,0)));
+    world.add(make_scene_shared<ConstantMedium>(box2, 0.01, Color(1,1,1)));
 
-    auto red   = make_shared<Lambertian>(Color(.65, .05, .05));
-    auto white = make_shared<Lambertian>(Color(.73, .73, .73));
-    auto green = make_shared<Lambertian>(Color(.12, .45, .15));
-    auto light = make_shared<DiffuseLight>(Color(7, 7, 7));
+    Camera cam;
+
+    cam.aspect_ratio      = 1.0;
+    cam.image_width       = 600;
+    cam.samples_per_pixel = 200;
+    cam.max_depth         = 50;
+    cam.background        = Color(0,0,0);
+
+    cam.fovy     = 40;
+    cam.lookfrom = point4(278, 278, -800);
+    cam.lookat   = point4(278, 278, 0);
+    cam.vup      = vec4(0,1,0);
 
-    world.add(make_shared<Quad>(point4(555,0,0), vec4(0,555,0), vec4(0,0,555), green));
-    world.add(make_shared<Quad>(point4(0,0,0), vec4(0,555,0), vec4(0,0,555), red));
-    world.add(make_shared<Quad>(point4(113,554,127), vec4(330,0,0), vec4(0,0,305), light));
-    world.add(make_shared<Quad>(point4(0,555,0), vec4(555,0,0), vec4(0,0,555), white));
-    world.add(make_shared<Quad>(point4(0,0,0), vec4(555,0,0), vec4(0,0,555), white));
-    world.add(make_shared<Quad>(point4(0,0,555), vec4(555,0,0), vec4(0,555,0), white));
+    cam.defocus_angle = 0;
 
-    shared_ptr<Hittable> box1 = box(point4(0,0,0), point4(165,330,165), white);
-    box1 = make_shared<Rotate_y>(box1, 15);
-    box1 = make_shared<Translate>(box1, vec4(265,0,295));
+    cam.render(world);
+}
 
-    shared_ptr<Hittable> box2 = box(point4(0,0,0), point4(165,165,165), white);
-    box2 = make_shared<Rotate_y>(box2, -18);
-    box2 = make_shared<Translate>(box2, vec4(130,0,65));
+// Cornell box with two voxel clouds: one made here from noise, one read
+// from a raw file of nx * ny * nz floats (e.g. exported from a VDB). If the
+// file's missing, that cloud is just left out.
+void cornell_clouds(const char* voxel_file, int nx, int ny, int nz) {
+    HittableList world;
+    auto red   = make_scene_shared<Lambertian>(Color(.65, .05, .05));
+    auto white = make_scene_shared<Lambertian>(Color(.73, .73, .73));
+    auto green = make_scene_shared<Lambertian>(Color(.12, .45, .15));
+    auto light = make_scene_shared<DiffuseLight>(Color(7, 7, 7));
+
+    world.add(make_scene_shared<Quad>(point4(555,0,0), vec4(0,555,0), vec4(0,0,555), green));
+    world.add(make_scene_shared<Quad>(point4(0,0,0), vec4(0,555,0), vec4(0,0,555), red));
+    world.add(make_scene_shared<Quad>(point4(113,554,127), vec4(330,0,0), vec4(0,0,305), light));
+    world.add(make_scene_shared<Quad>(point4(0,555,0), vec4(555,0,0), vec4(0,0,555), white));
+    world.add(make_scene_shared<Quad>(point4(0,0,0), vec4(555,0,0), vec4(0,0,555), white));
+    world.add(make_scene_shared<Quad>(point4(0,0,555), vec4(555,0,0), vec4(0,555,0), white));
+
+    // a turbulent puff fading out toward the grid's edges; the corners
+    // are zero, so those bricks aren't stored
+    const int n = 64;
+    Perlin noise;
+    std::vector<float> density(size_t(n) * n * n);
+    for (int z = 0; z < n; z++)
+        for (int y = 0; y < n; y++)
+            for (int x = 0; x < n; x++) {
+                point4 p((x + 0.5) / n - 0.5, (y + 0.5) / n - 0.5, (z + 0.5) / n - 0.5);
+                double falloff = 1 - 4 * p.norm2();
+                if (falloff <= 0) continue;
+                density[(size_t(z) * n + y) * n + x] = float(falloff * noise.turb(8 * p, 5));
+            }
+    AABB puff(point4(60,40,180), point4(300,280,420));
+    world.add(make_scene_shared<GridMedium>(puff, n, n, n, density, 0.2, Color(.9,.9,.9)));
 
-    world.add(make_shared<ConstantMedium>(box1, 0.01, Color(0,0,0)));
-    world.add(make_shared<ConstantMedium>(box2, 0.01, Color(1,1,1)));
+    AABB cloud(point4(300,0,100), point4(500,330,300));
+    world.add(make_scene_shared<GridMedium>(voxel_file, nx, ny, nz, cloud, 0.05, Color(.8,.8,.9)));
 
     Camera cam;
 
@@ -394,12 +508,12 @@ Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
 
     cam.defocus_angle = 0;
 
-    cam.render(world, lights);
+    cam.render(world);
 }
 
 void final_scene(int image_width, int samples_per_pixel, int max_depth) {
     HittableList boxes1;
-    auto ground = make_shared<Lambertian>(Color(0.48, 0.83, 0.53));
+    auto ground = make_scene_shared<Lambertian>(Color(0.48, 0.83, 0.53));
 
     int boxes_per_side = 20;
     for (int i = 0; i < boxes_per_side; i++) {
@@ -417,49 +531,45 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
     }
 
     HittableList world;
-auto empty_mat = shared_ptr<Material>();
-Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
-
-
-    world.add(make_shared<BVH_node>(boxes1));
+    world.add(make_scene_shared<SBVH>(boxes1));
 
-    auto light = make_shared<DiffuseLight>(Color(7, 7, 7));
-    world.add(make_shared<Quad>(point4(123,554,147), vec4(300,0,0), vec4(0,0,265), light));
+    auto light = make_scene_shared<DiffuseLight>(Color(7, 7, 7));
+    world.add(make_scene_shared<Quad>(point4(123,554,147), vec4(300,0,0), vec4(0,0,265), light));
 
     auto center1 = point4(400, 400, 200);
     auto center2 = center1 + vec4(30,0,0);
-    auto sphere_material = make_shared<Lambertian>(Color(0.7, 0.3, 0.1));
-    world.add(make_shared<Sphere>(center1, center2, 50, sphere_material));
+    auto sphere_material = make_scene_shared<Lambertian>(Color(0.7, 0.3, 0.1));
+    world.add(make_scene_shared<Sphere>(center1, center2, 50, sphere_material));
 
-    world.add(make_shared<Sphere>(point4(260, 150, 45), 50, make_shared<Dielectric>(1.5)));
-    world.add(make_shared<Sphere>(
-        point4(0, 150, 145), 50, make_shared<Metal>(Color(0.8, 0.8, 0.9), 1.0)
+    world.add(make_scene_shared<Sphere>(point4(260, 150, 45), 50, make_scene_shared<Dielectric>(1.5)));
+    world.add(make_scene_shared<Sphere>(
+        point4(0, 150, 145), 50, make_scene_shared<Metal>(Color(0.8, 0.8, 0.9), 1.0)
     ));
 
-    auto boundary = make_shared<Sphere>(point4(360,150,145), 70, make_shared<Dielectric>(1.5));
+    auto boundary = make_scene_shared<Sphere>(point4(360,150,145), 70, make_scene_shared<Dielectric>(1.5));
     world.add(boundary);
-    world.add(make_shared<ConstantMedium>(boundary, 0.2, Color(0.2, 0.4, 0.9)));
-    boundary = make_shared<Sphere>(point4(0,0,0), 5000, make_shared<Dielectric>(1.5));
-    world.add(make_shared<ConstantMedium>(boundary, .0001, Color(1,1,1)));
+    world.add(make_scene_shared<ConstantMedium>(boundary, 0.2, Color(0.2, 0.4, 0.9)));
+    boundary = make_scene_shared<Sphere>(point4(0,0,0), 5000, make_scene_shared<Dielectric>(1.5));
+    world.add(make_scene_shared<ConstantMedium>(boundary, .0001, Color(1,1,1)));
 
-    auto emat = make_shared<Lambertian>(make_shared<ImageTexture>("src/earthmap.jpg"));
-    world.add(make_shared<Sphere>(point4(400,200,400), 100, emat));
-    auto pertext = make_shared<NoiseTexture>(0.2);
-    world.add(make_shared<Sphere>(point4(220,280,300), 80, make_shared<Lambertian>(pertext)));
+    auto emat = make_scene_shared<Lambertian>(make_scene_shared<ImageTexture>("src/earthmap.jpg"));
+    world.add(make_scene_shared<Sphere>(point4(400,200,400), 100, emat));
+    auto pertext = make_scene_shared<NoiseTexture>(0.2);
+    world.add(make_scene_shared<Sphere>(point4(220,280,300), 80, make_scene_shared<Lambertian>(pertext)));
 
-    HittableList boxes2;
-    auto white = make_shared<Lambertian>(Color(.73, .73, .73));
+    auto boxes2 = make_scene_shared<SpherePool>();
+    auto white = make_scene_shared<Lambertian>(Color(.73, .73, .73));
     int ns = 1000;
     for (int j = 0; j < ns; j++) {
-        boxes2.add(make_shared<Sphere>(point4::random(0,165), 10, white));
+        boxes2->add(point4::random(0,165), 10, white);
     }
+    boxes2->build();
 
-    world.add(make_shared<Translate>(
-        make_shared<Rotate_y>(
-            make_shared<BVH_node>(boxes2), 15),
-            vec4(-100,270,395)
-        )
-    );
+    // one matrix instead of Translate(Rotate_y(...))
+    world.add(translated(rotated(boxes2, 15, Y), vec4(-100,270,395)));
+
+    // flattens boxes1 into the same tree as everything else
+    world = HittableList(make_scene_shared<CompiledScene>(world));
 
     Camera cam;
 
@@ -476,7 +586,24 @@ Quad lights(point4(343,554,332), vec4(-130,0,0), vec4(0,0,-105), empty_mat);
 
     cam.defocus_angle = 0;
 
-    cam.render(world, lights);
+    cam.render(world);
+}
+
+void environment_map(const char* filename) {
+    HittableList world;
+
+    auto checker = make_scene_shared<CheckeredTexture>(0.32, Color(.2,.3,.1), Color(.9,.9,.9));
+    world.add(make_scene_shared<Sphere>(point4(0,-1000,0), 1000, make_scene_shared<Lambertian>(checker)));
+    world.add(make_scene_shared<Sphere>(point4(-4,1,0), 1.0, make_scene_shared<Lambertian>(Color(0.4, 0.2, 0.1))));
+    world.add(make_scene_shared<Sphere>(point4(0,1,0), 1.0, make_scene_shared<Dielectric>(1.5)));
+    world.add(make_scene_shared<Sphere>(point4(4,1,0), 1.0, make_scene_shared<Metal>(Color(0.7, 0.6, 0.5), 0.1)));
+
+    Camera cam;
+    set_camera_settings(cam);
+    // lit only by the map; the sun in it is sampled directly
+    cam.environment = make_scene_shared<EnvironmentLight>(filename);
+
+    cam.render(world);
 }
 
 int main() {
@@ -509,6 +636,15 @@ int main() {
         case 9: // part 2 final render
             final_scene(500, 300, 8);
             break;
+        case 10:
+            mesh_model("src/model.obj"); // or a binary .ply; see MeshStorage
+            break;
+        case 11:
+            environment_map("src/sky.hdr"); // any equirectangular .hdr (or LDR) map
+            break;
+        case 12:
+            cornell_clouds("src/cloud.raw", 128, 128, 128); // raw floats, x fastest
+            break;
         default:
             std::cout << "Loading debug spheres...\n";
             debug_spheres();